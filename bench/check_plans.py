@@ -0,0 +1,134 @@
+"""Query plan check for the report and listing queries.
+
+Migrates a scratch database with migrate_db.sh (or opens --db), runs EXPLAIN QUERY PLAN on the SQL
+that report spend, report budget, transaction list and transaction search prepare, and exits with
+status 1 if any of them reads transactions or monthly_rollup with a SCAN instead of a SEARCH of an
+index, so a schema or query change cannot silently turn a report into a full table scan:
+
+    python3 bench/check_plans.py
+    python3 bench/check_plans.py --db=budget.db --verbose
+
+The SQL below mirrors the statements built in report.c and budget_tracker.c; keep them in step.
+"""
+
+import argparse
+import os
+import re
+import shutil
+import sqlite3
+import subprocess
+import sys
+import tempfile
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# Tables that must only be read through an index; "t" is the alias both are given in joins
+INDEXED_TABLES = re.compile(r"^SCAN (transactions|monthly_rollup|t)( |$)")
+
+EXCLUDE = " AND t.category_id NOT IN (1, 4)"
+SPEND_TABLE = ("SELECT %s, SUM(t.cents) FROM transactions t JOIN categories c ON t.category_id = c.id "
+               "WHERE t.day >= ?1 AND t.day < ?2%s GROUP BY %s ORDER BY %s;")
+SPEND_ROLLUP = ("SELECT %s, SUM(t.total_cents) FROM monthly_rollup t JOIN categories c ON t.category_id = c.id "
+                "WHERE t.month >= ?1 AND t.month <= ?2%s GROUP BY %s ORDER BY %s;")
+LISTING = ("SELECT t.day, t.cents, t.description, c.label, t.category_id, t.id FROM transactions t "
+           "JOIN categories c ON t.category_id = c.id "
+           "WHERE t.day BETWEEN ?1 AND ?2 AND (t.day > ?1 OR t.id > ?3) %s ORDER BY t.day, t.id LIMIT ?4;")
+RANGE_TOTAL = ("SELECT (SELECT IFNULL(SUM(t.cents), 0) FROM transactions t JOIN categories c ON t.category_id = c.id "
+               "WHERE t.day >= ?1 AND t.day < ?2 %s) + "
+               "(SELECT IFNULL(SUM(t.total_cents), 0) FROM monthly_rollup t JOIN categories c ON t.category_id = c.id "
+               "WHERE t.month >= ?3 AND t.month <= ?4 AND ?2 < ?5 %s) + "
+               "(SELECT IFNULL(SUM(t.cents), 0) FROM transactions t JOIN categories c ON t.category_id = c.id "
+               "WHERE t.day >= ?5 AND t.day <= ?6 %s);")
+SEARCH_FROM = {
+    "fts": "FROM transactions_fts JOIN transactions t ON t.id = transactions_fts.rowid "
+           "JOIN categories c ON t.category_id = c.id WHERE transactions_fts MATCH ?5 AND t.day BETWEEN ?1 AND ?2",
+    "like": "FROM transactions t JOIN categories c ON t.category_id = c.id "
+            "WHERE (t.description LIKE '%uber%') AND t.day BETWEEN ?1 AND ?2",
+}
+
+
+def spend(template, dimensions, exclude=""):
+    """A spend_sql query grouped by the given (expression) dimensions."""
+    columns = ", ".join("%s AS d%d" % (expression, i) for i, expression in enumerate(dimensions))
+    names = ", ".join("d%d" % i for i in range(len(dimensions)))
+    return template % (columns, exclude, names, names)
+
+
+def queries():
+    """(name, sql) of every query whose plan is checked."""
+    year = "strftime('%Y', t.day * 86400, 'unixepoch')"
+    month = "strftime('%Y-%m', t.day * 86400, 'unixepoch')"
+    week = "date((t.day - (t.day % 7 + 10) % 7) * 86400, 'unixepoch')"
+    cases = [
+        ("report spend", spend(SPEND_TABLE, ["c.label"])),
+        ("report spend monthly", spend(SPEND_TABLE, [month, "c.label"])),
+        ("report spend yearly exclude", spend(SPEND_TABLE, [year, "c.label"], EXCLUDE)),
+        ("report spend week,category", spend(SPEND_TABLE, [week, "c.label"])),
+        ("report spend rollup", spend(SPEND_ROLLUP, ["c.label"])),
+        ("report spend rollup yearly", spend(SPEND_ROLLUP, ["substr(t.month, 1, 4)", "c.label"])),
+        ("report spend rollup monthly exclude", spend(SPEND_ROLLUP, ["t.month", "c.label"], EXCLUDE)),
+        ("report spend vector", "SELECT day, category_id, cents FROM transactions WHERE day >= ?1 AND day < ?2;"),
+        ("report budget year", "SELECT SUM(total_cents) / 100.0 FROM monthly_rollup WHERE month >= ? AND month < ?;"),
+        ("report budget year exclude", "SELECT SUM(total_cents) / 100.0 FROM monthly_rollup WHERE month >= ? "
+                                       "AND month < ? AND category_id <> 0 AND category_id NOT IN (2, 3);"),
+        ("report budget month", "SELECT SUM(total_cents) / 100.0 FROM monthly_rollup WHERE month = ?;"),
+        ("report budget year monthly", "SELECT month, SUM(total_cents) FROM monthly_rollup WHERE month >= ? "
+                                       "AND month < ? GROUP BY month;"),
+        ("transaction list", LISTING % ""),
+        ("transaction list exclude", LISTING % EXCLUDE),
+        ("transaction list total", RANGE_TOTAL % ("", "", "")),
+    ]
+    for engine, source in SEARCH_FROM.items():
+        cases.append(("transaction search %s" % engine, "SELECT t.day, t.cents, t.description, c.label, t.category_id, "
+                      "t.id %s AND (t.day > ?1 OR t.id > ?3) ORDER BY t.day, t.id LIMIT ?4;" % source))
+        cases.append(("transaction search %s total" % engine, "SELECT IFNULL(SUM(t.cents), 0) %s;" % source))
+    return cases
+
+
+def parameter_count(sql):
+    numbered = [int(n) for n in re.findall(r"\?(\d+)", sql)]
+    return max(numbered) if numbered else sql.count("?")
+
+
+def check(db, verbose):
+    """Print the plan of every query; return the names of those that scan an indexed table."""
+    failed = []
+    with sqlite3.connect("file:%s?mode=ro" % db, uri=True) as conn:
+        for name, sql in queries():
+            plan = [row[3] for row in conn.execute("EXPLAIN QUERY PLAN " + sql, [None] * parameter_count(sql))]
+            scans = [step for step in plan if INDEXED_TABLES.match(step)]
+            print("%-4s %s" % ("FAIL" if scans else "ok", name))
+            if scans or verbose:
+                for step in plan:
+                    print("       " + step)
+            if scans:
+                failed.append(name)
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--db", help="check this database instead of a freshly migrated one")
+    parser.add_argument("--verbose", action="store_true", help="print every plan, not only failing ones")
+    args = parser.parse_args()
+
+    scratch = None
+    db = args.db
+    if not db:
+        scratch = tempfile.mkdtemp(prefix="check_plans-")
+        db = os.path.join(scratch, "plans.db")
+        subprocess.run(["sh", os.path.join(os.path.dirname(BENCH_DIR), "migrate_db.sh"), "--db=" + db], check=True,
+                       stdout=subprocess.DEVNULL)
+    try:
+        failed = check(db, args.verbose)
+    finally:
+        if scratch:
+            shutil.rmtree(scratch)
+    if failed:
+        print("%d of %d queries scan transactions or monthly_rollup instead of searching an index"
+              % (len(failed), len(queries())), file=sys.stderr)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,278 @@
+"""Synthetic ledger generator for the benchmarks.
+
+Writes bank-style CSV statements and pre-populated budget.db files of any size. Spending follows
+a Zipf-like merchant distribution: a few chains (grocery stores, coffee shops, fuel) account for
+most transactions and a long tail of local merchants for the rest, as in real statements. Output
+is fully determined by --rows and --seed.
+
+    python3 bench/gen_ledger.py --rows=1m --csv=statement.csv
+    python3 bench/gen_ledger.py --rows=1m --db=ledger.db
+"""
+
+import argparse
+import csv
+import datetime
+import os
+import random
+import sqlite3
+import subprocess
+import sys
+
+# Bump when the generated data changes, so cached datasets are rebuilt
+GENERATOR_VERSION = 2
+
+REPO_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# label, description, median charge in dollars, spread (sigma of the log-normal)
+CATEGORIES = [
+    ("Groceries", "Supermarkets and grocery stores", 62.0, 0.6),
+    ("Dining", "Restaurants, bars and food delivery", 28.0, 0.5),
+    ("Coffee", "Coffee shops and cafes", 6.5, 0.3),
+    ("Transport", "Fuel, rideshare, transit and parking", 24.0, 0.7),
+    ("Utilities", "Electricity, water, internet and phone bills", 95.0, 0.4),
+    ("Rent", "Rent and mortgage payments", 1850.0, 0.05),
+    ("Shopping", "Online and department store purchases", 45.0, 0.9),
+    ("Entertainment", "Movies, concerts, games and events", 32.0, 0.6),
+    ("Subscription", "Streaming and software subscriptions", 13.0, 0.4),
+    ("Health", "Pharmacies, doctors and fitness", 38.0, 0.8),
+    ("Travel", "Airlines, hotels and car rental", 310.0, 0.8),
+    ("Income", "Payroll deposits and refunds", 2600.0, 0.1),  # Credits, in statements only
+]
+
+# Chains, most frequent first; the share of the rest falls off as 1 / rank
+CHAINS = [
+    ("STARBUCKS STORE", "Coffee"),
+    ("AMAZON MKTP US", "Shopping"),
+    ("SAFEWAY", "Groceries"),
+    ("SHELL OIL", "Transport"),
+    ("UBER TRIP", "Transport"),
+    ("TRADER JOE S", "Groceries"),
+    ("CHIPOTLE", "Dining"),
+    ("WHOLEFDS MKT", "Groceries"),
+    ("DOORDASH", "Dining"),
+    ("WALGREENS", "Health"),
+    ("TARGET", "Shopping"),
+    ("COSTCO WHSE", "Groceries"),
+    ("PEETS COFFEE", "Coffee"),
+    ("CHEVRON", "Transport"),
+    ("NETFLIX.COM", "Subscription"),
+    ("SPOTIFY USA", "Subscription"),
+    ("CVS PHARMACY", "Health"),
+    ("LYFT RIDE", "Transport"),
+    ("MCDONALDS", "Dining"),
+    ("PG&E WEB ONLINE", "Utilities"),
+    ("COMCAST CABLE", "Utilities"),
+    ("VERIZON WIRELESS", "Utilities"),
+    ("AMC THEATRES", "Entertainment"),
+    ("TICKETMASTER", "Entertainment"),
+    ("STEAM PURCHASE", "Entertainment"),
+    ("UNITED AIRLINES", "Travel"),
+    ("MARRIOTT HOTEL", "Travel"),
+    ("HERTZ RENT A CAR", "Travel"),
+    ("24 HOUR FITNESS", "Health"),
+    ("APPLE.COM BILL", "Subscription"),
+]
+
+TAIL_WORDS = ["BLUE", "OAK", "MAIN ST", "CORNER", "GOLDEN", "RIVER", "SUNSET", "HARBOR", "MISSION", "PARK",
+              "VALLEY", "CITY", "NORTH", "UNION", "MARKET", "HILL", "BAY", "LUCKY", "GREEN", "STAR"]
+TAIL_KINDS = [("DELI", "Dining"), ("BISTRO", "Dining"), ("TAQUERIA", "Dining"), ("CAFE", "Coffee"),
+              ("MARKET", "Groceries"), ("HARDWARE", "Shopping"), ("BOOKS", "Shopping"), ("PHARMACY", "Health"),
+              ("PARKING", "Transport"), ("CINEMA", "Entertainment"), ("SALON", "Shopping"), ("GAS", "Transport")]
+CITIES = ["SAN FRANCISCO CA", "OAKLAND CA", "SEATTLE WA", "PORTLAND OR", "AUSTIN TX", "DENVER CO"]
+
+# Merchants in the long tail of local businesses
+TAIL_MERCHANTS = 2000
+# Share of rows that are monthly rent, and of rows that are payroll deposits
+RENT_SHARE = 0.004
+INCOME_SHARE = 0.008
+
+# Pre-populated databases span these years
+FIRST_YEAR = 2015
+LAST_YEAR = 2024
+
+
+def parse_rows(text):
+    """Parse a row count such as 10000, 10k, 1m or 10M."""
+    text = text.strip().lower()
+    scale = {"k": 1000, "m": 1000000}.get(text[-1:], 1)
+    return int(float(text[:-1] if scale > 1 else text) * scale)
+
+
+def merchants(seed):
+    """The merchant table as (name, category label, weight), most frequent first."""
+    rng = random.Random(seed)
+    table = list(CHAINS)
+    for i in range(TAIL_MERCHANTS):
+        kind, label = rng.choice(TAIL_KINDS)
+        table.append(("%s %s %s" % (rng.choice(TAIL_WORDS), rng.choice(TAIL_WORDS), kind), label))
+    return [(name, label, 1.0 / (rank + 1)) for rank, (name, label) in enumerate(table)]
+
+
+def category_of(description, table):
+    """The category label of a generated description, as a perfect classifier would answer."""
+    description = description.upper()
+    for name, label, _ in table:
+        if description.startswith(name):
+            return label
+    if description.startswith("PAYROLL"):
+        return "Income"
+    if description.startswith("RENT"):
+        return "Rent"
+    return "Other"
+
+
+class Ledger:
+    """Deterministic stream of (day, cents, description, label) rows in date order."""
+
+    def __init__(self, rows, seed, first_year=FIRST_YEAR, last_year=LAST_YEAR):
+        self.rows = rows
+        self.rng = random.Random(seed)
+        self.table = merchants(seed)
+        self.names = [m[0] for m in self.table]
+        self.cumulative = []
+        total = 0.0
+        for _, _, weight in self.table:
+            total += weight
+            self.cumulative.append(total)
+        self.pricing = {label: (median, sigma) for label, _, median, sigma in CATEGORIES}
+        epoch = datetime.date(1970, 1, 1)
+        self.first_day = (datetime.date(first_year, 1, 1) - epoch).days
+        self.span = (datetime.date(last_year, 12, 31) - epoch).days - self.first_day + 1
+
+    def __iter__(self):
+        rng = self.rng
+        labels = dict((m[0], m[1]) for m in self.table)
+        # Rows of one day are kept distinct, since import drops repeated (date, amount, description) rows
+        today, seen = None, set()
+        for i in range(self.rows):
+            day = self.first_day + i * self.span // self.rows
+            if day != today:
+                today, seen = day, set()
+            roll = rng.random()
+            if roll < INCOME_SHARE:
+                label, description = "Income", "PAYROLL DEPOSIT ACME CORP"
+            elif roll < INCOME_SHARE + RENT_SHARE:
+                label, description = "Rent", "RENT PAYMENT PROPERTY MGMT"
+            else:
+                name = rng.choices(self.names, cum_weights=self.cumulative)[0]
+                label = labels[name]
+                # Store numbers vary, as on real statements; the classification cache ignores them
+                description = "%s #%04d %s" % (name, rng.randrange(40), rng.choice(CITIES))
+            median, sigma = self.pricing[label]
+            cents = max(1, int(round(rng.lognormvariate(0, sigma) * median * 100)))
+            while (cents, description) in seen:
+                cents += 1
+            seen.add((cents, description))
+            yield day, cents if label == "Income" else -cents, description, label
+
+
+def format_day(day, fmt):
+    return (datetime.date(1970, 1, 1) + datetime.timedelta(days=day)).strftime(fmt)
+
+
+def write_csv(path, rows, seed):
+    """Write a Wells Fargo style statement: "date","amount","*","","description", no header."""
+    with open(path, "w", newline="") as f:
+        writer = csv.writer(f, quoting=csv.QUOTE_ALL)
+        for day, cents, description, _ in Ledger(rows, seed):
+            sign = "-" if cents < 0 else ""
+            writer.writerow([format_day(day, "%m/%d/%Y"), "%s%d.%02d" % (sign, abs(cents) // 100, abs(cents) % 100),
+                             "*", "", description])
+
+
+def fingerprint(day, cents, description):
+    """transaction_fingerprint from import.c: FNV-1a of the date, the cents and the normalized description."""
+    h = 14695981039346656037
+    data = format_day(day, "%Y-%m-%d").encode() + b"\0" + (cents & 0xFFFFFFFFFFFFFFFF).to_bytes(8, sys.byteorder)
+    data += " ".join(description.split()).upper().encode()
+    for byte in data:
+        h = ((h ^ byte) * 1099511628211) & 0xFFFFFFFFFFFFFFFF
+    return h - (1 << 64) if h >= 1 << 63 else h
+
+
+def create_db(path, rows, seed, binary=None):
+    """Create a migrated budget.db holding the categories, yearly budgets and the debits of rows transactions.
+
+    The schema comes from migrate_db.sh, so the database matches what the application creates.
+    Indexes and the rollup and search triggers are dropped during the bulk insert and rebuilt afterwards.
+    Fingerprints are computed here, or by an import of an empty statement when a budget_tracker
+    binary is given, which is an order of magnitude faster.
+    """
+    if os.path.exists(path):
+        os.remove(path)
+    subprocess.run(["sh", os.path.join(REPO_DIR, "migrate_db.sh"), "--db=" + path], check=True,
+                   stdout=subprocess.DEVNULL)
+    db = sqlite3.connect(path, isolation_level=None)
+    db.execute("PRAGMA journal_mode = OFF")
+    db.execute("PRAGMA synchronous = OFF")
+    for label, description, _, _ in CATEGORIES:
+        db.execute("INSERT OR IGNORE INTO categories (label, description) VALUES (?, ?)", (label, description))
+    ids = dict(db.execute("SELECT label, id FROM categories"))
+    table = merchants(seed)
+    for label in ids:
+        examples = [name for name, of, _ in table[:len(CHAINS)] if of == label][:3]
+        for example in examples:
+            db.execute("INSERT INTO category_examples (category_id, example) VALUES (?, ?)", (ids[label], example))
+
+    # Imported rows record the category-set version that labelled them
+    version = db.execute("SELECT version FROM category_set").fetchone()[0]
+
+    saved = db.execute("SELECT type, name, sql FROM sqlite_master WHERE tbl_name = 'transactions' "
+                       "AND type IN ('index', 'trigger') AND sql IS NOT NULL").fetchall()
+    for kind, name, _ in saved:
+        db.execute("DROP %s %s" % (kind.upper(), name))
+    yearly = {}
+
+    def records():
+        for day, cents, description, label in Ledger(rows, seed):
+            # Import skips credits, so a populated database holds only the debits
+            if cents > 0:
+                continue
+            year = int(format_day(day, "%Y"))
+            yearly[year] = yearly.get(year, 0) + cents
+            yield (day, cents, description, ids[label], None if binary else fingerprint(day, cents, description), version)
+
+    db.execute("BEGIN")
+    db.executemany("INSERT INTO transactions (day, cents, description, category_id, fingerprint, category_version) "
+                   "VALUES (?, ?, ?, ?, ?, ?)", records())
+    db.execute("DELETE FROM monthly_rollup")
+    db.execute("INSERT INTO monthly_rollup (month, category_id, total_cents, count) "
+               "SELECT IFNULL(strftime('%Y-%m', day * 86400, 'unixepoch'), ''), IFNULL(category_id, 0), SUM(cents), COUNT(*) "
+               "FROM transactions GROUP BY 1, 2")
+    for _, _, sql in saved:
+        db.execute(sql)
+    db.execute("INSERT INTO transactions_fts (transactions_fts) VALUES ('rebuild')")
+    # A budget a little under each year's spending, so reports show both over- and under-spent months
+    for year, cents in yearly.items():
+        db.execute("INSERT OR REPLACE INTO budgets (year, amount) VALUES (?, ?)", (year, round(-cents * 0.9 / 100, 2)))
+    db.execute("COMMIT")
+    db.execute("ANALYZE")
+    db.close()
+    if binary:
+        empty = path + ".empty.csv"
+        open(empty, "w").close()
+        try:
+            subprocess.run([binary, "--db=" + path, "import", "--csv=" + empty], check=True, stdout=subprocess.DEVNULL)
+        finally:
+            os.remove(empty)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rows", default="10k", help="number of transactions, e.g. 10k, 1m or 10m (default 10k)")
+    parser.add_argument("--seed", type=int, default=1, help="random seed (default 1)")
+    parser.add_argument("--csv", help="write a Wells Fargo style CSV statement to this path")
+    parser.add_argument("--db", help="write a migrated, pre-populated database to this path")
+    parser.add_argument("--binary", help="budget_tracker build used to fingerprint the rows of --db quickly")
+    args = parser.parse_args()
+    if not args.csv and not args.db:
+        parser.error("nothing to do: pass --csv and/or --db")
+    rows = parse_rows(args.rows)
+    if args.csv:
+        write_csv(args.csv, rows, args.seed)
+    if args.db:
+        create_db(args.db, rows, args.seed, args.binary)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,107 @@
+"""Local stand-in for the chat completions API, for benchmarking imports without network or cost.
+
+Answers the single and batched classification prompts that category.c sends, labelling each
+generated description with its merchant's category, after an injectable delay. A fraction of
+requests can be failed with 429 to exercise the retry path. GET /stats returns the request
+counters as JSON.
+
+    python3 bench/mock_classifier.py --port=8089 --latency-ms=200 --jitter-ms=50
+    ./budget_tracker import --csv=statement.csv --classifier-url=http://127.0.0.1:8089/v1/chat/completions
+"""
+
+import argparse
+import json
+import random
+import re
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+from gen_ledger import category_of, merchants
+
+SINGLE = re.compile(r'classify this transaction:\n"(.*)"\n', re.S)
+NUMBERED = re.compile(r'^(\d+)\. "(.*)"$', re.M)
+
+
+class Classifier(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, status, body, headers=()):
+        data = json.dumps(body).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        for name, value in headers:
+            self.send_header(name, value)
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_GET(self):
+        if self.path != "/stats":
+            self.reply(404, {"error": "not found"})
+            return
+        with self.server.lock:
+            self.reply(200, dict(self.server.stats))
+
+    def do_POST(self):
+        request = json.loads(self.rfile.read(int(self.headers.get("Content-Length", 0))))
+        options = self.server.options
+        with self.server.lock:
+            self.server.stats["requests"] += 1
+        delay = max(0.0, options.latency_ms + random.uniform(-options.jitter_ms, options.jitter_ms)) / 1000
+        time.sleep(delay)
+        if random.random() < options.error_rate:
+            with self.server.lock:
+                self.server.stats["throttled"] += 1
+            self.reply(429, {"error": {"message": "Rate limit reached"}}, [("Retry-After", "1")])
+            return
+
+        prompt = " ".join(message.get("content", "") for message in request.get("messages", []))
+        table = self.server.table
+        if request.get("response_format"):
+            items = NUMBERED.findall(prompt)
+            content = json.dumps({number: category_of(description, table) for number, description in items})
+        else:
+            match = SINGLE.search(prompt)
+            items = [match.group(1)] if match else []
+            content = category_of(items[0], table) if items else "Other"
+        with self.server.lock:
+            self.server.stats["classified"] += len(items)
+        self.reply(200, {"choices": [{"message": {"role": "assistant", "content": content}}]})
+
+
+def start(port=0, latency_ms=0.0, jitter_ms=0.0, error_rate=0.0, seed=1):
+    """Start the mock in a background thread and return the server; its port is server.server_port."""
+    options = argparse.Namespace(latency_ms=latency_ms, jitter_ms=jitter_ms, error_rate=error_rate)
+    server = ThreadingHTTPServer(("127.0.0.1", port), Classifier)
+    server.daemon_threads = True
+    server.options = options
+    server.table = merchants(seed)
+    server.lock = threading.Lock()
+    server.stats = {"requests": 0, "throttled": 0, "classified": 0}
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=8089, help="port to listen on, 0 for any (default 8089)")
+    parser.add_argument("--latency-ms", type=float, default=0, help="delay before each reply (default 0)")
+    parser.add_argument("--jitter-ms", type=float, default=0, help="random +/- variation of the delay (default 0)")
+    parser.add_argument("--error-rate", type=float, default=0, help="fraction of requests answered 429 (default 0)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated ledger (default 1)")
+    args = parser.parse_args()
+    server = start(args.port, args.latency_ms, args.jitter_ms, args.error_rate, args.seed)
+    print("http://127.0.0.1:%d/v1/chat/completions" % server.server_port, flush=True)
+    try:
+        threading.Event().wait()
+    except KeyboardInterrupt:
+        sys.exit(0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,306 @@
+"""Benchmark driver for budget_tracker.
+
+Runs import (against the mock classifier), transaction list in every output format, transaction
+search through the full-text index and as a LIKE scan, and every report variant over generated
+ledgers, and writes the timings as JSON so runs can be compared:
+
+    python3 bench/run_bench.py --binary=./budget_tracker --sizes=10k,1m --output=after.json
+    python3 bench/run_bench.py compare before.json after.json
+
+Datasets are generated once per size and seed into --work-dir and reused by later runs.
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import shutil
+import socket
+import sqlite3
+import statistics
+import subprocess
+import sys
+import time
+
+import gen_ledger
+import mock_classifier
+
+RESULTS_VERSION = 1
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def migrate(db):
+    subprocess.run(["sh", os.path.join(os.path.dirname(BENCH_DIR), "migrate_db.sh"), "--db=" + db], check=True,
+                   stdout=subprocess.DEVNULL)
+
+
+def dataset(work_dir, size, seed, binary, kind):
+    """Path of a generated CSV statement or database, generating it on first use.
+
+    A database generated before a schema change is migrated, so its indexes match the binary's queries.
+    """
+    name = "ledger-v%d-%s-seed%d.%s" % (gen_ledger.GENERATOR_VERSION, size, seed, kind)
+    path = os.path.join(work_dir, name)
+    if not os.path.exists(path):
+        print("Generating %s" % name, file=sys.stderr)
+        partial = path + ".partial"
+        rows = gen_ledger.parse_rows(size)
+        if kind == "csv":
+            gen_ledger.write_csv(partial, rows, seed)
+        else:
+            gen_ledger.create_db(partial, rows, seed, binary)
+        os.rename(partial, path)
+    elif kind == "db":
+        migrate(path)
+    return path
+
+
+def cursor(db, start, end):
+    """The transaction list cursor of the row halfway through a date range, for benchmarking a deep page."""
+    with sqlite3.connect(db) as conn:
+        first, last = ((datetime.date.fromisoformat(d) - datetime.date(1970, 1, 1)).days for d in (start, end))
+        count = conn.execute("SELECT COUNT(*) FROM transactions WHERE day BETWEEN ? AND ?", (first, last)).fetchone()[0]
+        row = conn.execute("SELECT day, id FROM transactions WHERE day BETWEEN ? AND ? ORDER BY day, id LIMIT 1 OFFSET ?",
+                           (first, last, count // 2)).fetchone()
+    day, row_id = row or (first, 0)
+    return "%08x%016x" % ((day & 0xffffffff) ^ 0x80000000, row_id)
+
+
+def run(command, stdout_path):
+    """Run a command once; return its wall time, CPU time, peak RSS, output size and exit status."""
+    stderr_path = stdout_path + ".err"
+    with open(stdout_path, "wb") as out, open(stderr_path, "wb") as err:
+        started = time.perf_counter()
+        process = subprocess.Popen(command, stdout=out, stderr=err)
+        # wait4 gives the resource usage of this child alone
+        _, status, usage = os.wait4(process.pid, 0)
+        wall = time.perf_counter() - started
+    with open(stderr_path, "rb") as err:
+        stderr = err.read()
+    return {
+        "wall_ms": wall * 1000,
+        "cpu_ms": (usage.ru_utime + usage.ru_stime) * 1000,
+        "max_rss_kb": usage.ru_maxrss,
+        "output_bytes": os.path.getsize(stdout_path),
+        "exit_status": os.waitstatus_to_exitcode(status),
+        "stderr": stderr.decode(errors="replace")[-500:],
+    }
+
+
+def summarize(name, size, command, samples, extra=None):
+    walls = [s["wall_ms"] for s in samples]
+    result = {
+        "name": name,
+        "size": size,
+        "command": command,
+        "runs": len(samples),
+        "wall_ms": {
+            "min": min(walls),
+            "median": statistics.median(walls),
+            "mean": statistics.mean(walls),
+            "max": max(walls),
+            "stdev": statistics.stdev(walls) if len(walls) > 1 else 0.0,
+        },
+        "cpu_ms_median": statistics.median(s["cpu_ms"] for s in samples),
+        "max_rss_kb": max(s["max_rss_kb"] for s in samples),
+        "output_bytes": samples[-1]["output_bytes"],
+        "exit_status": max((s["exit_status"] for s in samples), key=abs),
+    }
+    failed = [s["stderr"] for s in samples if s["exit_status"] != 0]
+    if failed:
+        result["stderr"] = failed[-1]
+    result.update(extra or {})
+    return result
+
+
+def query_cases(db):
+    """(name, arguments) of every query benchmarked against the populated database db."""
+    year = "--date-start=2023-01-01", "--date-end=2023-12-31"
+    partial = "--date-start=2023-03-05", "--date-end=2023-09-17"
+    decade = "--date-start=2015-01-01", "--date-end=2024-12-31"
+    cases = []
+    for fmt in ["table", "json", "ndjson", "yaml", "csv"]:
+        args = ["transaction", "list", "--start-date=2023-01-01", "--end-date=2023-12-31"]
+        cases.append(("transaction list -o%s" % fmt, args + ([] if fmt == "table" else ["-o" + fmt])))
+    cases.append(("transaction list excluded", ["transaction", "list", "--start-date=2023-01-01", "--end-date=2023-12-31",
+                                                "--excluded-categories=2,4"]))
+    pages = ["transaction", "list", "--start-date=2015-01-01", "--end-date=2024-12-31", "--limit=100", "-ojson"]
+    cases.append(("transaction list first page", pages))
+    cases.append(("transaction list middle page", pages + ["--after=" + cursor(db, "2015-01-01", "2024-12-31")]))
+    # The same searches through the full-text index and as a LIKE scan of the descriptions
+    for label, query in [("word", "uber"), ("phrase", '"verizon wireless" portl*'), ("rare", "starbucks 0012 oakland")]:
+        search = ["transaction", "search", "--query=" + query, "--start-date=2019-01-01", "--end-date=2024-12-31"]
+        cases.append(("transaction search %s" % label, search))
+        cases.append(("transaction search %s like" % label, search + ["--engine=like"]))
+        cases.append(("transaction search %s page" % label, search + ["--limit=100"]))
+    for label, dates in [("year", year), ("partial", partial), ("decade", decade)]:
+        spend = ["report", "spend"] + list(dates)
+        cases.append(("report spend %s" % label, spend))
+        cases.append(("report spend %s yearly" % label, spend + ["--agg=yearly"]))
+        cases.append(("report spend %s monthly" % label, spend + ["--agg=monthly"]))
+        cases.append(("report spend %s monthly -ojson" % label, spend + ["--agg=monthly", "-ojson"]))
+        cases.append(("report spend %s exclude" % label, spend + ["--exclude-categories=1,4"]))
+        cases.append(("report spend %s week,category" % label, spend + ["--group-by=week,category"]))
+        cases.append(("report spend %s monthly vector" % label, spend + ["--agg=monthly", "--engine=vector"]))
+    cases.append(("report budget year", ["report", "budget", "--year=2023"]))
+    cases.append(("report budget year exclude", ["report", "budget", "--year=2023", "--exclude-categories=2,3"]))
+    cases.append(("report budget month", ["report", "budget", "--month=2023-06"]))
+    breakdown = ["report", "budget", "--year=2023", "--breakdown=monthly"]
+    cases.append(("report budget year monthly", breakdown))
+    cases.append(("report budget year monthly exclude", breakdown + ["--exclude-categories=2,3"]))
+    cases.append(("report budget year monthly -ojson", breakdown + ["-ojson"]))
+    return cases
+
+
+def bench_queries(args, size, results):
+    db = dataset(args.work_dir, size, args.seed, args.binary, "db")
+    out = os.path.join(args.work_dir, "output.txt")
+    for name, query in query_cases(db):
+        if args.only and not re.search(args.only, name):
+            continue
+        command = [args.binary, "--db=" + db] + query
+        run(command, out)  # Warm the page cache
+        samples = [run(command, out) for _ in range(args.runs)]
+        results.append(summarize(name, size, query, samples))
+        report(results[-1])
+
+
+def bench_import(args, size, results):
+    """Import a statement of size rows into a database holding only the categories."""
+    name = "import"
+    if args.only and not re.search(args.only, name):
+        return
+    statement = dataset(args.work_dir, size, args.seed, args.binary, "csv")
+    empty = dataset(args.work_dir, "0", args.seed, args.binary, "db")
+    db = os.path.join(args.work_dir, "import.db")
+    out = os.path.join(args.work_dir, "output.txt")
+    server = mock_classifier.start(latency_ms=args.latency_ms, jitter_ms=args.jitter_ms,
+                                   error_rate=args.error_rate, seed=args.seed)
+    url = "http://127.0.0.1:%d/v1/chat/completions" % server.server_port
+    query = ["import", "--csv=" + statement, "--classifier-url=" + url] + args.import_args
+    samples = []
+    for _ in range(args.runs):
+        # Every run starts from the same empty database, so the classification cache starts cold
+        shutil.copyfile(empty, db)
+        samples.append(run([args.binary, "--db=" + db] + query, out))
+    with server.lock:
+        stats = dict(server.stats)
+    server.shutdown()
+    server.server_close()
+    with sqlite3.connect(db) as conn:
+        rows = conn.execute("SELECT COUNT(*) FROM transactions").fetchone()[0]
+    extra = {
+        "rows_imported": rows,
+        "classifier": {
+            "latency_ms": args.latency_ms,
+            "jitter_ms": args.jitter_ms,
+            "error_rate": args.error_rate,
+            "requests_per_run": stats["requests"] / args.runs,
+            "throttled_per_run": stats["throttled"] / args.runs,
+        },
+    }
+    results.append(summarize(name, size, query, samples, extra))
+    report(results[-1])
+
+
+def report(result):
+    status = "" if result["exit_status"] == 0 else "  (exit %d)" % result["exit_status"]
+    print("%-6s %-42s %10.1f ms  %8d KB%s" % (result["size"], result["name"], result["wall_ms"]["median"],
+                                           result["max_rss_kb"], status), file=sys.stderr)
+
+
+def environment(binary):
+    git = ["git", "-C", os.path.dirname(BENCH_DIR)]
+    commit = subprocess.run(git + ["rev-parse", "HEAD"], capture_output=True, text=True).stdout.strip()
+    dirty = subprocess.run(git + ["status", "--porcelain", "--untracked-files=no"], capture_output=True, text=True).stdout
+    return {
+        "timestamp": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec="seconds"),
+        "commit": commit or None,
+        "dirty": bool(dirty.strip()),
+        "binary": os.path.abspath(binary),
+        "host": socket.gethostname(),
+        "platform": platform.platform(),
+        "machine": platform.machine(),
+        "cpus": os.cpu_count(),
+        "python": platform.python_version(),
+        "sqlite": sqlite3.sqlite_version,
+    }
+
+
+def compare(base_path, new_path, threshold):
+    """Print the median wall time change of every case in both result files.
+
+    Returns 1 if any case got slower by more than threshold (a fraction), else 0.
+    """
+    with open(base_path) as f:
+        base = json.load(f)
+    with open(new_path) as f:
+        new = json.load(f)
+    before = {(r["size"], r["name"]): r for r in base["results"]}
+    regressed = 0
+    print("%-6s %-42s %12s %12s %8s" % ("Size", "Case", "Before ms", "After ms", "Change"))
+    for result in new["results"]:
+        old = before.get((result["size"], result["name"]))
+        if not old:
+            continue
+        a, b = old["wall_ms"]["median"], result["wall_ms"]["median"]
+        change = (b - a) / a if a else 0.0
+        flag = ""
+        if change > threshold:
+            flag = "  slower"
+            regressed = 1
+        print("%-6s %-42s %12.1f %12.1f %+7.1f%%%s" % (result["size"], result["name"], a, b, change * 100, flag))
+    return regressed
+
+
+def main():
+    if len(sys.argv) > 1 and sys.argv[1] == "compare":
+        parser = argparse.ArgumentParser(prog="run_bench.py compare",
+                                         description="Compare two result files; exit 1 on a regression.")
+        parser.add_argument("base")
+        parser.add_argument("new")
+        parser.add_argument("--threshold", type=float, default=0.10,
+                            help="median slowdown counted as a regression (default 0.10, i.e. 10%%)")
+        args = parser.parse_args(sys.argv[2:])
+        sys.exit(compare(args.base, args.new, args.threshold))
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default="./budget_tracker", help="budget_tracker build to measure")
+    parser.add_argument("--sizes", default="10k", help="comma-separated ledger sizes, e.g. 10k,1m,10m (default 10k)")
+    parser.add_argument("--runs", type=int, default=5, help="timed runs per case (default 5)")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the generated ledgers (default 1)")
+    parser.add_argument("--only", help="only run cases whose name matches this regular expression")
+    parser.add_argument("--work-dir", default=os.path.join(BENCH_DIR, "data"),
+                        help="where generated datasets are kept (default bench/data)")
+    parser.add_argument("--latency-ms", type=float, default=50, help="mock classifier delay per request (default 50)")
+    parser.add_argument("--jitter-ms", type=float, default=10, help="mock classifier delay variation (default 10)")
+    parser.add_argument("--error-rate", type=float, default=0, help="fraction of classifier requests failed with 429")
+    parser.add_argument("--import-arg", dest="import_args", action="append", default=[],
+                        help="extra import option, e.g. --import-arg=--jobs=4 (may be repeated)")
+    parser.add_argument("--output", help="write the JSON results here instead of standard output")
+    args = parser.parse_args()
+    if not os.access(args.binary, os.X_OK):
+        parser.error("%s is not an executable budget_tracker build" % args.binary)
+    os.makedirs(args.work_dir, exist_ok=True)
+
+    results = []
+    for size in args.sizes.split(","):
+        bench_import(args, size, results)
+        bench_queries(args, size, results)
+
+    document = {"version": RESULTS_VERSION, "environment": environment(args.binary), "runs": args.runs,
+                "seed": args.seed, "results": results}
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(document, f, indent=2)
+            f.write("\n")
+    else:
+        json.dump(document, sys.stdout, indent=2)
+        sys.stdout.write("\n")
+    sys.exit(1 if any(r["exit_status"] != 0 for r in results) else 0)
+
+
+if __name__ == "__main__":
+    main()
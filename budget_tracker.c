@@ -6,13 +6,21 @@
 #include <time.h>
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
 #include <regex.h>
 #include <json-c/json.h>
 
 #include <curl/curl.h>
 #include "report.h"
+#include "csv.h"
 #include "import.h"
 #include "category.h"
+#include "date.h"
+#include "db.h"
+#include "emit.h"
+#include "server.h"
+#include "snapshot.h"
+#include "metrics.h"
 
 /**
  * @brief Set the budget for a specific year.
@@ -24,117 +32,678 @@
  */
 void set_budget(int year, double amount) {
     printf("Setting budget for year %d with amount %.2f\n", year, amount);
-    sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("budget.db", &db);
+    sqlite3 *db = db_open();
+    if (!db) {
+        return;
+    }
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO budgets (year, amount) VALUES (?, ?) "
+                                    "ON CONFLICT(year) DO UPDATE SET amount=excluded.amount;");
+    if (!stmt) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
         return;
     }
+    sqlite3_bind_int(stmt, 1, year);
+    sqlite3_bind_double(stmt, 2, amount);
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    }
+    db_release(stmt);
+}
+
+/**
+ * @brief Format a transaction list cursor: the (day, id) of the last row of a page.
+ *
+ * The day is offset by 2^31 so cursors of negative days are still plain hex.
+ */
+static void cursor_format(int day, sqlite3_int64 id, char cursor[25]) {
+    snprintf(cursor, 25, "%08x%016llx", (unsigned)day ^ 0x80000000u, (unsigned long long)id);
+}
 
-    char *sql = sqlite3_mprintf("INSERT INTO budgets (year, amount) VALUES (%d, %f) "
-                                "ON CONFLICT(year) DO UPDATE SET amount=excluded.amount;", year, amount);
+/**
+ * @brief Parse a cursor written by cursor_format.
+ *
+ * @return 0 on success, -1 if the text is not a cursor.
+ */
+static int cursor_parse(const char *cursor, int *day, sqlite3_int64 *id) {
+    if (strlen(cursor) != 24 || strspn(cursor, "0123456789abcdef") != 24) {
+        return -1;
+    }
+    unsigned offset_day;
+    unsigned long long row_id;
+    if (sscanf(cursor, "%8x%16llx", &offset_day, &row_id) != 2) {
+        return -1;
+    }
+    *day = (int)(offset_day ^ 0x80000000u);
+    *id = (sqlite3_int64)row_id;
+    return 0;
+}
 
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+/**
+ * @brief Sum the charges transaction_list lists over a whole date range without reading its rows.
+ *
+ * Whole calendar months inside the range are read from monthly_rollup, and the partial months at
+ * either end from the (day, category_id, cents) index, so the cost depends on the number of
+ * months rather than of transactions.
+ *
+ * @return 0 on success, -1 after printing the SQL failure to err.
+ */
+static int range_total(sqlite3 *db, FILE *err, int start_day, int end_day, const char *exclude_clause, long long *total_cents) {
+    int year, month, day;
+    date_civil_from_days(start_day, &year, &month, &day);
+    int whole_start = day == 1 ? start_day : date_days_from_civil(month == 12 ? year + 1 : year, month == 12 ? 1 : month + 1, 1);
+    date_civil_from_days(end_day + 1, &year, &month, &day);
+    int whole_end = date_days_from_civil(year, month, 1); // First day after the last whole month
+    if (whole_end <= whole_start) {
+        whole_start = whole_end = end_day + 1;
+    }
+    char first_month[11], last_month[11];
+    date_format(whole_start, first_month);
+    date_format(whole_end - 1, last_month);
+    first_month[7] = last_month[7] = '\0';
+
+    char *sql = sqlite3_mprintf(
+             "SELECT (SELECT IFNULL(SUM(t.cents), 0) FROM transactions t JOIN categories c ON t.category_id = c.id "
+             "WHERE t.day >= ?1 AND t.day < ?2 %s) + "
+             "(SELECT IFNULL(SUM(t.total_cents), 0) FROM monthly_rollup t JOIN categories c ON t.category_id = c.id "
+             "WHERE t.month >= ?3 AND t.month <= ?4 AND ?2 < ?5 %s) + "
+             "(SELECT IFNULL(SUM(t.cents), 0) FROM transactions t JOIN categories c ON t.category_id = c.id "
+             "WHERE t.day >= ?5 AND t.day <= ?6 %s);",
+             exclude_clause, exclude_clause, exclude_clause);
+    sqlite3_stmt *stmt = db_prepare(sql);
     sqlite3_free(sql);
+    if (!stmt) {
+        fprintf(err, "Failed to total transactions: %s (has migrate_db.sh been run?)\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, start_day);
+    sqlite3_bind_int(stmt, 2, whole_start);
+    sqlite3_bind_text(stmt, 3, first_month, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 4, last_month, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 5, whole_end);
+    sqlite3_bind_int(stmt, 6, end_day);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        *total_cents = sqlite3_column_int64(stmt, 0);
+    } else {
+        fprintf(err, "Failed to total transactions: %s\n", sqlite3_errmsg(db));
+    }
+    db_release(stmt);
+    return rc == SQLITE_ROW ? 0 : -1;
+}
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+/**
+ * @brief Bind the range and page of a listing query.
+ *
+ * The query selects "t.day BETWEEN ?1 AND ?2 AND (t.day > ?1 OR t.id > ?3)", ordered by day and id,
+ * with "LIMIT ?4". The cursor folds into the lower bound of the range, so an index seek starts at it.
+ */
+static void bind_page(sqlite3_stmt *stmt, int start_day, int end_day, int after_day, sqlite3_int64 after_id, int limit) {
+    if (after_day >= start_day) {
+        sqlite3_bind_int(stmt, 1, after_day);
+        sqlite3_bind_int64(stmt, 3, after_id);
+    } else {
+        sqlite3_bind_int(stmt, 1, start_day);
+        sqlite3_bind_int64(stmt, 3, 0);
     }
+    sqlite3_bind_int(stmt, 2, end_day);
+    // One row more than the page, to tell whether another page follows
+    sqlite3_bind_int64(stmt, 4, limit > 0 ? (sqlite3_int64)limit + 1 : -1);
+}
 
-    sqlite3_close(db);
+/**
+ * @brief Write the rows of a transaction listing, followed by its total and the cursor of the next page.
+ *
+ * The statement selects the day, cents, description, category label, category id and id of each
+ * transaction in listing order, and one row more than limit when another page follows. Formatted
+ * pages are page documents (see emit_begin_page) with total_charge and next_cursor fields, the
+ * cursor being null on the last page.
+ *
+ * @param out Where to write the transactions.
+ * @param stmt The bound listing query.
+ * @param output_format The output format as given, or NULL for a table.
+ * @param format The parsed output format, when output_format is given.
+ * @param limit The page size, or 0 if the listing is not paged.
+ * @param total The total charge of the whole listing in cents, or NULL to print the sum of the rows written.
+ */
+static void print_transactions(FILE *out, sqlite3_stmt *stmt, const char *output_format, enum emit_format format,
+                               int limit, const long long *total) {
+    long long total_cents = 0;
+    char date[11];
+    char next[25] = "";
+    int rows = 0;
+
+    if (output_format) {
+        // Rows are written as they are stepped, so memory use does not grow with the range
+        static const char *const columns[] = { "date", "charge", "description", "category", "category_id" };
+        struct emitter emitter;
+        if (total) {
+            emit_begin_page(&emitter, out, format, columns, 5, "transactions");
+        } else {
+            emit_begin(&emitter, out, format, columns, 5);
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (limit > 0 && rows++ == limit) {
+                break;
+            }
+            emit_record(&emitter);
+            date_format(sqlite3_column_int(stmt, 0), date);
+            emit_string(&emitter, date);
+            emit_cents(&emitter, sqlite3_column_int64(stmt, 1));
+            emit_string(&emitter, (const char *)sqlite3_column_text(stmt, 2));
+            emit_string(&emitter, (const char *)sqlite3_column_text(stmt, 3));
+            emit_int(&emitter, sqlite3_column_int(stmt, 4));
+            total_cents += sqlite3_column_int64(stmt, 1);
+            cursor_format(sqlite3_column_int(stmt, 0), sqlite3_column_int64(stmt, 5), next);
+        }
+        if (total) {
+            // A page carries its total and cursor inside the document, where a parser finds them
+            static const char *const summary[] = { "total_charge", "next_cursor" };
+            emit_summary(&emitter, summary, 2);
+            emit_cents(&emitter, *total);
+            emit_string(&emitter, limit > 0 && rows > limit ? next : NULL);
+            emit_end(&emitter);
+        } else {
+            emit_end(&emitter);
+            // NDJSON and CSV are read by other tools, which would take a trailing total for a record
+            if (format == EMIT_JSON || format == EMIT_YAML) {
+                fprintf(out, "Total Charge: %.2f\n", total_cents / 100.0);
+            }
+        }
+    } else {
+        fprintf(out, "%-12s | %-10s | %-30s | %-15s | %-12s\n", "Date", "Charge", "Description", "Category", "Category ID");
+        fprintf(out, "-------------------------------------------------------------------------------------------\n");
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            if (limit > 0 && rows++ == limit) {
+                break;
+            }
+            date_format(sqlite3_column_int(stmt, 0), date);
+            double charge = sqlite3_column_int64(stmt, 1) / 100.0;
+            const char *description = (const char *)sqlite3_column_text(stmt, 2);
+            const char *category = (const char *)sqlite3_column_text(stmt, 3);
+            int category_id = sqlite3_column_int(stmt, 4);
+            fprintf(out, "%-12s | %-10.2f | %-30s | %-15s | %-12d\n", date, charge, description, category, category_id);
+            total_cents += sqlite3_column_int64(stmt, 1);
+            cursor_format(sqlite3_column_int(stmt, 0), sqlite3_column_int64(stmt, 5), next);
+        }
+        fprintf(out, "Total Charge: %.2f\n", (total ? *total : total_cents) / 100.0);
+        if (limit > 0 && rows > limit) {
+            fprintf(out, "Next Cursor: %s\n", next);
+        }
+    }
 }
 
 /**
  * @brief List transactions within a specified date range.
  *
  * This function retrieves and lists transactions from the database that fall within a specified date range,
- * optionally excluding certain categories and outputting in different formats (JSON or YAML).
+ * optionally excluding certain categories and outputting in different formats (JSON, NDJSON, YAML or CSV).
+ *
+ * Dates are stored as day numbers and charges as cents; both are formatted here, and the total is
+ * summed in cents so it is exact. Formatted output is streamed row by row through an emitter.
  *
- * @param start_date The start date of the transaction period (inclusive).
- * @param end_date The end date of the transaction period (inclusive).
+ * Transactions are listed by date, then in the order they were stored. With a limit, the list is
+ * paged: each page is a seek of the (day) index just past the cursor of the previous page's last row,
+ * so it costs the same however deep it is. When more rows follow, the table ends with the next
+ * page's cursor, and formatted output holds it in its next_cursor field. The total of a paged list covers the whole range, and is
+ * computed by range_total instead of from the rows.
+ *
+ * @param out Where to write the transactions.
+ * @param err Where to write errors.
+ * @param start_date The start date of the transaction period (inclusive) in YYYY-MM-DD format.
+ * @param end_date The end date of the transaction period (inclusive) in YYYY-MM-DD format.
  * @param excluded_categories A comma-separated list of category IDs to exclude from the results.
- * @param output_format The format in which to output the transactions ("json" or "yaml").
+ * @param output_format The format in which to output the transactions ("json", "ndjson", "yaml" or "csv"), or NULL for a table.
+ * @param limit The most transactions to list, or 0 for all of them.
+ * @param after The cursor printed with the previous page, or NULL to start at the beginning of the range.
+ * @return 0 on success, -1 if the options are invalid or the listing failed.
  */
-void transaction_list(const char *start_date, const char *end_date, const char *excluded_categories, const char *output_format) {
-    sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("budget.db", &db);
+int transaction_list(FILE *out, FILE *err, const char *start_date, const char *end_date, const char *excluded_categories,
+                      const char *output_format, int limit, const char *after) {
+    sqlite3 *db = db_open();
+    if (!db) {
+        return -1;
+    }
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        return;
+    enum emit_format format = EMIT_JSON;
+    if (output_format && emit_format_parse(output_format, &format) != 0) {
+        fprintf(err, "Unknown output format: %s (expected json, ndjson, yaml or csv)\n", output_format);
+        return -1;
+    }
+
+    int start_day, end_day;
+    if (date_parse(start_date, strlen(start_date), "%Y-%m-%d", &start_day) != 0 ||
+        date_parse(end_date, strlen(end_date), "%Y-%m-%d", &end_day) != 0) {
+        fprintf(err, "Invalid date range: %s to %s (expected YYYY-MM-DD)\n", start_date, end_date);
+        return -1;
+    }
+
+    // Rows after the cursor are on a later day, or on the cursor's day with a later id
+    int after_day = INT_MIN;
+    sqlite3_int64 after_id = 0;
+    if (after && cursor_parse(after, &after_day, &after_id) != 0) {
+        fprintf(err, "Invalid cursor: %s\n", after);
+        return -1;
     }
 
-    char exclude_clause[512] = "";
-    if (excluded_categories) {
-        snprintf(exclude_clause, sizeof(exclude_clause),
-                 "AND t.category_id NOT IN (%s)", excluded_categories);
+    // Rebuilt from the parsed ids, so a serve client cannot put anything but numbers into the SQL
+    char *excluded = NULL;
+    if (excluded_categories && !(excluded = category_id_list(excluded_categories, err))) {
+        return -1;
     }
+    char *exclude_clause = sqlite3_mprintf(excluded && *excluded ? "AND t.category_id NOT IN (%s)" : "", excluded);
+    free(excluded);
 
-    char sql[512];
-    snprintf(sql, sizeof(sql),
-             "SELECT t.date, t.charge, t.description, c.label, t.category_id FROM transactions t "
+    int paged = limit > 0 || after;
+    long long total_cents = 0;
+    if (paged && range_total(db, err, start_day, end_day, exclude_clause, &total_cents) != 0) {
+        sqlite3_free(exclude_clause);
+        return -1;
+    }
+
+    char *sql = sqlite3_mprintf(
+             "SELECT t.day, t.cents, t.description, c.label, t.category_id, t.id FROM transactions t "
              "JOIN categories c ON t.category_id = c.id "
-             "WHERE t.date BETWEEN '%s' AND '%s' %s "
-             "ORDER BY t.date;", start_date, end_date, exclude_clause);
+             "WHERE t.day BETWEEN ?1 AND ?2 AND (t.day > ?1 OR t.id > ?3) %s "
+             "ORDER BY t.day, t.id LIMIT ?4;", exclude_clause);
+    sqlite3_free(exclude_clause);
+
+    sqlite3_stmt *stmt = db_prepare(sql);
+    sqlite3_free(sql);
+    if (!stmt) {
+        fprintf(err, "Failed to fetch transactions: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    bind_page(stmt, start_day, end_day, after_day, after_id, limit);
 
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+    print_transactions(out, stmt, output_format, format, limit, paged ? &total_cents : NULL);
+    db_release(stmt);
+    return 0;
+}
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to fetch transactions: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        return;
+/**
+ * @brief Options of transaction search.
+ */
+struct search_options {
+    const char *query;               /**< Words, "quoted phrases" and prefix* terms, all required unless joined by OR. */
+    const char *start_date;          /**< First day (YYYY-MM-DD), or NULL for no lower bound. */
+    const char *end_date;            /**< Last day (YYYY-MM-DD), or NULL for no upper bound. */
+    const char *categories;          /**< Comma-separated category ids to search, or NULL for all of them. */
+    const char *excluded_categories; /**< Comma-separated category ids to leave out, or NULL. */
+    const char *output_format;       /**< "json", "ndjson", "yaml" or "csv", or NULL for a table. */
+    int limit;                       /**< Page size, or 0 to list every match. */
+    const char *after;               /**< Cursor of the previous page, or NULL. */
+    const char *engine;              /**< "fts" (the default) or "like", which scans the descriptions. */
+};
+
+/**
+ * @brief Translate a search query into an FTS5 expression, or into a LIKE condition on t.description.
+ *
+ * Each word or "quoted phrase" is quoted for FTS5, so punctuation in descriptions (such as "#0012"
+ * or "*TRIP") is matched rather than read as query syntax. A trailing * makes a prefix term and OR
+ * joins two terms; other terms are all required. The LIKE condition matches each term anywhere in
+ * the description, which also matches inside words.
+ *
+ * @return The number of terms written to out, or -1 if the query is malformed.
+ */
+static int search_expression(const char *query, int like, FILE *out) {
+    int terms = 0, or_pending = 0;
+    const char *p = query;
+    for (;;) {
+        p += strspn(p, " \t");
+        if (!*p) {
+            break;
+        }
+        const char *start, *end;
+        int prefix = 0;
+        if (*p == '"') {
+            start = p + 1;
+            end = strchr(start, '"');
+            if (!end) {
+                return -1;
+            }
+            p = end + 1;
+            if (*p == '*') {
+                prefix = 1;
+                p++;
+            }
+        } else {
+            start = p;
+            end = p + strcspn(p, " \t");
+            p = end;
+            if (end - start == 2 && strncmp(start, "OR", 2) == 0) {
+                if (terms == 0 || or_pending) {
+                    return -1;
+                }
+                or_pending = 1;
+                continue;
+            }
+            if (end[-1] == '*') {
+                prefix = 1;
+                end--;
+            }
+        }
+        if (end == start) {
+            continue;
+        }
+
+        if (terms > 0) {
+            fputs(or_pending ? " OR " : like ? " AND " : " ", out);
+        }
+        or_pending = 0;
+        terms++;
+        if (like) {
+            // Quotes are doubled for SQL and the LIKE wildcards escaped
+            fputs("t.description LIKE '%", out);
+            for (const char *c = start; c < end; c++) {
+                if (*c == '%' || *c == '_' || *c == '\\') {
+                    fputc('\\', out);
+                } else if (*c == '\'') {
+                    fputc('\'', out);
+                }
+                fputc(*c, out);
+            }
+            fputs("%' ESCAPE '\\'", out);
+        } else {
+            fputc('"', out);
+            for (const char *c = start; c < end; c++) {
+                if (*c == '"') {
+                    fputc('"', out);
+                }
+                fputc(*c, out);
+            }
+            fputs(prefix ? "\"*" : "\"", out);
+        }
     }
+    return or_pending ? -1 : terms;
+}
 
-    double total_charge = 0.0;
+/**
+ * @brief Search transaction descriptions, listing the matches like transaction list.
+ *
+ * The default engine looks the terms up in the transactions_fts full-text index, so the cost depends
+ * on the number of matching transactions rather than the size of the ledger; the date range and
+ * categories then filter the matches. The "like" engine runs the same search as a scan of every
+ * description in the range, for comparison. Matches are listed by date, paged with --limit and
+ * --after as by transaction list, and the total of a paged search covers every match.
+ *
+ * @param out Where to write the transactions.
+ * @param err Where to write errors.
+ * @param options The query, filters and output format.
+ * @return 0 on success, -1 if the options are invalid or the search failed.
+ */
+int transaction_search(FILE *out, FILE *err, const struct search_options *options) {
+    sqlite3 *db = db_open();
+    if (!db) {
+        return -1;
+    }
 
-    if (output_format && strcmp(output_format, "json") == 0) {
-        struct json_object *jarray = json_object_new_array();
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            struct json_object *jobj = json_object_new_object();
-            json_object_object_add(jobj, "date", json_object_new_string((const char *)sqlite3_column_text(stmt, 0)));
-            json_object_object_add(jobj, "charge", json_object_new_double(sqlite3_column_double(stmt, 1)));
-            json_object_object_add(jobj, "description", json_object_new_string((const char *)sqlite3_column_text(stmt, 2)));
-            json_object_object_add(jobj, "category", json_object_new_string((const char *)sqlite3_column_text(stmt, 3)));
-            json_object_object_add(jobj, "category_id", json_object_new_int(sqlite3_column_int(stmt, 4)));
-            json_object_array_add(jarray, jobj);
-            total_charge += sqlite3_column_double(stmt, 1);
-        }
-        printf("Total Charge: %.2f\n", total_charge);
-        printf("%s\n", json_object_to_json_string(jarray));
-        json_object_put(jarray);
-    } else if (output_format && strcmp(output_format, "yaml") == 0) {
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            printf("- date: %s\n  charge: %.2f\n  description: %s\n  category: %s\n",
-                   sqlite3_column_text(stmt, 0),
-                   sqlite3_column_double(stmt, 1),
-                   sqlite3_column_text(stmt, 2),
-                   sqlite3_column_text(stmt, 3));
-            total_charge += sqlite3_column_double(stmt, 1);
-        }
-        printf("Total Charge: %.2f\n", total_charge);
+    enum emit_format format = EMIT_JSON;
+    if (options->output_format && emit_format_parse(options->output_format, &format) != 0) {
+        fprintf(err, "Unknown output format: %s (expected json, ndjson, yaml or csv)\n", options->output_format);
+        return -1;
+    }
+    int like = options->engine && strcmp(options->engine, "like") == 0;
+    if (options->engine && !like && strcmp(options->engine, "fts") != 0) {
+        fprintf(err, "Unknown search engine: %s (expected fts or like)\n", options->engine);
+        return -1;
+    }
+
+    int start_day = INT_MIN, end_day = INT_MAX;
+    if ((options->start_date && date_parse(options->start_date, strlen(options->start_date), "%Y-%m-%d", &start_day) != 0) ||
+        (options->end_date && date_parse(options->end_date, strlen(options->end_date), "%Y-%m-%d", &end_day) != 0)) {
+        fprintf(err, "Invalid date range (expected YYYY-MM-DD)\n");
+        return -1;
+    }
+    int after_day = INT_MIN;
+    sqlite3_int64 after_id = 0;
+    if (options->after && cursor_parse(options->after, &after_day, &after_id) != 0) {
+        fprintf(err, "Invalid cursor: %s\n", options->after);
+        return -1;
+    }
+
+    char *expression = NULL;
+    size_t expression_size;
+    FILE *stream = open_memstream(&expression, &expression_size);
+    int terms = search_expression(options->query, like, stream);
+    fclose(stream);
+    if (terms <= 0) {
+        fprintf(err, "Invalid search query: %s (expected words, \"phrases\", prefix* terms and OR)\n", options->query);
+        free(expression);
+        return -1;
+    }
+
+    char *categories = NULL, *excluded = NULL;
+    if ((options->categories && !(categories = category_id_list(options->categories, err))) ||
+        (options->excluded_categories && !(excluded = category_id_list(options->excluded_categories, err)))) {
+        free(categories);
+        free(expression);
+        return -1;
+    }
+
+    // Everything after the SELECT list; ?1 and ?2 are the day range and, for FTS, ?5 the expression
+    char *from = NULL;
+    size_t from_size;
+    stream = open_memstream(&from, &from_size);
+    if (like) {
+        fprintf(stream, "FROM transactions t JOIN categories c ON t.category_id = c.id WHERE (%s)", expression);
     } else {
-        printf("%-12s | %-10s | %-30s | %-15s | %-12s\n", "Date", "Charge", "Description", "Category", "Category ID");
-        printf("-------------------------------------------------------------------------------------------\n");
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *date = (const char *)sqlite3_column_text(stmt, 0);
-            double charge = sqlite3_column_double(stmt, 1);
-            const char *description = (const char *)sqlite3_column_text(stmt, 2);
-            const char *category = (const char *)sqlite3_column_text(stmt, 3);
-            int category_id = sqlite3_column_int(stmt, 4);
-            printf("%-12s | %-10.2f | %-30s | %-15s | %-12d\n", date, charge, description, category, category_id);
-            total_charge += sqlite3_column_double(stmt, 1);
+        fprintf(stream, "FROM transactions_fts JOIN transactions t ON t.id = transactions_fts.rowid "
+                        "JOIN categories c ON t.category_id = c.id WHERE transactions_fts MATCH ?5");
+    }
+    fprintf(stream, " AND t.day BETWEEN ?1 AND ?2");
+    if (categories && *categories) {
+        fprintf(stream, " AND t.category_id IN (%s)", categories);
+    }
+    if (excluded && *excluded) {
+        fprintf(stream, " AND t.category_id NOT IN (%s)", excluded);
+    }
+    fclose(stream);
+    free(categories);
+    free(excluded);
+
+    char *sql = sqlite3_mprintf("SELECT t.day, t.cents, t.description, c.label, t.category_id, t.id %s "
+                                "AND (t.day > ?1 OR t.id > ?3) ORDER BY t.day, t.id LIMIT ?4;", from);
+    char *total_sql = sqlite3_mprintf("SELECT IFNULL(SUM(t.cents), 0) %s;", from);
+    free(from);
+
+    int paged = options->limit > 0 || options->after;
+    long long total_cents = 0;
+    sqlite3_stmt *total_stmt = NULL, *stmt = NULL;
+    int rc = -1;
+    if ((paged && !(total_stmt = db_prepare(total_sql))) || !(stmt = db_prepare(sql))) {
+        fprintf(err, "Failed to search transactions: %s (has migrate_db.sh been run?)\n", sqlite3_errmsg(db));
+    } else {
+        if (total_stmt) {
+            sqlite3_bind_int(total_stmt, 1, start_day);
+            sqlite3_bind_int(total_stmt, 2, end_day);
+            if (!like) {
+                sqlite3_bind_text(total_stmt, 5, expression, -1, SQLITE_TRANSIENT);
+            }
+            if (sqlite3_step(total_stmt) == SQLITE_ROW) {
+                total_cents = sqlite3_column_int64(total_stmt, 0);
+            }
         }
-        printf("Total Charge: %.2f\n", total_charge);
+        bind_page(stmt, start_day, end_day, after_day, after_id, options->limit);
+        if (!like) {
+            sqlite3_bind_text(stmt, 5, expression, -1, SQLITE_TRANSIENT);
+        }
+        print_transactions(out, stmt, options->output_format, format, options->limit, paged ? &total_cents : NULL);
+        rc = 0;
     }
+    db_release(total_stmt);
+    db_release(stmt);
+    sqlite3_free(sql);
+    sqlite3_free(total_sql);
+    free(expression);
+    return rc;
+}
 
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+/**
+ * @brief The value of a "--name=value" argument, or NULL if arg is not that option.
+ */
+static const char *option_value(const char *arg, const char *prefix) {
+    size_t len = strlen(prefix);
+    return strncmp(arg, prefix, len) == 0 ? arg + len : NULL;
+}
+
+/**
+ * @brief Run one of the read-only query commands: report spend, report budget, transaction list or
+ * transaction search.
+ *
+ * Shared by the command line and the serve command, which answers the same commands over a socket.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments, laid out as for main (argv[1] is the command).
+ * @param out Where to write the command's output.
+ * @param err Where to write why the command failed.
+ * @return 0 if the command succeeded, 1 if it failed, -1 if argv is not a query command.
+ */
+static int run_query(int argc, char **argv, FILE *out, FILE *err) {
+    int rc = -1;
+    if (argc >= 3 && strcmp(argv[1], "report") == 0) {
+        const char *date_start = argc >= 5 ? option_value(argv[3], "--date-start=") : NULL;
+        const char *date_end = argc >= 5 ? option_value(argv[4], "--date-end=") : NULL;
+        if (strcmp(argv[2], "spend") == 0 && date_start && date_end) {
+            struct spend_options options = {
+                .date_start = date_start,
+                .date_end = date_end,
+                .agg = argc >= 6 ? option_value(argv[5], "--agg=") : NULL,
+            };
+            int bench = 0;
+            for (int i = 5; i < argc; i++) {
+                if (strncmp(argv[i], "-o", 2) == 0) {
+                    options.output_format = argv[i] + 2; // Skip "-o" part
+                }
+                if (strncmp(argv[i], "--exclude-categories=", 21) == 0) {
+                    options.exclude_categories = argv[i] + 21; // Skip "--exclude-categories=" part
+                }
+                if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+                    options.snapshot = argv[i] + 11; // Skip "--snapshot=" part
+                }
+                if (strncmp(argv[i], "--group-by=", 11) == 0) {
+                    options.group_by = argv[i] + 11; // Skip "--group-by=" part
+                }
+                if (strncmp(argv[i], "--engine=", 9) == 0) {
+                    options.engine = argv[i] + 9; // Skip "--engine=" part
+                }
+                if (strncmp(argv[i], "--bench=", 8) == 0) {
+                    bench = atoi(argv[i] + 8); // Skip "--bench=" part
+                }
+            }
+            if (bench > 0) {
+                rc = report_spend_bench(out, err, &options, bench);
+            } else {
+                rc = report_spend(out, err, &options);
+            }
+        } else if (strcmp(argv[2], "budget") == 0 && argc >= 4) {
+            if (strncmp(argv[3], "--year=", 7) == 0) {
+                int year = atoi(argv[3] + 7); // Skip "--year=" part
+                const char *exclude_categories = NULL;
+                const char *breakdown = NULL;
+                const char *output_format = NULL;
+                for (int i = 4; i < argc; i++) {
+                    if (strncmp(argv[i], "--exclude-categories=", 21) == 0) {
+                        exclude_categories = argv[i] + 21; // Skip "--exclude-categories=" part
+                    }
+                    if (strncmp(argv[i], "--breakdown=", 12) == 0) {
+                        breakdown = argv[i] + 12; // Skip "--breakdown=" part
+                    }
+                    if (strncmp(argv[i], "-o", 2) == 0) {
+                        output_format = argv[i] + 2; // Skip "-o" part
+                    }
+                }
+                if (!breakdown) {
+                    rc = report_budget(out, err, year, exclude_categories);
+                } else if (strcmp(breakdown, "monthly") == 0) {
+                    rc = report_budget_breakdown(out, err, year, exclude_categories, output_format);
+                } else {
+                    fprintf(err, "Unknown breakdown: %s (expected monthly)\n", breakdown);
+                }
+            } else if (strncmp(argv[3], "--month=", 8) == 0) {
+                const char *month = argv[3] + 8; // Skip "--month=" part
+                const char *exclude_categories = NULL;
+                for (int i = 4; i < argc; i++) {
+                    if (strncmp(argv[i], "--exclude-categories=", 21) == 0) {
+                        exclude_categories = argv[i] + 21; // Skip "--exclude-categories=" part
+                    }
+                }
+                rc = report_budget_month(out, err, month, exclude_categories);
+            } else {
+                fprintf(err, "Invalid budget report option\n");
+            }
+        } else {
+            fprintf(err, "Invalid report command or options\n");
+        }
+        return rc == 0 ? 0 : 1;
+    }
+    if (argc >= 5 && strcmp(argv[1], "transaction") == 0 && strcmp(argv[2], "list") == 0) {
+        const char *start_date = option_value(argv[3], "--start-date=");
+        const char *end_date = option_value(argv[4], "--end-date=");
+        if (!start_date || !end_date) {
+            fprintf(err, "Invalid transaction list options\n");
+            return 1;
+        }
+        const char *excluded_categories = NULL;
+        const char *output_format = NULL;
+        int limit = 0;
+        const char *after = NULL;
+        for (int i = 5; i < argc; i++) {
+            if (strncmp(argv[i], "-o", 2) == 0) {
+                output_format = argv[i] + 2; // Skip "-o" part
+            }
+            if (strncmp(argv[i], "--excluded-categories=", 22) == 0) {
+                excluded_categories = argv[i] + 22; // Skip "--excluded-categories=" part
+            }
+            if (strncmp(argv[i], "--limit=", 8) == 0) {
+                limit = atoi(argv[i] + 8); // Skip "--limit=" part
+            }
+            if (strncmp(argv[i], "--after=", 8) == 0) {
+                after = argv[i] + 8; // Skip "--after=" part
+            }
+        }
+        rc = transaction_list(out, err, start_date, end_date, excluded_categories, output_format, limit, after);
+        return rc == 0 ? 0 : 1;
+    }
+    if (argc >= 3 && strcmp(argv[1], "transaction") == 0 && strcmp(argv[2], "search") == 0) {
+        struct search_options options = { 0 };
+        for (int i = 3; i < argc; i++) {
+            if (strncmp(argv[i], "--query=", 8) == 0) {
+                options.query = argv[i] + 8; // Skip "--query=" part
+            }
+            if (strncmp(argv[i], "--start-date=", 13) == 0) {
+                options.start_date = argv[i] + 13; // Skip "--start-date=" part
+            }
+            if (strncmp(argv[i], "--end-date=", 11) == 0) {
+                options.end_date = argv[i] + 11; // Skip "--end-date=" part
+            }
+            if (strncmp(argv[i], "--categories=", 13) == 0) {
+                options.categories = argv[i] + 13; // Skip "--categories=" part
+            }
+            if (strncmp(argv[i], "--excluded-categories=", 22) == 0) {
+                options.excluded_categories = argv[i] + 22; // Skip "--excluded-categories=" part
+            }
+            if (strncmp(argv[i], "-o", 2) == 0) {
+                options.output_format = argv[i] + 2; // Skip "-o" part
+            }
+            if (strncmp(argv[i], "--limit=", 8) == 0) {
+                options.limit = atoi(argv[i] + 8); // Skip "--limit=" part
+            }
+            if (strncmp(argv[i], "--after=", 8) == 0) {
+                options.after = argv[i] + 8; // Skip "--after=" part
+            }
+            if (strncmp(argv[i], "--engine=", 9) == 0) {
+                options.engine = argv[i] + 9; // Skip "--engine=" part
+            }
+        }
+        if (!options.query) {
+            fprintf(err, "Invalid transaction search options\n");
+            return 1;
+        }
+        rc = transaction_search(out, err, &options);
+        return rc == 0 ? 0 : 1;
+    }
+    return -1;
 }
 
 /**
@@ -151,34 +720,136 @@ void transaction_list(const char *start_date, const char *end_date, const char *
  * - create-category: Create a new category.
  * - report: Generate reports on spending and budgets.
  * - transaction list: List transactions within a specified date range.
+ * - transaction search: Search transaction descriptions.
+ * - rollup rebuild: Recompute the monthly report totals from the transactions.
+ * - export: Write a columnar snapshot of the transactions for offline analysis.
+ * - serve: Answer report and transaction list requests over a Unix socket.
+ * - client: Send a report or transaction list command to a running server.
+ *
+ * Every command accepts --db=PATH to use another database than $BUDGET_DB or budget.db,
+ * --profile to print where its time went to standard error, and --metrics-json=PATH to write the
+ * same measurements as JSON.
  *
  * @param argc The number of command-line arguments.
  * @param argv An array of command-line argument strings.
  * @return 0 on successful execution, non-zero on error.
  */
 int main(int argc, char *argv[]) {
+    // --db, --profile and --metrics-json may appear anywhere; they are taken out so every command
+    // sees its usual argument positions
+    int kept = 1;
+    int profile = 0;
+    const char *metrics_json = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--db=", 5) == 0) {
+            db_configure(argv[i] + 5); // Skip "--db=" part
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strncmp(argv[i], "--metrics-json=", 15) == 0) {
+            metrics_json = argv[i] + 15; // Skip "--metrics-json=" part
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    argv[argc] = NULL;
+
     if (argc < 2) {
         printf("Usage: %s <command> [options]\n", argv[0]);
         return 1;
     }
 
+    if (profile || metrics_json) {
+        metrics_enable();
+    }
+    uint64_t started = metrics_start();
+    int status = 0;
+
     if (strcmp(argv[1], "import") == 0) {
-        int overwrite = 0;
-        const char *filename = NULL;
+        struct import_options options = { .overwrite = 0, .batch_size = 1, .concurrency = 4, .requests_per_sec = 10,
+                                          .local_threshold = -1, .jobs = 1 };
+        const char *paths[argc];
+        int path_count = 0;
+        const char *bank = "wellsfargo";
+        const char *columns = NULL;
+        const char *date_format = NULL;
+        int header = -1;
 
         for (int i = 2; i < argc; i++) {
             if (strncmp(argv[i], "--csv=", 6) == 0) {
-                filename = argv[i] + 6; // Skip "--csv=" part
+                paths[path_count++] = argv[i] + 6; // Skip "--csv=" part; may be repeated
             } else if (strcmp(argv[i], "--overwrite") == 0) {
-                overwrite = 1;
+                options.overwrite = 1;
+            } else if (strcmp(argv[i], "--since-checkpoint") == 0) {
+                options.since_checkpoint = 1;
+            } else if (strncmp(argv[i], "--batch-size=", 13) == 0) {
+                options.batch_size = atoi(argv[i] + 13); // Skip "--batch-size=" part
+            } else if (strncmp(argv[i], "--concurrency=", 14) == 0) {
+                options.concurrency = atoi(argv[i] + 14); // Skip "--concurrency=" part
+            } else if (strncmp(argv[i], "--requests-per-sec=", 19) == 0) {
+                options.requests_per_sec = atof(argv[i] + 19); // Skip "--requests-per-sec=" part
+            } else if (strncmp(argv[i], "--classifier-url=", 17) == 0) {
+                options.classifier_url = argv[i] + 17; // Skip "--classifier-url=" part
+            } else if (strncmp(argv[i], "--local-threshold=", 18) == 0) {
+                options.local_threshold = atof(argv[i] + 18); // Skip "--local-threshold=" part
+            } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+                options.jobs = atoi(argv[i] + 7); // Skip "--jobs=" part
+            } else if (strncmp(argv[i], "--bank=", 7) == 0) {
+                bank = argv[i] + 7; // Skip "--bank=" part
+            } else if (strncmp(argv[i], "--columns=", 10) == 0) {
+                columns = argv[i] + 10; // Skip "--columns=" part
+            } else if (strncmp(argv[i], "--date-format=", 14) == 0) {
+                date_format = argv[i] + 14; // Skip "--date-format=" part
+            } else if (strcmp(argv[i], "--header") == 0) {
+                header = 1;
+            } else if (strcmp(argv[i], "--no-header") == 0) {
+                header = 0;
             }
         }
 
-        if (filename) {
-            import_csv(filename, overwrite);
+        // Start from the bank's layout, then apply any explicit overrides
+        if (csv_columns_preset(bank, &options.columns) != 0) {
+            printf("Unknown bank: %s (expected wellsfargo, chase or generic)\n", bank);
+            return 1;
+        }
+        if (columns && csv_columns_parse(columns, &options.columns) != 0) {
+            printf("Invalid --columns: %s (expected e.g. date=0,charge=1,description=4)\n", columns);
+            return 1;
+        }
+        if (date_format) {
+            options.columns.date_format = date_format;
+        }
+        if (header != -1) {
+            options.columns.header = header;
+        }
+
+        if (path_count > 0) {
+            import_csv(paths, path_count, &options);
         } else {
             printf("CSV file not specified.\n");
         }
+    } else if (strcmp(argv[1], "reclassify") == 0) {
+        struct reclassify_options options = { .batch_size = 5000, .concurrency = 4, .requests_per_sec = 10 };
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--date-start=", 13) == 0) {
+                options.date_start = argv[i] + 13; // Skip "--date-start=" part
+            } else if (strncmp(argv[i], "--date-end=", 11) == 0) {
+                options.date_end = argv[i] + 11; // Skip "--date-end=" part
+            } else if (strncmp(argv[i], "--categories=", 13) == 0) {
+                options.categories = argv[i] + 13; // Skip "--categories=" part
+            } else if (strcmp(argv[i], "--all") == 0) {
+                options.all = 1;
+            } else if (strncmp(argv[i], "--batch-size=", 13) == 0) {
+                options.batch_size = atoi(argv[i] + 13); // Skip "--batch-size=" part
+            } else if (strncmp(argv[i], "--concurrency=", 14) == 0) {
+                options.concurrency = atoi(argv[i] + 14); // Skip "--concurrency=" part
+            } else if (strncmp(argv[i], "--requests-per-sec=", 19) == 0) {
+                options.requests_per_sec = atof(argv[i] + 19); // Skip "--requests-per-sec=" part
+            } else if (strncmp(argv[i], "--classifier-url=", 17) == 0) {
+                options.classifier_url = argv[i] + 17; // Skip "--classifier-url=" part
+            }
+        }
+        reclassify(&options);
     } else if (strcmp(argv[1], "set-budget") == 0 && argc == 4) {
         int year = atoi(argv[2] + 7); // Skip "--year=" part
         double amount = atof(argv[3] + 9); // Skip "--amount=" part
@@ -194,58 +865,77 @@ int main(int argc, char *argv[]) {
         const char *label = argv[2] + 8; // Skip "--label=" part
         const char *description = argv[3] + 14; // Skip "--description=" part
         create_category(label, description);
-    } else if (strcmp(argv[1], "report") == 0) {
-        if (strcmp(argv[2], "spend") == 0 && argc >= 5) {
-            const char *date_start = argv[3] + 13; // Skip "--date-start=" part
-            const char *date_end = argv[4] + 11;   // Skip "--date-end=" part
-            const char *agg = (argc >= 5) ? argv[5] + 6 : NULL; // Skip "--agg=" part if present
-            const char *exclude_categories = NULL;
-            const char *output_format = NULL;
-            for (int i = 6; i < argc; i++) {
-                if (strcmp(argv[i], "-ojson") == 0) {
-                    output_format = "json";
-                }
-                if (strncmp(argv[i], "--exclude-categories=", 21) == 0) {
-                    exclude_categories = argv[i] + 21; // Skip "--exclude-categories=" part
-                }
+    } else if (strcmp(argv[1], "report") == 0 || strcmp(argv[1], "transaction") == 0) {
+        status = run_query(argc, argv, stdout, stderr) == 0 ? 0 : 1;
+    } else if (strcmp(argv[1], "rollup") == 0 && argc >= 3 && strcmp(argv[2], "rebuild") == 0) {
+        rollup_rebuild();
+    } else if (strcmp(argv[1], "export") == 0) {
+        const char *format = NULL;
+        const char *output = NULL;
+        int full = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--format=", 9) == 0) {
+                format = argv[i] + 9; // Skip "--format=" part
+            } else if (strncmp(argv[i], "--output=", 9) == 0) {
+                output = argv[i] + 9; // Skip "--output=" part
+            } else if (strcmp(argv[i], "--full") == 0) {
+                full = 1;
             }
-            report_spend(date_start, date_end, agg, exclude_categories, output_format);
-        } else if (strcmp(argv[2], "budget") == 0 && argc >= 4) {
-            if (strncmp(argv[3], "--year=", 7) == 0) {
-                int year = atoi(argv[3] + 7); // Skip "--year=" part
-                const char *exclude_categories = NULL;
-                for (int i = 4; i < argc; i++) {
-                    if (strncmp(argv[i], "--exclude-categories=", 21) == 0) {
-                        exclude_categories = argv[i] + 21; // Skip "--exclude-categories=" part
-                    }
-                }
-                report_budget(year, exclude_categories);
-            } else if (strncmp(argv[3], "--month=", 8) == 0) {
-                const char *month = argv[3] + 8; // Skip "--month=" part
-                report_budget_month(month);
-            } else {
-                printf("Invalid budget report option\n");
+        }
+        if (!format || strcmp(format, "columnar") != 0) {
+            printf("Unknown export format (expected --format=columnar).\n");
+            status = 1;
+        } else if (!output) {
+            printf("Output directory not specified.\n");
+            status = 1;
+        } else if (snapshot_export(output, full) != 0) {
+            status = 1;
+        }
+    } else if (strcmp(argv[1], "serve") == 0) {
+        const char *socket_path = NULL;
+        int workers = SERVER_DEFAULT_WORKERS;
+        for (int i = 2; i < argc; i++) {
+            if (strncmp(argv[i], "--socket=", 9) == 0) {
+                socket_path = argv[i] + 9; // Skip "--socket=" part
+            } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+                workers = atoi(argv[i] + 10); // Skip "--workers=" part
             }
+        }
+        if (socket_path) {
+            status = server_run(socket_path, workers, run_query) == 0 ? 0 : 1;
         } else {
-            printf("Invalid report command or options\n");
+            printf("Socket not specified.\n");
         }
-    } else if (strcmp(argv[1], "transaction") == 0 && strcmp(argv[2], "list") == 0 && argc >= 5) {
-        const char *start_date = argv[3] + 13; // Skip "--start-date=" part
-        const char *end_date = argv[4] + 11;   // Skip "--end-date=" part
-        const char *excluded_categories = NULL;
-        const char *output_format = NULL;
-        for (int i = 5; i < argc; i++) {
-            if (strcmp(argv[i], "-ojson") == 0) {
-                output_format = "json";
-            } else if (strcmp(argv[i], "-oyaml") == 0) {
-                output_format = "yaml";
-            }
-            if (strncmp(argv[i], "--excluded-categories=", 22) == 0) {
-                excluded_categories = argv[i] + 22; // Skip "--excluded-categories=" part
+    } else if (strcmp(argv[1], "client") == 0) {
+        const char *socket_path = NULL;
+        int bench = 0;
+        int i = 2;
+        // Client options come first; everything after them is the command sent to the server
+        for (; i < argc; i++) {
+            if (strncmp(argv[i], "--socket=", 9) == 0) {
+                socket_path = argv[i] + 9; // Skip "--socket=" part
+            } else if (strncmp(argv[i], "--bench=", 8) == 0) {
+                bench = atoi(argv[i] + 8); // Skip "--bench=" part
+            } else {
+                break;
             }
         }
-        transaction_list(start_date, end_date, excluded_categories, output_format);
+        if (socket_path) {
+            status = client_run(socket_path, argc - i, argv + i, bench);
+        } else {
+            printf("Socket not specified.\n");
+        }
     }
 
-    return 0;
+    db_close();
+    metrics_stop(METRIC_COMMAND, started);
+    if (profile) {
+        // Standard error, so the table does not end up in formatted output piped to another tool
+        fprintf(stderr, "\n");
+        metrics_print(stderr);
+    }
+    if (metrics_json && metrics_write_json(metrics_json) != 0) {
+        status = 1;
+    }
+    return status;
 }
@@ -7,161 +7,535 @@
 #include <stdlib.h>
 #include <math.h>
 #include <regex.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <json-c/json.h>
 
 #include <curl/curl.h>
 #include "report.h"
+#include "csv.h"
 #include "import.h"
+#include "category.h"
+#include "date.h"
+#include "db.h"
+#include "hash.h"
+#include "http.h"
+#include "metrics.h"
+
+static int cache_hits = 0;
+static int cache_misses = 0;
+
+static const char *classifier_url = NULL;
+static struct http_limits classifier_limits = { .max_in_flight = 4, .requests_per_sec = 10, .max_retries = 4 };
 
 /**
- * @brief Callback function to write data received from cURL.
+ * @brief Normalize a transaction description into a classification cache key.
  *
- * This function is used by cURL to append the received data into a user-provided buffer.
+ * Letters are upper-cased, digits and '#'/'*' separators are dropped and whitespace is collapsed,
+ * so "Starbucks #1234" and "STARBUCKS #0981" share the key "STARBUCKS".
  *
- * @param contents Pointer to the data received.
- * @param size Size of each element in bytes.
- * @param nmemb Number of elements.
- * @param userp Pointer to the user-provided buffer where data should be stored.
- * @return Total number of bytes written to the buffer.
+ * @param description The transaction description.
+ * @param key Buffer receiving the normalized key.
+ * @param size Size of the key buffer.
  */
-size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t totalSize = size * nmemb;
-    strncat((char *)userp, (char *)contents, totalSize);
-    return totalSize;
+void merchant_key(const char *description, char *key, size_t size) {
+    size_t len = 0;
+    int pending_space = 0;
+    for (const unsigned char *p = (const unsigned char *)description; *p && len + 2 < size; p++) {
+        if (isdigit(*p) || *p == '#' || *p == '*') {
+            continue;
+        }
+        if (isspace(*p)) {
+            pending_space = 1;
+            continue;
+        }
+        if (pending_space && len > 0) {
+            key[len++] = ' ';
+        }
+        pending_space = 0;
+        key[len++] = toupper(*p);
+    }
+    key[len] = '\0';
 }
 
 /**
- * @brief Get the category ID for a given transaction description.
+ * @brief Classification state built once per import and reused for every request.
  *
- * This function queries an external API (OpenAI GPT-4) to categorize a transaction based on its description.
- * It then retrieves the corresponding category ID from the database.
+ * Holds the serialized categories/examples preamble, a label to category ID map used to resolve
+ * the model's answers, and the prepared classification cache statements.
+ */
+struct prompt_context {
+    char *preamble;
+    int version; /**< category_set version the preamble was built from, or 0 if unknown. */
+    struct hash_map labels;
+    sqlite3_stmt *cache_lookup_stmt;
+    sqlite3_stmt *cache_store_stmt;
+};
+
+/**
+ * @brief Look up a cached classification for a merchant key.
+ *
+ * @return The cached category ID, or -1 if the key is not cached.
+ */
+static int category_cache_lookup(struct prompt_context *context, const char *key) {
+    int category_id = -1;
+    sqlite3_stmt *stmt = context->cache_lookup_stmt;
+    if (stmt) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            category_id = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_reset(stmt);
+    }
+    return category_id;
+}
+
+/**
+ * @brief Remember the classification of a merchant key.
+ */
+static void category_cache_store(struct prompt_context *context, const char *key, int category_id) {
+    sqlite3_stmt *stmt = context->cache_store_stmt;
+    if (stmt) {
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, category_id);
+        sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+    }
+}
+
+/**
+ * @brief Drop every cached classification.
+ *
+ * Called whenever the category set or its examples change, since earlier answers may no longer
+ * be what the model would pick.
  *
  * @param db Pointer to the SQLite3 database connection.
- * @param description The transaction description to be categorized.
- * @return The category ID if found, otherwise -1.
  */
-int get_category_id(sqlite3 *db, const char *description) {
-    int category_id = -1; // Default to -1 indicating no match found
-    CURL *curl;
-    CURLcode res;
-    struct curl_slist *headers = NULL;
-    char *api_key = getenv("OPENAI_API_KEY");
-    if (!api_key) {
-        fprintf(stderr, "OpenAI API key not set in environment\n");
-        return -1;
+void category_cache_clear(sqlite3 *db) {
+    char *err_msg = 0;
+    if (sqlite3_exec(db, "DELETE FROM category_cache;", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to clear classification cache: %s\n", err_msg);
+        sqlite3_free(err_msg);
     }
+}
 
-    curl = curl_easy_init();
-    if(curl) {
-        const char *MODEL = "gpt-4o-mini";
-        char post_data[4096];
+/**
+ * @brief Print the classification cache hit and miss counters for this process.
+ */
+void category_cache_print_stats(void) {
+    printf("Classification cache: %d hits, %d misses\n", cache_hits, cache_misses);
+}
 
-        // Retrieve categories and examples from the database
-        sqlite3_stmt *stmt;
-        char categories_query[] = "SELECT c.label, c.description, e.example FROM categories c LEFT JOIN category_examples e ON c.id = e.category_id";
-        int rc = sqlite3_prepare_v2(db, categories_query, -1, &stmt, 0);
+/**
+ * @brief Build the classification context for the current category set.
+ *
+ * The preamble shared by every classification request lists every category with its description,
+ * followed by the category examples, and is serialized once into a growable buffer so large
+ * category sets are never truncated.
+ *
+ * @param db Pointer to the SQLite3 database connection; it must outlive the context.
+ * @return The context, to be released with prompt_context_free, or NULL on failure.
+ */
+struct prompt_context *prompt_context_new(sqlite3 *db) {
+    struct prompt_context *context = calloc(1, sizeof(struct prompt_context));
+    if (!context || hash_map_init(&context->labels, 64) != 0) {
+        free(context);
+        return NULL;
+    }
 
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "Failed to fetch categories and examples: %s\n", sqlite3_errmsg(db));
-            return -1;
+    // Read first, so a change made while the categories are read leaves the version behind, never ahead
+    sqlite3_stmt *version_stmt;
+    if (sqlite3_prepare_v2(db, "SELECT version FROM category_set;", -1, &version_stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(version_stmt) == SQLITE_ROW) {
+            context->version = sqlite3_column_int(version_stmt, 0);
         }
+        sqlite3_finalize(version_stmt);
+    }
 
-        // Construct the prompt dynamically
-        char categories_part[2048] = "Categories:\\n";
-        char examples_part[2048] = "Examples:\\n";
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const char *label = (const char *)sqlite3_column_text(stmt, 0);
-            const char *description = (const char *)sqlite3_column_text(stmt, 1);
-            const char *example = (const char *)sqlite3_column_text(stmt, 2);
-
-            if (label && description) {
-                strcat(categories_part, "- ");
-                strcat(categories_part, label);
-                strcat(categories_part, ": ");
-                strcat(categories_part, description);
-                strcat(categories_part, "\\n");
-            }
+    // Retrieve categories and examples from the database
+    sqlite3_stmt *categories_stmt, *examples_stmt;
+    if (sqlite3_prepare_v2(db, "SELECT id, label, description FROM categories;", -1, &categories_stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to fetch categories and examples: %s\n", sqlite3_errmsg(db));
+        prompt_context_free(context);
+        return NULL;
+    }
+    if (sqlite3_prepare_v2(db, "SELECT example FROM category_examples;", -1, &examples_stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to fetch categories and examples: %s\n", sqlite3_errmsg(db));
+        sqlite3_finalize(categories_stmt);
+        prompt_context_free(context);
+        return NULL;
+    }
 
-            if (example) {
-                strcat(examples_part, example);
-                strcat(examples_part, "\\n");
-            }
+    // Construct the prompt dynamically
+    size_t preamble_size;
+    FILE *preamble = open_memstream(&context->preamble, &preamble_size);
+    fprintf(preamble, "You are a financial assistant that categorizes transactions.\nCategories:\n");
+    while (sqlite3_step(categories_stmt) == SQLITE_ROW) {
+        int id = sqlite3_column_int(categories_stmt, 0);
+        const char *label = (const char *)sqlite3_column_text(categories_stmt, 1);
+        const char *description = (const char *)sqlite3_column_text(categories_stmt, 2);
+
+        if (label) {
+            hash_map_put(&context->labels, label, id);
+        }
+        if (label && description) {
+            fprintf(preamble, "- %s: %s\n", label, description);
+        }
+    }
+    fprintf(preamble, "Examples:\n");
+    while (sqlite3_step(examples_stmt) == SQLITE_ROW) {
+        const char *example = (const char *)sqlite3_column_text(examples_stmt, 0);
+        if (example) {
+            fprintf(preamble, "%s\n", example);
         }
-        sqlite3_finalize(stmt);
-
-        // Format the JSON request properly
-        int written = snprintf(post_data, sizeof(post_data),
-            "{"
-            "\"model\": \"%s\","
-            "\"messages\": [{\"role\": \"user\", \"content\": \""
-            "You are a financial assistant that categorizes transactions.\\n"
-            "%s"
-            "%s"
-            "Now classify this transaction:\\n"
-            "\\\"%s\\\"\\n"
-            "Return only the category name as a string.\"}]}",
-            MODEL, categories_part, examples_part, description);
-
-        // Ensure snprintf didn't truncate output
-        if (written < 0 || written >= sizeof(post_data)) {
-            fprintf(stderr, "Error: JSON request is too long or snprintf failed.\n");
-            return 0;
+    }
+    fclose(preamble);
+    sqlite3_finalize(categories_stmt);
+    sqlite3_finalize(examples_stmt);
+
+    // A missing cache table only disables caching
+    sqlite3_prepare_v2(db, "SELECT category_id FROM category_cache WHERE merchant = ?;", -1, &context->cache_lookup_stmt, 0);
+    sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO category_cache (merchant, category_id) VALUES (?, ?);", -1, &context->cache_store_stmt, 0);
+    return context;
+}
+
+/**
+ * @brief Release a classification context.
+ */
+void prompt_context_free(struct prompt_context *context) {
+    if (!context) {
+        return;
+    }
+    sqlite3_finalize(context->cache_lookup_stmt);
+    sqlite3_finalize(context->cache_store_stmt);
+    hash_map_free(&context->labels);
+    free(context->preamble);
+    free(context);
+}
+
+/**
+ * @brief The category-set version a context classifies with, stored with each label it produces.
+ *
+ * @return The version, or 0 if the database predates category-set versions.
+ */
+int prompt_context_version(const struct prompt_context *context) {
+    return context->version;
+}
+
+/**
+ * @brief Configure where and how fast classification requests are sent.
+ *
+ * @param url The chat completions endpoint, or NULL to use $BUDGET_CLASSIFIER_URL or api.openai.com.
+ * @param max_in_flight Maximum number of concurrent requests, or 0 to keep the default.
+ * @param requests_per_sec Maximum request rate, or 0 to keep the default.
+ */
+void classifier_configure(const char *url, int max_in_flight, double requests_per_sec) {
+    if (url) {
+        classifier_url = url;
+    }
+    if (max_in_flight > 0) {
+        classifier_limits.max_in_flight = max_in_flight;
+    }
+    if (requests_per_sec > 0) {
+        classifier_limits.requests_per_sec = requests_per_sec;
+    }
+}
+
+/**
+ * @brief Serialize a chat completion request body.
+ *
+ * The request body is serialized with json-c, so descriptions containing quotes or backslashes
+ * are escaped correctly.
+ *
+ * @param prompt The user message to send.
+ * @param json_reply Non-zero to ask the model for a JSON object reply.
+ * @return The request body, which the caller must free.
+ */
+static char *chat_request_body(const char *prompt, int json_reply) {
+    const char *MODEL = "gpt-4o-mini";
+    struct json_object *request = json_object_new_object();
+    struct json_object *messages = json_object_new_array();
+    struct json_object *message = json_object_new_object();
+    json_object_object_add(message, "role", json_object_new_string("user"));
+    json_object_object_add(message, "content", json_object_new_string(prompt));
+    json_object_array_add(messages, message);
+    json_object_object_add(request, "model", json_object_new_string(MODEL));
+    json_object_object_add(request, "messages", messages);
+    if (json_reply) {
+        struct json_object *format = json_object_new_object();
+        json_object_object_add(format, "type", json_object_new_string("json_object"));
+        json_object_object_add(request, "response_format", format);
+    }
+
+    char *body = strdup(json_object_to_json_string(request));
+    json_object_put(request);
+    return body;
+}
+
+/**
+ * @brief Send several chat completion requests concurrently and collect the text of each first choice.
+ *
+ * Requests go to the configured classifier endpoint through http_post_all, which bounds the number
+ * in flight, rate-limits them and retries throttled or failed requests.
+ *
+ * @param prompts The user messages to send.
+ * @param count Number of prompts.
+ * @param json_reply Non-zero to ask the model for JSON object replies.
+ * @param replies Output array of count reply texts, each NULL on failure; the caller frees them.
+ */
+static void request_chat_completions(const char **prompts, int count, int json_reply, char **replies) {
+    const char *url = classifier_url ? classifier_url : getenv("BUDGET_CLASSIFIER_URL");
+    char *api_key = getenv("OPENAI_API_KEY");
+    for (int i = 0; i < count; i++) {
+        replies[i] = NULL;
+    }
+    if (!url) {
+        url = "https://api.openai.com/v1/chat/completions";
+        if (!api_key) {
+            fprintf(stderr, "OpenAI API key not set in environment\n");
+            return;
         }
+    }
 
-        headers = curl_slist_append(headers, "Content-Type: application/json");
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    if (api_key) {
         char auth_header[256];
         snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", api_key);
         headers = curl_slist_append(headers, auth_header);
+    }
 
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.openai.com/v1/chat/completions");
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_data);
+    struct http_request *requests = calloc(count, sizeof(struct http_request));
+    if (!requests) {
+        curl_slist_free_all(headers);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        requests[i].body = chat_request_body(prompts[i], json_reply);
+    }
 
-        res = curl_easy_perform(curl);
-        if(res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        } else {
-            // Parse the response to extract the category name
-            // char buffer[4096];
-            char buffer[4096] = {0}; // Initialize buffer to store response
-            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-            curl_easy_setopt(curl, CURLOPT_WRITEDATA, buffer);
-            res = curl_easy_perform(curl);
-            if (res == CURLE_OK) {
-                struct json_object *parsed_json;
-                struct json_object *choices;
-                struct json_object *choice;
-                struct json_object *message;
-                struct json_object *content;
-
-                parsed_json = json_tokener_parse(buffer);
-                json_object_object_get_ex(parsed_json, "choices", &choices);
-                choice = json_object_array_get_idx(choices, 0);
-                json_object_object_get_ex(choice, "message", &message);
-                json_object_object_get_ex(message, "content", &content);
-                const char *category_name = json_object_get_string(content);
-
-                // Query the database to get the category_id
-                sqlite3_stmt *stmt;
-                char *sql = sqlite3_mprintf("SELECT id FROM categories WHERE label = '%q';", category_name);
-                int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
-                sqlite3_free(sql);
-
-                if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
-                    category_id = sqlite3_column_int(stmt, 0);
-                }
-                sqlite3_finalize(stmt);
-                json_object_put(parsed_json); // Free memory
+    http_post_all(url, headers, requests, count, &classifier_limits);
+
+    for (int i = 0; i < count; i++) {
+        if (requests[i].status == 200 && requests[i].response) {
+            // Extract choices[0].message.content
+            uint64_t timer = metrics_start();
+            struct json_object *parsed_json = json_tokener_parse(requests[i].response);
+            metrics_stop(METRIC_JSON_PARSE, timer);
+            struct json_object *choices = NULL, *choice, *message = NULL, *content = NULL;
+            json_object_object_get_ex(parsed_json, "choices", &choices);
+            choice = json_object_array_get_idx(choices, 0);
+            json_object_object_get_ex(choice, "message", &message);
+            json_object_object_get_ex(message, "content", &content);
+            if (content) {
+                replies[i] = strdup(json_object_get_string(content));
+            } else {
+                fprintf(stderr, "Unexpected response from classifier: %.200s\n", requests[i].response);
             }
+            json_object_put(parsed_json);
         }
+        free((char *)requests[i].body);
+        free(requests[i].response);
+    }
 
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
+    free(requests);
+    curl_slist_free_all(headers);
+}
+
+/**
+ * @brief Look up a category ID by its label in the context's label map.
+ *
+ * Surrounding whitespace and quotes in the label, which the model sometimes adds, are ignored.
+ *
+ * @return The category ID, or -1 if no category has that label.
+ */
+static int category_id_for_label(struct prompt_context *context, const char *label) {
+    while (*label && (isspace((unsigned char)*label) || *label == '"')) {
+        label++;
+    }
+    size_t len = strlen(label);
+    while (len > 0 && (isspace((unsigned char)label[len - 1]) || label[len - 1] == '"')) {
+        len--;
+    }
+
+    int category_id;
+    return hash_map_get(&context->labels, label, len, &category_id) ? category_id : -1;
+}
+
+/**
+ * @brief Get the category ID for a given transaction description.
+ *
+ * The normalized description is first looked up in the classification cache. On a miss, this function
+ * queries an external API (OpenAI GPT-4) to categorize the transaction, maps the answer to its
+ * category ID and caches it.
+ *
+ * @param context The classification context built by prompt_context_new.
+ * @param description The transaction description to be categorized.
+ * @return The category ID if found, otherwise -1.
+ */
+int get_category_id(struct prompt_context *context, const char *description) {
+    char key[256];
+    merchant_key(description, key, sizeof(key));
+    int category_id = key[0] ? category_cache_lookup(context, key) : -1;
+    if (category_id != -1) {
+        cache_hits++;
+        return category_id;
+    }
+    cache_misses++;
+
+    char *prompt;
+    size_t prompt_size;
+    FILE *stream = open_memstream(&prompt, &prompt_size);
+    fprintf(stream, "%sNow classify this transaction:\n\"%s\"\nReturn only the category name as a string.",
+            context->preamble, description);
+    fclose(stream);
+
+    char *category_name;
+    request_chat_completions((const char **)&prompt, 1, 0, &category_name);
+    free(prompt);
+    if (category_name) {
+        category_id = category_id_for_label(context, category_name);
+        free(category_name);
     }
 
+    if (category_id != -1 && key[0]) {
+        category_cache_store(context, key, category_id);
+    }
     return category_id;
 }
 
+/**
+ * @brief Classify several transaction descriptions with batched, concurrent requests.
+ *
+ * Descriptions already in the classification cache are answered from it. The rest are numbered
+ * and sent CLASSIFY_BATCH_SIZE distinct merchants per request, each request carrying one copy of
+ * the categories/examples preamble, and the requests run concurrently. The model is asked
+ * for a JSON object mapping each number to a category label. Items the reply leaves out, or
+ * labels that match no category, are left at -1 so the caller can retry them one at a time.
+ *
+ * @param context The classification context built by prompt_context_new.
+ * @param descriptions The transaction descriptions to classify.
+ * @param count Number of descriptions.
+ * @param category_ids Output array of count category IDs (-1 where unclassified).
+ * @return The number of descriptions that were classified.
+ */
+int classify_batch(struct prompt_context *context, const char **descriptions, int count, int *category_ids) {
+    int classified = 0;
+    int to_send = 0;
+    char (*keys)[256] = malloc(sizeof(*keys) * count);
+    int *same_as = malloc(sizeof(int) * count); // Earlier item with the same merchant key, or -1
+    if (!keys || !same_as) {
+        free(keys);
+        free(same_as);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        merchant_key(descriptions[i], keys[i], sizeof(keys[i]));
+        category_ids[i] = keys[i][0] ? category_cache_lookup(context, keys[i]) : -1;
+        same_as[i] = -1;
+        if (category_ids[i] != -1) {
+            cache_hits++;
+            classified++;
+            continue;
+        }
+        cache_misses++;
+        for (int j = 0; j < i && keys[i][0]; j++) {
+            if (same_as[j] == -1 && category_ids[j] == -1 && strcmp(keys[i], keys[j]) == 0) {
+                same_as[i] = j;
+                break;
+            }
+        }
+        if (same_as[i] == -1) {
+            to_send++;
+        }
+    }
+
+    if (to_send == 0) {
+        free(keys);
+        free(same_as);
+        return classified;
+    }
+
+    // One prompt per CLASSIFY_BATCH_SIZE distinct merchants; items keep their 1-based position as their number
+    int prompt_count = (to_send + CLASSIFY_BATCH_SIZE - 1) / CLASSIFY_BATCH_SIZE;
+    char **prompts = calloc(prompt_count, sizeof(char *));
+    char **replies = calloc(prompt_count, sizeof(char *));
+    struct json_object **labels = calloc(prompt_count, sizeof(struct json_object *));
+    int *prompt_of = malloc(sizeof(int) * count);
+    if (!prompts || !replies || !labels || !prompt_of) {
+        free(prompts);
+        free(replies);
+        free(labels);
+        free(prompt_of);
+        free(keys);
+        free(same_as);
+        return classified;
+    }
+
+    int sent = 0;
+    for (int i = 0; i < count; i++) {
+        prompt_of[i] = (category_ids[i] == -1 && same_as[i] == -1) ? sent++ / CLASSIFY_BATCH_SIZE : -1;
+    }
+    for (int p = 0; p < prompt_count; p++) {
+        size_t prompt_size;
+        FILE *prompt = open_memstream(&prompts[p], &prompt_size);
+        fprintf(prompt, "%sNow classify each of these numbered transactions:\n", context->preamble);
+        for (int i = 0; i < count; i++) {
+            if (prompt_of[i] == p) {
+                fprintf(prompt, "%d. \"%s\"\n", i + 1, descriptions[i]);
+            }
+        }
+        fprintf(prompt, "Return a JSON object whose keys are the transaction numbers and whose values are the category names.");
+        fclose(prompt);
+    }
+
+    request_chat_completions((const char **)prompts, prompt_count, 1, replies);
+    for (int p = 0; p < prompt_count; p++) {
+        if (replies[p]) {
+            uint64_t timer = metrics_start();
+            labels[p] = json_tokener_parse(replies[p]);
+            metrics_stop(METRIC_JSON_PARSE, timer);
+        }
+    }
+
+    // Items are visited in order, so an item's earlier twin has already been resolved
+    for (int i = 0; i < count; i++) {
+        if (category_ids[i] != -1) {
+            continue;
+        }
+        if (same_as[i] != -1) {
+            category_ids[i] = category_ids[same_as[i]];
+        } else {
+            char number[16];
+            snprintf(number, sizeof(number), "%d", i + 1);
+            struct json_object *label;
+            if (json_object_object_get_ex(labels[prompt_of[i]], number, &label)) {
+                category_ids[i] = category_id_for_label(context, json_object_get_string(label));
+            }
+            if (category_ids[i] != -1 && keys[i][0]) {
+                category_cache_store(context, keys[i], category_ids[i]);
+            }
+        }
+        if (category_ids[i] != -1) {
+            classified++;
+        }
+    }
+
+    for (int p = 0; p < prompt_count; p++) {
+        json_object_put(labels[p]);
+        free(prompts[p]);
+        free(replies[p]);
+    }
+    free(labels);
+    free(prompts);
+    free(replies);
+    free(prompt_of);
+    free(keys);
+    free(same_as);
+    return classified;
+}
+
 /**
  * @brief Create or update a category in the database.
  *
@@ -172,29 +546,29 @@ int get_category_id(sqlite3 *db, const char *description) {
  * @param description The description of the category.
  */
 void create_category(const char *label, const char *description) {
-    sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("budget.db", &db);
-
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+    sqlite3 *db = db_open();
+    if (!db) {
         return;
     }
 
     // Insert new category or update if it exists
-    char *sql = sqlite3_mprintf("INSERT INTO categories (label, description) VALUES ('%q', '%q') "
-                                "ON CONFLICT(label) DO UPDATE SET description=excluded.description;", label, description);
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-    sqlite3_free(sql);
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO categories (label, description) VALUES (?, ?) "
+                                    "ON CONFLICT(label) DO UPDATE SET description=excluded.description;");
+    if (!stmt) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+        return;
+    }
+    sqlite3_bind_text(stmt, 1, label, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, description, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    db_release(stmt);
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
     } else {
+        category_cache_clear(db);
         printf("Category created or updated: %s with description: %s\n", label, description);
     }
-
-    sqlite3_close(db);
 }
 
 /**
@@ -204,21 +578,14 @@ void create_category(const char *label, const char *description) {
  * displaying their IDs and labels.
  */
 void category_list() {
-    sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("budget.db", &db);
-
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+    sqlite3 *db = db_open();
+    if (!db) {
         return;
     }
 
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(db, "SELECT id, label FROM categories", -1, &stmt, 0);
-
-    if (rc != SQLITE_OK) {
+    sqlite3_stmt *stmt = db_prepare("SELECT id, label FROM categories");
+    if (!stmt) {
         fprintf(stderr, "Failed to fetch categories: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
         return;
     }
 
@@ -230,8 +597,7 @@ void category_list() {
         printf("%11d | %s\n", id, label);
     }
 
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    db_release(stmt);
 }
 /**
  * @brief Create examples for a specific category in the database.
@@ -242,31 +608,314 @@ void category_list() {
  * @param category_id The ID of the category to which the examples belong.
  */
 void create_category_examples(const char *examples, int category_id) {
-    sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("budget.db", &db);
+    sqlite3 *db = db_open();
+    if (!db) {
+        return;
+    }
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+    sqlite3_stmt *stmt = db_prepare("INSERT INTO category_examples (category_id, example) VALUES (?, ?);");
+    if (!stmt) {
+        fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
         return;
     }
 
     char *example = strtok((char *)examples, ",");
     while (example != NULL) {
-        char *sql = sqlite3_mprintf("INSERT INTO category_examples (category_id, example) VALUES (%d, '%q');", category_id, example);
-        rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
-        sqlite3_free(sql);
-
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "SQL error: %s\n", err_msg);
-            sqlite3_free(err_msg);
-            sqlite3_close(db);
+        sqlite3_bind_int(stmt, 1, category_id);
+        sqlite3_bind_text(stmt, 2, example, -1, SQLITE_STATIC);
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            db_release(stmt);
             return;
         }
 
         example = strtok(NULL, ",");
     }
+    db_release(stmt);
 
+    category_cache_clear(db);
     printf("Examples added to category ID %d\n", category_id);
-    sqlite3_close(db);
+}
+
+/**
+ * @brief Check a comma-separated list of category ids, such as "1,4", and rewrite it for SQL.
+ *
+ * The list is rebuilt from the parsed ids, so nothing but numbers reaches the SQL.
+ *
+ * @param err Where to write the error if the list is invalid.
+ * @return The ids separated by ", ", to be freed, or NULL after printing an error if the list is invalid.
+ */
+char *category_id_list(const char *categories, FILE *err) {
+    char *list = NULL;
+    size_t list_size;
+    FILE *stream = open_memstream(&list, &list_size);
+    for (const char *p = categories; *p;) {
+        char *end;
+        long id = strtol(p, &end, 10);
+        if (end == p || id < 0 || id > INT32_MAX || (*end != ',' && *end != '\0')) {
+            fprintf(err, "Invalid category list: %s (expected e.g. 1,4)\n", categories);
+            fclose(stream);
+            free(list);
+            return NULL;
+        }
+        fprintf(stream, "%s%ld", p == categories ? "" : ", ", id);
+        p = *end ? end + 1 : end;
+    }
+    fclose(stream);
+    return list;
+}
+
+/**
+ * @brief Relabel the debits whose category was assigned by an older category set.
+ *
+ * Stale rows (category_version missing or older than the current set, or every row with
+ * options->all) within the optional date range and current categories are gathered by distinct
+ * description, and descriptions sharing a merchant key are classified once, through
+ * classify_batch and the classification cache. The answers go into a temporary table, and the
+ * rows are then updated with a join against it, options->batch_size ids per database
+ * transaction. Rows whose merchant could not be classified stay stale for the next run.
+ *
+ * @param options Filters, batch size and classifier settings.
+ */
+void reclassify(const struct reclassify_options *options) {
+    sqlite3 *db = db_open();
+    if (!db) {
+        return;
+    }
+
+    int first_day = INT32_MIN, last_day = INT32_MAX;
+    if ((options->date_start && date_parse(options->date_start, strlen(options->date_start), "%Y-%m-%d", &first_day) != 0) ||
+        (options->date_end && date_parse(options->date_end, strlen(options->date_end), "%Y-%m-%d", &last_day) != 0)) {
+        fprintf(stderr, "Invalid date range (expected YYYY-MM-DD)\n");
+        return;
+    }
+    char *category_filter = NULL;
+    if (options->categories && *options->categories && !(category_filter = category_id_list(options->categories, stderr))) {
+        return;
+    }
+
+    classifier_configure(options->classifier_url, options->concurrency, options->requests_per_sec);
+    struct prompt_context *context = prompt_context_new(db);
+    if (!context || context->version <= 0) {
+        fprintf(stderr, "Failed to read the category set (has migrate_db.sh been run?)\n");
+        prompt_context_free(context);
+        free(category_filter);
+        return;
+    }
+
+    // The answers, joined against the transactions by the updates below
+    char *err_msg = 0;
+    if (sqlite3_exec(db, "CREATE TEMP TABLE IF NOT EXISTS reclassified(description TEXT PRIMARY KEY, category_id INTEGER) WITHOUT ROWID;"
+                         "DELETE FROM temp.reclassified;", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+    }
+
+    // ?1 version, ?2 and ?3 the day range, ?4 whether current labels are redone too
+    char filter[1024];
+    snprintf(filter, sizeof(filter),
+             "t.cents < 0 AND t.day >= ?2 AND t.day <= ?3 AND (?4 OR t.category_version IS NULL OR t.category_version <> ?1)%s%s%s",
+             category_filter ? " AND t.category_id IN (" : "", category_filter ? category_filter : "", category_filter ? ")" : "");
+    free(category_filter);
+    char sql[1536];
+    snprintf(sql, sizeof(sql), "SELECT t.description, COUNT(*) FROM transactions AS t WHERE %s GROUP BY t.description;", filter);
+    sqlite3_stmt *stale_stmt = db_prepare(sql);
+    // The confirm and relabel statements split the matching rows by whether their label changes,
+    // so each row is counted by one of them even with --all
+    snprintf(sql, sizeof(sql),
+             "UPDATE transactions AS t SET category_id = r.category_id, category_version = ?1 FROM temp.reclassified AS r "
+             "WHERE t.description = r.description AND t.id >= ?5 AND t.id < ?6 AND t.category_id IS NOT r.category_id AND %s;",
+             filter);
+    sqlite3_stmt *relabel_stmt = db_prepare(sql);
+    snprintf(sql, sizeof(sql),
+             "UPDATE transactions AS t SET category_version = ?1 FROM temp.reclassified AS r "
+             "WHERE t.description = r.description AND t.id >= ?5 AND t.id < ?6 AND t.category_id IS r.category_id AND %s;",
+             filter);
+    sqlite3_stmt *confirm_stmt = NULL;
+    sqlite3_stmt *result_stmt = NULL;
+    sqlite3_stmt *range_stmt = NULL;
+    if (!stale_stmt || !relabel_stmt || !(confirm_stmt = db_prepare(sql)) ||
+        !(result_stmt = db_prepare("INSERT INTO temp.reclassified (description, category_id) VALUES (?, ?);")) ||
+        !(range_stmt = db_prepare("SELECT MIN(id), MAX(id) FROM transactions;"))) {
+        fprintf(stderr, "Failed to prepare reclassify statements: %s (has migrate_db.sh been run?)\n", sqlite3_errmsg(db));
+        db_release(stale_stmt);
+        db_release(relabel_stmt);
+        db_release(confirm_stmt);
+        db_release(result_stmt);
+        db_release(range_stmt);
+        prompt_context_free(context);
+        return;
+    }
+    sqlite3_stmt *filtered[] = { stale_stmt, confirm_stmt, relabel_stmt };
+    for (int i = 0; i < 3; i++) {
+        sqlite3_bind_int(filtered[i], 1, context->version);
+        sqlite3_bind_int(filtered[i], 2, first_day);
+        sqlite3_bind_int(filtered[i], 3, last_day);
+        sqlite3_bind_int(filtered[i], 4, options->all != 0);
+    }
+
+    // Distinct stale descriptions, each pointing at the first description with its merchant key
+    char **descriptions = NULL;
+    int *merchant_of = NULL;
+    int description_count = 0, capacity = 0, merchant_count = 0;
+    long long stale_rows = 0;
+    struct hash_map merchants;
+    int failed = hash_map_init(&merchants, 1024) != 0;
+    while (!failed && sqlite3_step(stale_stmt) == SQLITE_ROW) {
+        const char *description = (const char *)sqlite3_column_text(stale_stmt, 0);
+        if (!description) {
+            continue;
+        }
+        if (description_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            char **grown = realloc(descriptions, sizeof(char *) * capacity);
+            int *grown_merchants = grown ? realloc(merchant_of, sizeof(int) * capacity) : NULL;
+            if (grown) {
+                descriptions = grown;
+            }
+            if (!grown || !grown_merchants) {
+                failed = 1;
+                break;
+            }
+            merchant_of = grown_merchants;
+        }
+        char key[256];
+        merchant_key(description, key, sizeof(key));
+        int first;
+        if (!key[0]) {
+            first = description_count;
+        } else if (!hash_map_get(&merchants, key, strlen(key), &first)) {
+            first = description_count;
+            hash_map_put(&merchants, key, first);
+        }
+        if (!(descriptions[description_count] = strdup(description))) {
+            failed = 1;
+            break;
+        }
+        merchant_count += first == description_count;
+        merchant_of[description_count++] = first;
+        stale_rows += sqlite3_column_int64(stale_stmt, 1);
+    }
+    sqlite3_reset(stale_stmt);
+    hash_map_free(&merchants);
+    if (failed) {
+        fprintf(stderr, "Out of memory reading stale transactions\n");
+    }
+    printf("%lld stale transactions, %d distinct descriptions, %d merchants (category set version %d)\n", stale_rows,
+           description_count, merchant_count, context->version);
+
+    // Classify one description per merchant, a classify_batch call's worth at a time
+    int *category_ids = malloc(sizeof(int) * (description_count > 0 ? description_count : 1));
+    const char **pending = malloc(sizeof(char *) * (merchant_count > 0 ? merchant_count : 1));
+    int *pending_of = malloc(sizeof(int) * (merchant_count > 0 ? merchant_count : 1));
+    int chunk = CLASSIFY_BATCH_SIZE * (options->concurrency > 0 ? options->concurrency : 1);
+    int classified = 0;
+    if (!category_ids || !pending || !pending_of) {
+        failed = 1;
+    }
+    for (int i = 0, next = 0; !failed && i < description_count; i++) {
+        if (merchant_of[i] == i) {
+            pending[next] = descriptions[i];
+            pending_of[next++] = i;
+        }
+        if (next == chunk || (i == description_count - 1 && next > 0)) {
+            int *answers = malloc(sizeof(int) * next);
+            if (!answers) {
+                failed = 1;
+                break;
+            }
+            classify_batch(context, pending, next, answers);
+            for (int j = 0; j < next; j++) {
+                category_ids[pending_of[j]] = answers[j] != -1 ? answers[j] : get_category_id(context, pending[j]);
+                classified += category_ids[pending_of[j]] != -1;
+            }
+            free(answers);
+            next = 0;
+        }
+    }
+
+    // Every description takes its merchant's answer; unanswered ones are left out and stay stale
+    failed = failed || db_exec("BEGIN;") != 0;
+    for (int i = 0; !failed && i < description_count; i++) {
+        int category_id = category_ids[merchant_of[i]];
+        if (category_id == -1) {
+            continue;
+        }
+        sqlite3_bind_text(result_stmt, 1, descriptions[i], -1, SQLITE_STATIC);
+        sqlite3_bind_int(result_stmt, 2, category_id);
+        if (sqlite3_step(result_stmt) != SQLITE_DONE) {
+            fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+            failed = 1;
+        }
+        sqlite3_reset(result_stmt);
+    }
+    if (!failed && db_exec("COMMIT;") != 0) {
+        failed = 1;
+    }
+    if (failed) {
+        sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    }
+
+    // Walk the ids in ranges, one transaction each, so a large history never holds the write lock for long
+    long long updated = 0, changed = 0;
+    int batch_size = options->batch_size > 0 ? options->batch_size : 5000;
+    if (!failed && sqlite3_step(range_stmt) == SQLITE_ROW && sqlite3_column_type(range_stmt, 0) != SQLITE_NULL) {
+        sqlite3_int64 min_id = sqlite3_column_int64(range_stmt, 0);
+        sqlite3_int64 max_id = sqlite3_column_int64(range_stmt, 1);
+        for (sqlite3_int64 from = min_id; from <= max_id && !failed; from += batch_size) {
+            long long range_updated = 0, range_changed = 0;
+            if (db_exec("BEGIN;") != 0) {
+                failed = 1;
+                break;
+            }
+            for (int i = 1; i < 3 && !failed; i++) {
+                sqlite3_bind_int64(filtered[i], 5, from);
+                sqlite3_bind_int64(filtered[i], 6, from + batch_size);
+                if (sqlite3_step(filtered[i]) != SQLITE_DONE) {
+                    fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+                    failed = 1;
+                }
+                int rows = sqlite3_changes(db);
+                range_updated += rows;
+                range_changed += filtered[i] == relabel_stmt ? rows : 0;
+                sqlite3_reset(filtered[i]);
+            }
+            // A range only counts once it is committed
+            if (failed || db_exec("COMMIT;") != 0) {
+                failed = 1;
+                sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            } else {
+                updated += range_updated;
+                changed += range_changed;
+            }
+        }
+    }
+    sqlite3_reset(range_stmt);
+    sqlite3_exec(db, "DROP TABLE IF EXISTS temp.reclassified;", 0, 0, 0);
+
+    printf("Reclassified %lld transactions (%lld changed category) from %d of %d merchants\n", updated, changed,
+           classified, merchant_count);
+    if (!failed && updated < stale_rows) {
+        printf("%lld transactions could not be classified and stay stale for the next run\n", stale_rows - updated);
+    }
+    category_cache_print_stats();
+    http_print_stats();
+
+    for (int i = 0; i < description_count; i++) {
+        free(descriptions[i]);
+    }
+    free(descriptions);
+    free(merchant_of);
+    free(category_ids);
+    free(pending);
+    free(pending_of);
+    db_release(stale_stmt);
+    db_release(relabel_stmt);
+    db_release(confirm_stmt);
+    db_release(result_stmt);
+    db_release(range_stmt);
+    prompt_context_free(context);
 }
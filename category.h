@@ -1,9 +1,38 @@
 #ifndef CATEGORY_H
 #define CATEGORY_H
 
-int get_category_id(sqlite3 *db, const char *description);
+// Maximum number of distinct descriptions classified by one request
+#define CLASSIFY_BATCH_SIZE 25
+
+struct prompt_context;
+
+/**
+ * @brief Which transactions reclassify relabels, and how it sends classification requests.
+ */
+struct reclassify_options {
+    const char *date_start;     /**< First day (YYYY-MM-DD), or NULL for no lower bound. */
+    const char *date_end;       /**< Last day, inclusive, or NULL for no upper bound. */
+    const char *categories;     /**< Comma-separated ids of the current categories to limit to, or NULL. */
+    int all;                    /**< Also relabel rows already labelled by the current category set. */
+    int batch_size;             /**< Transaction ids updated per database transaction. */
+    int concurrency;            /**< Maximum classification requests in flight at once. */
+    double requests_per_sec;    /**< Maximum classification request rate. */
+    const char *classifier_url; /**< Chat completions endpoint, or NULL for the default. */
+};
+
+struct prompt_context *prompt_context_new(sqlite3 *db);
+void prompt_context_free(struct prompt_context *context);
+int prompt_context_version(const struct prompt_context *context);
+int get_category_id(struct prompt_context *context, const char *description);
+int classify_batch(struct prompt_context *context, const char **descriptions, int count, int *category_ids);
+void classifier_configure(const char *url, int max_in_flight, double requests_per_sec);
 void create_category(const char *label, const char *description);
 void category_list();
 void create_category_examples(const char *examples, int category_id);
+void merchant_key(const char *description, char *key, size_t size);
+void category_cache_clear(sqlite3 *db);
+void category_cache_print_stats(void);
+char *category_id_list(const char *categories, FILE *err);
+void reclassify(const struct reclassify_options *options);
 
 #endif
\ No newline at end of file
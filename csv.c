@@ -0,0 +1,338 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "csv.h"
+
+// Initial read buffer size for inputs that cannot be memory-mapped
+#define CSV_BLOCK_SIZE (1 << 20)
+// Returned by parse_record when the buffer ends inside a record
+#define CSV_NEED_MORE -2
+
+/**
+ * @brief Open a CSV file for reading.
+ *
+ * Regular files are memory-mapped; "-", pipes and other special files are read in blocks.
+ *
+ * @param reader The reader to initialize.
+ * @param filename The path to the file, or "-" for standard input.
+ * @return 0 on success, -1 if the file could not be opened.
+ */
+int csv_open(struct csv_reader *reader, const char *filename) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (reader->fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        reader->mapped = 1;
+        reader->eof = 1;
+        reader->size = st.st_size;
+        if (st.st_size == 0) {
+            return 0;
+        }
+        reader->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (reader->data != MAP_FAILED) {
+            posix_madvise(reader->data, st.st_size, POSIX_MADV_SEQUENTIAL);
+            return 0;
+        }
+        reader->data = NULL;
+        reader->mapped = 0;
+        reader->eof = 0;
+        reader->size = 0;
+    }
+
+    reader->capacity = CSV_BLOCK_SIZE;
+    reader->data = malloc(reader->capacity);
+    if (!reader->data) {
+        csv_close(reader);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the next block of an unmapped input, keeping the unfinished record at the front of the buffer.
+ *
+ * @return The number of bytes read, 0 at end of input, or -1 on error.
+ */
+static ssize_t csv_fill(struct csv_reader *reader) {
+    if (reader->pos > 0) {
+        memmove(reader->data, reader->data + reader->pos, reader->size - reader->pos);
+        reader->consumed += reader->pos;
+        reader->size -= reader->pos;
+        reader->pos = 0;
+    }
+    if (reader->size == reader->capacity) {
+        char *data = realloc(reader->data, reader->capacity * 2);
+        if (!data) {
+            return -1;
+        }
+        reader->data = data;
+        reader->capacity *= 2;
+    }
+
+    ssize_t n = read(reader->fd, reader->data + reader->size, reader->capacity - reader->size);
+    if (n > 0) {
+        reader->size += n;
+    } else {
+        reader->eof = 1;
+    }
+    return n;
+}
+
+/**
+ * @brief Tokenize one record starting at *pos.
+ *
+ * @param final Non-zero if no more data will follow the buffer.
+ * @return The number of fields in the record (possibly more than max_fields), 0 at end of input,
+ *         or CSV_NEED_MORE if the buffer ends inside the record and final is zero.
+ */
+static int parse_record(const char *data, size_t size, size_t *pos, struct csv_field *fields, int max_fields, int final) {
+    size_t p = *pos;
+    if (p >= size) {
+        return final ? 0 : CSV_NEED_MORE;
+    }
+
+    int count = 0;
+    for (;;) {
+        const char *start;
+        size_t len;
+        int escaped = 0;
+
+        if (p < size && data[p] == '"') {
+            // Quoted field: runs to the next quote that is not doubled, and may span lines
+            size_t q = p + 1;
+            for (;;) {
+                const char *quote = memchr(data + q, '"', size - q);
+                if (!quote) {
+                    if (!final) {
+                        return CSV_NEED_MORE;
+                    }
+                    quote = data + size;
+                }
+                q = quote - data;
+                if (q + 1 < size && data[q + 1] == '"') {
+                    escaped = 1;
+                    q += 2;
+                    continue;
+                }
+                if (q + 1 >= size && q < size && !final) {
+                    return CSV_NEED_MORE;
+                }
+                break;
+            }
+            start = data + p + 1;
+            len = q - (p + 1);
+            p = q < size ? q + 1 : size;
+            // Tolerate stray characters between the closing quote and the delimiter
+            while (p < size && data[p] != ',' && data[p] != '\n' && data[p] != '\r') {
+                p++;
+            }
+            if (p == size && !final) {
+                return CSV_NEED_MORE;
+            }
+        } else {
+            size_t q = p;
+            while (q < size && data[q] != ',' && data[q] != '\n' && data[q] != '\r') {
+                q++;
+            }
+            if (q == size && !final) {
+                return CSV_NEED_MORE;
+            }
+            start = data + p;
+            len = q - p;
+            p = q;
+        }
+
+        if (count < max_fields) {
+            fields[count].data = start;
+            fields[count].len = len;
+            fields[count].escaped = escaped;
+        }
+        count++;
+
+        if (p >= size) {
+            break;
+        }
+        if (data[p] == ',') {
+            p++;
+            continue;
+        }
+        if (data[p] == '\r') {
+            p++;
+        }
+        if (p < size && data[p] == '\n') {
+            p++;
+        }
+        break;
+    }
+
+    *pos = p;
+    return count;
+}
+
+/**
+ * @brief Read the next record.
+ *
+ * @param reader The reader.
+ * @param fields Output array receiving up to max_fields field views.
+ * @param max_fields Capacity of fields.
+ * @return The number of fields in the record (which may exceed max_fields), 0 at end of input, or -1 on error.
+ */
+int csv_next_record(struct csv_reader *reader, struct csv_field *fields, int max_fields) {
+    for (;;) {
+        size_t pos = reader->pos;
+        int count = parse_record(reader->data, reader->size, &pos, fields, max_fields, reader->eof);
+        if (count != CSV_NEED_MORE) {
+            reader->pos = pos;
+            return count;
+        }
+        if (csv_fill(reader) < 0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Read the record starting at *pos of a complete in-memory input.
+ *
+ * Lets several threads tokenize different parts of one memory-mapped file. Unlike
+ * csv_next_record it keeps no state, so the caller must start at a record boundary.
+ *
+ * @param data The whole input.
+ * @param size Size of the input.
+ * @param pos Offset of the record; advanced past it.
+ * @param fields Output array receiving up to max_fields field views.
+ * @param max_fields Capacity of fields.
+ * @return The number of fields in the record, or 0 at end of input.
+ */
+int csv_record_at(const char *data, size_t size, size_t *pos, struct csv_field *fields, int max_fields) {
+    return parse_record(data, size, pos, fields, max_fields, 1);
+}
+
+/**
+ * @brief Byte offset in the input just past the last record returned.
+ */
+size_t csv_offset(const struct csv_reader *reader) {
+    return reader->consumed + reader->pos;
+}
+
+/**
+ * @brief Continue reading a memory-mapped input at offset, which must be the start of a record.
+ *
+ * @return 0 on success, -1 if the input is not mapped or offset is past its end.
+ */
+int csv_seek(struct csv_reader *reader, size_t offset) {
+    if (!reader->mapped || offset > reader->size) {
+        return -1;
+    }
+    reader->pos = offset;
+    return 0;
+}
+
+/**
+ * @brief Copy a field into a NUL-terminated buffer, collapsing doubled quotes.
+ *
+ * @param field The field to copy.
+ * @param out The destination buffer.
+ * @param size Size of the destination; longer fields are truncated.
+ * @return The number of bytes written, excluding the terminator.
+ */
+size_t csv_field_copy(const struct csv_field *field, char *out, size_t size) {
+    size_t len = 0;
+    for (size_t i = 0; i < field->len && len + 1 < size; i++) {
+        out[len++] = field->data[i];
+        if (field->escaped && field->data[i] == '"' && i + 1 < field->len && field->data[i + 1] == '"') {
+            i++;
+        }
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/**
+ * @brief Release the mapping or buffer and close the input.
+ */
+void csv_close(struct csv_reader *reader) {
+    if (reader->mapped) {
+        if (reader->data) {
+            munmap(reader->data, reader->size);
+        }
+    } else {
+        free(reader->data);
+    }
+    if (reader->fd > STDIN_FILENO) {
+        close(reader->fd);
+    }
+    reader->data = NULL;
+    reader->fd = -1;
+}
+
+/**
+ * @brief Column layout of a known bank export.
+ *
+ * Supported banks:
+ * - wellsfargo: "date","amount","*","","description" with MM/DD/YYYY dates and no header (the default).
+ * - chase: Transaction Date,Post Date,Description,Category,Type,Amount,Memo with a header row.
+ * - generic: date,amount,description with YYYY-MM-DD dates and a header row.
+ *
+ * @param bank The bank name.
+ * @param columns Receives the column layout.
+ * @return 0 on success, -1 if the bank is not known.
+ */
+int csv_columns_preset(const char *bank, struct csv_columns *columns) {
+    if (strcmp(bank, "wellsfargo") == 0) {
+        *columns = (struct csv_columns){ .date = 0, .charge = 1, .description = 4, .date_format = "%m/%d/%Y", .header = 0 };
+    } else if (strcmp(bank, "chase") == 0) {
+        *columns = (struct csv_columns){ .date = 0, .charge = 5, .description = 2, .date_format = "%m/%d/%Y", .header = 1 };
+    } else if (strcmp(bank, "generic") == 0) {
+        *columns = (struct csv_columns){ .date = 0, .charge = 1, .description = 2, .date_format = "%Y-%m-%d", .header = 1 };
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Override column positions from a "date=N,charge=N,description=N" specification.
+ *
+ * Positions are zero-based; columns not named in the specification keep their current position.
+ *
+ * @param spec The specification.
+ * @param columns The column layout to update.
+ * @return 0 on success, -1 if the specification is malformed.
+ */
+int csv_columns_parse(const char *spec, struct csv_columns *columns) {
+    while (*spec) {
+        int *column;
+        size_t name_len = strcspn(spec, "=");
+        if (name_len == 4 && strncmp(spec, "date", 4) == 0) {
+            column = &columns->date;
+        } else if (name_len == 6 && strncmp(spec, "charge", 6) == 0) {
+            column = &columns->charge;
+        } else if (name_len == 11 && strncmp(spec, "description", 11) == 0) {
+            column = &columns->description;
+        } else {
+            return -1;
+        }
+        if (spec[name_len] != '=') {
+            return -1;
+        }
+
+        char *end;
+        long value = strtol(spec + name_len + 1, &end, 10);
+        if (end == spec + name_len + 1 || value < 0 || value >= CSV_MAX_FIELDS || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        *column = (int)value;
+        spec = *end == ',' ? end + 1 : end;
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include <stddef.h>
+
+// Largest number of fields read from one record; extra fields are ignored
+#define CSV_MAX_FIELDS 64
+
+/**
+ * @brief A field of the current record, pointing into the reader's buffer.
+ *
+ * Quoted fields are returned without their surrounding quotes. If escaped is set the field still
+ * contains doubled quotes ("") and must be read with csv_field_copy.
+ */
+struct csv_field {
+    const char *data;
+    size_t len;
+    int escaped;
+};
+
+/**
+ * @brief Streaming RFC 4180 CSV tokenizer.
+ *
+ * Regular files are memory-mapped and fields point straight into the mapping. Pipes and other
+ * unmappable inputs are read in large blocks into a buffer that grows to fit the longest record,
+ * in which case fields are only valid until the next call to csv_next_record.
+ */
+struct csv_reader {
+    int fd;
+    char *data;          /**< Mapping or read buffer. */
+    size_t size;         /**< Bytes of data available. */
+    size_t pos;          /**< Start of the next record within data. */
+    size_t capacity;     /**< Read buffer capacity (0 when mapped). */
+    size_t consumed;     /**< Bytes discarded from the front of the read buffer so far. */
+    int mapped;
+    int eof;
+};
+
+/**
+ * @brief Which columns hold the fields import_csv needs, and how dates are written.
+ */
+struct csv_columns {
+    int date;
+    int charge;
+    int description;
+    const char *date_format; /**< strptime format of the date column. */
+    int header;              /**< Non-zero if the first record is a header row. */
+};
+
+int csv_open(struct csv_reader *reader, const char *filename);
+int csv_next_record(struct csv_reader *reader, struct csv_field *fields, int max_fields);
+int csv_record_at(const char *data, size_t size, size_t *pos, struct csv_field *fields, int max_fields);
+size_t csv_offset(const struct csv_reader *reader);
+int csv_seek(struct csv_reader *reader, size_t offset);
+size_t csv_field_copy(const struct csv_field *field, char *out, size_t size);
+void csv_close(struct csv_reader *reader);
+int csv_columns_preset(const char *bank, struct csv_columns *columns);
+int csv_columns_parse(const char *spec, struct csv_columns *columns);
+
+#endif
@@ -0,0 +1,155 @@
+#define _XOPEN_SOURCE 700 // needed for strptime
+#include <string.h>
+#include <time.h>
+#include "date.h"
+
+/**
+ * @brief Number of days from 1970-01-01 to a date of the proleptic Gregorian calendar.
+ *
+ * Transactions store dates as this day number, so ranges and sorting are plain integer
+ * comparisons. Uses the era-based algorithm, which needs no tables and no floating point.
+ *
+ * @param year The year.
+ * @param month The month (1-12).
+ * @param day The day of the month (1-31).
+ * @return The day number; negative before 1970.
+ */
+int date_days_from_civil(int year, int month, int day) {
+    year -= month <= 2;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int year_of_era = year - era * 400;
+    int day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+/**
+ * @brief Inverse of date_days_from_civil.
+ */
+void date_civil_from_days(int days, int *year, int *month, int *day) {
+    days += 719468;
+    int era = (days >= 0 ? days : days - 146096) / 146097;
+    int day_of_era = days - era * 146097;
+    int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int shifted_month = (5 * day_of_year + 2) / 153;
+    *day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    *month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+    *year = year_of_era + era * 400 + (*month <= 2);
+}
+
+/**
+ * @brief Read exactly count decimal digits.
+ */
+static int read_digits(const char *text, int count, int *value) {
+    *value = 0;
+    for (int i = 0; i < count; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return -1;
+        }
+        *value = *value * 10 + (text[i] - '0');
+    }
+    return 0;
+}
+
+/**
+ * @brief Read one or two decimal digits, advancing *pos.
+ */
+static int read_short_number(const char *text, size_t len, size_t *pos, int *value) {
+    size_t start = *pos;
+    *value = 0;
+    while (*pos < len && *pos - start < 2 && text[*pos] >= '0' && text[*pos] <= '9') {
+        *value = *value * 10 + (text[*pos] - '0');
+        (*pos)++;
+    }
+    return *pos > start ? 0 : -1;
+}
+
+/**
+ * @brief Check that a day exists in the given month.
+ */
+static int valid_date(int year, int month, int day) {
+    static const int days_in_month[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (month < 1 || month > 12 || day < 1) {
+        return 0;
+    }
+    int leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    return day <= days_in_month[month - 1] + (month == 2 && leap);
+}
+
+/**
+ * @brief Parse a date into a day number.
+ *
+ * The formats bank exports use, "%m/%d/%Y", "%d/%m/%Y" and "%Y-%m-%d", are parsed by hand
+ * (single-digit months and days are accepted in the slash forms); any other strptime format
+ * falls back to strptime. The text need not be NUL-terminated.
+ *
+ * @param text The date text.
+ * @param len Length of the text.
+ * @param format The strptime format the text is written in.
+ * @param days Receives the day number.
+ * @return 0 on success, -1 if the text is not a valid date in that format.
+ */
+int date_parse(const char *text, size_t len, const char *format, int *days) {
+    int year, month, day;
+    if (strcmp(format, "%Y-%m-%d") == 0) {
+        if (len != 10 || text[4] != '-' || text[7] != '-' || read_digits(text, 4, &year) != 0 ||
+            read_digits(text + 5, 2, &month) != 0 || read_digits(text + 8, 2, &day) != 0) {
+            return -1;
+        }
+    } else if (strcmp(format, "%m/%d/%Y") == 0 || strcmp(format, "%d/%m/%Y") == 0) {
+        int first, second;
+        size_t pos = 0;
+        if (read_short_number(text, len, &pos, &first) != 0 || pos >= len || text[pos++] != '/' ||
+            read_short_number(text, len, &pos, &second) != 0 || pos >= len || text[pos++] != '/' ||
+            len - pos != 4 || read_digits(text + pos, 4, &year) != 0) {
+            return -1;
+        }
+        month = format[1] == 'm' ? first : second;
+        day = format[1] == 'm' ? second : first;
+    } else {
+        char buffer[64];
+        struct tm tm = {0};
+        if (len >= sizeof(buffer)) {
+            return -1;
+        }
+        memcpy(buffer, text, len);
+        buffer[len] = '\0';
+        const char *end = strptime(buffer, format, &tm);
+        if (!end || *end != '\0') {
+            return -1;
+        }
+        year = tm.tm_year + 1900;
+        month = tm.tm_mon + 1;
+        day = tm.tm_mday;
+    }
+
+    if (!valid_date(year, month, day)) {
+        return -1;
+    }
+    *days = date_days_from_civil(year, month, day);
+    return 0;
+}
+
+/**
+ * @brief Write a day number as YYYY-MM-DD.
+ *
+ * Digits are written directly rather than with snprintf, since import formats every row's
+ * date to compute its fingerprint. Years outside 0-9999 are clamped to keep the fixed width.
+ */
+void date_format(int days, char out[11]) {
+    int year, month, day;
+    date_civil_from_days(days, &year, &month, &day);
+    year = year < 0 ? 0 : year > 9999 ? 9999 : year;
+    out[0] = '0' + year / 1000;
+    out[1] = '0' + year / 100 % 10;
+    out[2] = '0' + year / 10 % 10;
+    out[3] = '0' + year % 10;
+    out[4] = '-';
+    out[5] = '0' + month / 10;
+    out[6] = '0' + month % 10;
+    out[7] = '-';
+    out[8] = '0' + day / 10;
+    out[9] = '0' + day % 10;
+    out[10] = '\0';
+}
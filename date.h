@@ -0,0 +1,11 @@
+#ifndef DATE_H
+#define DATE_H
+
+#include <stddef.h>
+
+int date_days_from_civil(int year, int month, int day);
+void date_civil_from_days(int days, int *year, int *month, int *day);
+int date_parse(const char *text, size_t len, const char *format, int *days);
+void date_format(int days, char out[11]);
+
+#endif
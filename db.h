@@ -0,0 +1,15 @@
+#ifndef DB_H
+#define DB_H
+
+// Database used when neither --db nor $BUDGET_DB names one
+#define DB_DEFAULT_PATH "budget.db"
+
+void db_configure(const char *path);
+const char *db_path(void);
+sqlite3 *db_open(void);
+sqlite3_stmt *db_prepare(const char *sql);
+void db_release(sqlite3_stmt *stmt);
+int db_exec(const char *sql);
+void db_close(void);
+
+#endif
@@ -0,0 +1,345 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include "emit.h"
+
+/**
+ * @brief Look up an output format by name.
+ *
+ * @param name "json", "ndjson", "yaml" or "csv".
+ * @param format Receives the format.
+ * @return 0 on success, -1 if the name is not known.
+ */
+int emit_format_parse(const char *name, enum emit_format *format) {
+    if (strcmp(name, "json") == 0) {
+        *format = EMIT_JSON;
+    } else if (strcmp(name, "ndjson") == 0) {
+        *format = EMIT_NDJSON;
+    } else if (strcmp(name, "yaml") == 0) {
+        *format = EMIT_YAML;
+    } else if (strcmp(name, "csv") == 0) {
+        *format = EMIT_CSV;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write a double-quoted JSON string, which is also a valid YAML double-quoted scalar.
+ *
+ * Runs of characters that need no escaping are written in one call.
+ */
+static void write_quoted(FILE *out, const char *value) {
+    putc('"', out);
+    const char *run = value;
+    const char *p = value;
+    for (; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        fwrite(run, 1, p - run, out);
+        switch (c) {
+        case '"':
+            fputs("\\\"", out);
+            break;
+        case '\\':
+            fputs("\\\\", out);
+            break;
+        case '\n':
+            fputs("\\n", out);
+            break;
+        case '\r':
+            fputs("\\r", out);
+            break;
+        case '\t':
+            fputs("\\t", out);
+            break;
+        default:
+            fprintf(out, "\\u%04x", c);
+            break;
+        }
+        run = p + 1;
+    }
+    fwrite(run, 1, p - run, out);
+    putc('"', out);
+}
+
+/**
+ * @brief Whether a string can be written as a YAML plain scalar and still read back as the same string.
+ *
+ * Strings that start with an indicator character, contain ": " or " #", hold control characters,
+ * or would be read as a number, boolean or null are quoted instead.
+ */
+static int yaml_plain(const char *value) {
+    size_t len = strlen(value);
+    if (len == 0 || strchr("-?:,[]{}#&*!|>'\"%@` ", value[0]) || value[len - 1] == ' ' || value[len - 1] == ':' ||
+        strstr(value, ": ") || strstr(value, " #")) {
+        return 0;
+    }
+    for (const char *p = value; *p; p++) {
+        if ((unsigned char)*p < 0x20 || *p == 0x7f) {
+            return 0;
+        }
+    }
+    static const char *const keywords[] = { "true", "false", "yes", "no", "on", "off", "null", "~", "y", "n" };
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        if (strcasecmp(value, keywords[i]) == 0) {
+            return 0;
+        }
+    }
+    char *end;
+    strtod(value, &end);
+    return *end != '\0';
+}
+
+/**
+ * @brief Write a CSV field, quoting it if it holds a delimiter, quote, line break or edge space.
+ */
+static void write_csv_field(FILE *out, const char *value) {
+    size_t len = strlen(value);
+    if (strpbrk(value, ",\"\r\n") == NULL && (len == 0 || (value[0] != ' ' && value[len - 1] != ' '))) {
+        fwrite(value, 1, len, out);
+        return;
+    }
+    putc('"', out);
+    const char *run = value;
+    const char *quote;
+    while ((quote = strchr(run, '"')) != NULL) {
+        fwrite(run, 1, quote - run + 1, out);
+        putc('"', out);
+        run = quote + 1;
+    }
+    fputs(run, out);
+    putc('"', out);
+}
+
+/**
+ * @brief Write the separator and name that precede the next field of the current record.
+ */
+static void begin_field(struct emitter *emitter) {
+    const char *name = emitter->field < emitter->column_count ? emitter->columns[emitter->field] : "";
+    FILE *out = emitter->out;
+    if (emitter->summary && emitter->format != EMIT_NDJSON) {
+        // Page-level fields are members of the document's mapping rather than of a record
+        if (emitter->format == EMIT_CSV) {
+            fprintf(out, "#%s,", name);
+        } else {
+            fputs(emitter->format == EMIT_JSON ? ", \"" : "", out);
+            fputs(name, out);
+            fputs(emitter->format == EMIT_JSON ? "\": " : ": ", out);
+        }
+        emitter->field++;
+        return;
+    }
+    switch (emitter->format) {
+    case EMIT_JSON:
+        fputs(emitter->field == 0 ? "{ \"" : ", \"", out);
+        fputs(name, out);
+        fputs("\": ", out);
+        break;
+    case EMIT_NDJSON:
+        fputs(emitter->field == 0 ? "{\"" : ",\"", out);
+        fputs(name, out);
+        fputs("\":", out);
+        break;
+    case EMIT_YAML:
+        fputs(emitter->field == 0 ? "- " : "  ", out);
+        fputs(name, out);
+        fputs(": ", out);
+        break;
+    case EMIT_CSV:
+        if (emitter->field > 0) {
+            putc(',', out);
+        }
+        break;
+    }
+    emitter->field++;
+}
+
+/**
+ * @brief End a field that takes a line of its own: every YAML field, and CSV page-level fields.
+ */
+static void end_field(struct emitter *emitter) {
+    if (emitter->format == EMIT_YAML || (emitter->format == EMIT_CSV && emitter->summary)) {
+        putc('\n', emitter->out);
+    }
+}
+
+/**
+ * @brief Finish the current record, if any.
+ */
+static void end_record(struct emitter *emitter) {
+    if (emitter->records == 0) {
+        return;
+    }
+    switch (emitter->format) {
+    case EMIT_JSON:
+        fputs(emitter->field > 0 ? " }" : "{ }", emitter->out);
+        break;
+    case EMIT_NDJSON:
+        fputs(emitter->field > 0 ? "}\n" : "{}\n", emitter->out);
+        break;
+    case EMIT_YAML:
+        if (emitter->field == 0) {
+            fputs("- {}\n", emitter->out);
+        }
+        break;
+    case EMIT_CSV:
+        putc('\n', emitter->out);
+        break;
+    }
+}
+
+/**
+ * @brief Start a document.
+ *
+ * @param emitter The emitter to initialize.
+ * @param out The stream to write to.
+ * @param format The output format.
+ * @param columns Field names, which must outlive the emitter.
+ * @param column_count Number of fields in each record.
+ */
+void emit_begin(struct emitter *emitter, FILE *out, enum emit_format format, const char *const *columns, int column_count) {
+    *emitter = (struct emitter){ .out = out, .format = format, .columns = columns, .column_count = column_count };
+    if (format == EMIT_CSV) {
+        for (int i = 0; i < column_count; i++) {
+            if (i > 0) {
+                putc(',', out);
+            }
+            write_csv_field(out, columns[i]);
+        }
+        putc('\n', out);
+    }
+}
+
+/**
+ * @brief Start a page document, which holds the records under a name followed by page-level fields.
+ *
+ * JSON pages are one object and YAML pages one mapping, with the records under name and the fields
+ * given to emit_summary beside them. NDJSON pages end with the fields as one last object, and CSV
+ * pages with one "#name,value" line per field after the rows.
+ *
+ * @param name The name of the records, which must outlive the emitter.
+ */
+void emit_begin_page(struct emitter *emitter, FILE *out, enum emit_format format, const char *const *columns, int column_count,
+                     const char *name) {
+    emit_begin(emitter, out, format, columns, column_count);
+    emitter->page = name;
+    if (format == EMIT_JSON) {
+        fputs("{ \"", out);
+        fputs(name, out);
+        fputs("\": ", out);
+    } else if (format == EMIT_YAML) {
+        fputs(name, out);
+        putc(':', out);
+    }
+}
+
+/**
+ * @brief Finish the previous record and start a new one.
+ */
+void emit_record(struct emitter *emitter) {
+    end_record(emitter);
+    if (emitter->format == EMIT_JSON) {
+        fputs(emitter->records == 0 ? "[ " : ", ", emitter->out);
+    } else if (emitter->format == EMIT_YAML && emitter->page && emitter->records == 0) {
+        putc('\n', emitter->out);
+    }
+    emitter->records++;
+    emitter->field = 0;
+}
+
+/**
+ * @brief Emit a string field; NULL is written as null (or an empty CSV field).
+ */
+void emit_string(struct emitter *emitter, const char *value) {
+    begin_field(emitter);
+    FILE *out = emitter->out;
+    if (emitter->format == EMIT_CSV) {
+        write_csv_field(out, value ? value : "");
+    } else if (!value) {
+        fputs("null", out);
+    } else if (emitter->format == EMIT_YAML && yaml_plain(value)) {
+        fputs(value, out);
+    } else {
+        write_quoted(out, value);
+    }
+    end_field(emitter);
+}
+
+/**
+ * @brief Emit an integer field.
+ */
+void emit_int(struct emitter *emitter, long long value) {
+    begin_field(emitter);
+    fprintf(emitter->out, "%lld", value);
+    end_field(emitter);
+}
+
+/**
+ * @brief Emit an amount of cents as an exact decimal number.
+ *
+ * JSON drops a trailing zero of the cents as JSON serializers do for doubles (12.5, 3.0), YAML and
+ * CSV always write two decimals like the table output.
+ */
+void emit_cents(struct emitter *emitter, long long cents) {
+    begin_field(emitter);
+    unsigned long long magnitude = cents < 0 ? 0ULL - (unsigned long long)cents : (unsigned long long)cents;
+    unsigned long long whole = magnitude / 100, fraction = magnitude % 100;
+    const char *sign = cents < 0 ? "-" : "";
+    FILE *out = emitter->out;
+    if (emitter->format == EMIT_YAML || emitter->format == EMIT_CSV) {
+        fprintf(out, "%s%llu.%02llu", sign, whole, fraction);
+    } else if (fraction % 10 == 0) {
+        fprintf(out, "%s%llu.%llu", sign, whole, fraction / 10);
+    } else {
+        fprintf(out, "%s%llu.%02llu", sign, whole, fraction);
+    }
+    end_field(emitter);
+}
+
+/**
+ * @brief Finish the last record of a page and start its page-level fields.
+ *
+ * The fields are then emitted in the order of names, as those of a record are.
+ *
+ * @param names Field names, which must outlive the emitter.
+ * @param count Number of fields.
+ */
+void emit_summary(struct emitter *emitter, const char *const *names, int count) {
+    end_record(emitter);
+    if (emitter->format == EMIT_JSON) {
+        fputs(emitter->records == 0 ? "[ ]" : " ]", emitter->out);
+    } else if (emitter->format == EMIT_YAML && emitter->records == 0) {
+        fputs(" []\n", emitter->out);
+    }
+    emitter->columns = names;
+    emitter->column_count = count;
+    emitter->field = 0;
+    emitter->summary = 1;
+}
+
+/**
+ * @brief Finish the last record and the document.
+ */
+void emit_end(struct emitter *emitter) {
+    if (emitter->page && !emitter->summary) {
+        emit_summary(emitter, NULL, 0);
+    }
+    if (emitter->summary) {
+        if (emitter->format == EMIT_JSON) {
+            fputs(" }\n", emitter->out);
+        } else if (emitter->format == EMIT_NDJSON) {
+            fputs(emitter->field > 0 ? "}\n" : "{}\n", emitter->out);
+        }
+        return;
+    }
+    end_record(emitter);
+    if (emitter->format == EMIT_JSON) {
+        fputs(emitter->records == 0 ? "[ ]\n" : " ]\n", emitter->out);
+    }
+}
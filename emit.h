@@ -0,0 +1,45 @@
+#ifndef EMIT_H
+#define EMIT_H
+
+#include <stdio.h>
+
+/**
+ * @brief Machine-readable output formats.
+ */
+enum emit_format {
+    EMIT_JSON,   /**< One JSON array of objects. */
+    EMIT_NDJSON, /**< One JSON object per line. */
+    EMIT_YAML,   /**< A YAML sequence of mappings. */
+    EMIT_CSV     /**< CSV with a header row, quoted as in RFC 4180. */
+};
+
+/**
+ * @brief Streaming writer of records with a fixed list of named fields.
+ *
+ * Every field is written to the output stream as soon as it is emitted, so memory use does not
+ * depend on the number of records. A record is started with emit_record and its fields are then
+ * emitted in the order of the column names.
+ */
+struct emitter {
+    FILE *out;
+    enum emit_format format;
+    const char *const *columns;
+    int column_count;
+    int field;    /**< Index of the next field of the current record. */
+    long records; /**< Records started so far. */
+    const char *page; /**< Name of the records of a page document, or NULL. */
+    int summary;      /**< Whether the page-level fields after the records are being written. */
+};
+
+int emit_format_parse(const char *name, enum emit_format *format);
+void emit_begin(struct emitter *emitter, FILE *out, enum emit_format format, const char *const *columns, int column_count);
+void emit_begin_page(struct emitter *emitter, FILE *out, enum emit_format format, const char *const *columns, int column_count,
+                     const char *name);
+void emit_record(struct emitter *emitter);
+void emit_summary(struct emitter *emitter, const char *const *names, int count);
+void emit_string(struct emitter *emitter, const char *value);
+void emit_int(struct emitter *emitter, long long value);
+void emit_cents(struct emitter *emitter, long long cents);
+void emit_end(struct emitter *emitter);
+
+#endif
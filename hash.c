@@ -0,0 +1,235 @@
+#define _XOPEN_SOURCE 700
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * @brief Compute a 64-bit FNV-1a hash.
+ *
+ * @param data The bytes to hash.
+ * @param len The number of bytes to hash.
+ * @param hash The starting hash, HASH_FNV_OFFSET or the result of a previous call to chain fields.
+ * @return The updated hash.
+ */
+uint64_t hash_fnv1a(const void *data, size_t len, uint64_t hash) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * @brief Mix the bits of a key so that linear probing spreads well even for weak hashes.
+ */
+static size_t slot_for(uint64_t key, size_t capacity) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key & (capacity - 1);
+}
+
+/**
+ * @brief Initialize an empty set sized for the expected number of keys.
+ *
+ * @param set The set to initialize.
+ * @param expected The number of keys the set is expected to hold.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int hash_set_init(struct hash_set *set, size_t expected) {
+    size_t capacity = 16;
+    while (capacity < expected * 2) {
+        capacity <<= 1;
+    }
+    set->slots = calloc(capacity, sizeof(uint64_t));
+    set->capacity = set->slots ? capacity : 0;
+    set->count = 0;
+    return set->slots ? 0 : -1;
+}
+
+/**
+ * @brief Check whether a key is in the set.
+ *
+ * @param set The set to search.
+ * @param key The key to look up.
+ * @return 1 if the key is present, otherwise 0.
+ */
+int hash_set_contains(const struct hash_set *set, uint64_t key) {
+    if (key == 0) {
+        key = 1;
+    }
+    for (size_t i = slot_for(key, set->capacity); set->slots[i] != 0; i = (i + 1) & (set->capacity - 1)) {
+        if (set->slots[i] == key) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Double the capacity of the set and re-insert every key.
+ */
+static int hash_set_grow(struct hash_set *set) {
+    struct hash_set bigger;
+    if (hash_set_init(&bigger, set->capacity) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->slots[i] != 0) {
+            hash_set_add(&bigger, set->slots[i]);
+        }
+    }
+    free(set->slots);
+    *set = bigger;
+    return 0;
+}
+
+/**
+ * @brief Add a key to the set.
+ *
+ * @param set The set to add to.
+ * @param key The key to add.
+ * @return 1 if the key was added, 0 if it was already present, -1 if memory could not be allocated.
+ */
+int hash_set_add(struct hash_set *set, uint64_t key) {
+    if (key == 0) {
+        key = 1;
+    }
+    if ((set->count + 1) * 2 > set->capacity && hash_set_grow(set) != 0) {
+        return -1;
+    }
+    size_t i = slot_for(key, set->capacity);
+    while (set->slots[i] != 0) {
+        if (set->slots[i] == key) {
+            return 0;
+        }
+        i = (i + 1) & (set->capacity - 1);
+    }
+    set->slots[i] = key;
+    set->count++;
+    return 1;
+}
+
+/**
+ * @brief Release the memory held by a set.
+ */
+void hash_set_free(struct hash_set *set) {
+    free(set->slots);
+    set->slots = NULL;
+    set->capacity = 0;
+    set->count = 0;
+}
+
+/**
+ * @brief Initialize an empty map sized for the expected number of keys.
+ *
+ * @param map The map to initialize.
+ * @param expected The number of keys the map is expected to hold.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int hash_map_init(struct hash_map *map, size_t expected) {
+    size_t capacity = 16;
+    while (capacity < expected * 2) {
+        capacity <<= 1;
+    }
+    map->keys = calloc(capacity, sizeof(char *));
+    map->values = calloc(capacity, sizeof(int));
+    map->count = 0;
+    if (!map->keys || !map->values) {
+        free(map->keys);
+        free(map->values);
+        map->keys = NULL;
+        map->values = NULL;
+        map->capacity = 0;
+        return -1;
+    }
+    map->capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Find the slot holding a key, or the empty slot where it would be inserted.
+ */
+static size_t hash_map_slot(const struct hash_map *map, const char *key, size_t len) {
+    size_t i = slot_for(hash_fnv1a(key, len, HASH_FNV_OFFSET), map->capacity);
+    while (map->keys[i] && !(strncmp(map->keys[i], key, len) == 0 && map->keys[i][len] == '\0')) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    return i;
+}
+
+/**
+ * @brief Look up a key in the map.
+ *
+ * @param map The map to search.
+ * @param key The key, which need not be NUL-terminated.
+ * @param len The length of the key.
+ * @param value Receives the value if the key is present.
+ * @return 1 if the key is present, otherwise 0.
+ */
+int hash_map_get(const struct hash_map *map, const char *key, size_t len, int *value) {
+    size_t i = hash_map_slot(map, key, len);
+    if (!map->keys[i]) {
+        return 0;
+    }
+    *value = map->values[i];
+    return 1;
+}
+
+/**
+ * @brief Insert a key or replace its value.
+ *
+ * @param map The map to update.
+ * @param key The NUL-terminated key, which is copied.
+ * @param value The value to store.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int hash_map_put(struct hash_map *map, const char *key, int value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        struct hash_map bigger;
+        if (hash_map_init(&bigger, map->capacity) != 0) {
+            return -1;
+        }
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i]) {
+                size_t j = hash_map_slot(&bigger, map->keys[i], strlen(map->keys[i]));
+                bigger.keys[j] = map->keys[i];
+                bigger.values[j] = map->values[i];
+                bigger.count++;
+            }
+        }
+        free(map->keys);
+        free(map->values);
+        *map = bigger;
+    }
+
+    size_t len = strlen(key);
+    size_t i = hash_map_slot(map, key, len);
+    if (!map->keys[i]) {
+        map->keys[i] = strdup(key);
+        if (!map->keys[i]) {
+            return -1;
+        }
+        map->count++;
+    }
+    map->values[i] = value;
+    return 0;
+}
+
+/**
+ * @brief Release the memory held by a map, including its copies of the keys.
+ */
+void hash_map_free(struct hash_map *map) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        free(map->keys[i]);
+    }
+    free(map->keys);
+    free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_FNV_OFFSET 14695981039346656037ULL
+
+uint64_t hash_fnv1a(const void *data, size_t len, uint64_t hash);
+
+/**
+ * @brief Open-addressing set of 64-bit hashes.
+ *
+ * Zero is used as the empty-slot marker, so a key of 0 is stored as 1.
+ */
+struct hash_set {
+    uint64_t *slots;
+    size_t capacity;
+    size_t count;
+};
+
+int hash_set_init(struct hash_set *set, size_t expected);
+int hash_set_contains(const struct hash_set *set, uint64_t key);
+int hash_set_add(struct hash_set *set, uint64_t key);
+void hash_set_free(struct hash_set *set);
+
+/**
+ * @brief Open-addressing map from strings to integers.
+ *
+ * Keys are copied into the map.
+ */
+struct hash_map {
+    char **keys;
+    int *values;
+    size_t capacity;
+    size_t count;
+};
+
+int hash_map_init(struct hash_map *map, size_t expected);
+int hash_map_get(const struct hash_map *map, const char *key, size_t len, int *value);
+int hash_map_put(struct hash_map *map, const char *key, int value);
+void hash_map_free(struct hash_map *map);
+
+#endif
@@ -0,0 +1,277 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include "http.h"
+#include "metrics.h"
+
+#define REQUEST_PENDING 0
+#define REQUEST_IN_FLIGHT 1
+#define REQUEST_DONE 2
+
+// Floor for the adaptive request rate, so a burst of 429s never stalls an import completely
+#define MIN_REQUESTS_PER_SEC 0.2
+// First retry waits about this long; each further retry doubles it
+#define RETRY_BASE_DELAY 0.5
+
+static int stat_requests = 0;
+static int stat_retries = 0;
+static int stat_throttled = 0;
+static int stat_failed = 0;
+
+/**
+ * @brief Monotonic wall-clock time in seconds.
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Callback function to write data received from cURL.
+ *
+ * This function is used by cURL to append the received data to the response of a request.
+ *
+ * @param contents Pointer to the data received.
+ * @param size Size of each element in bytes.
+ * @param nmemb Number of elements.
+ * @param userp Pointer to the struct http_request being received.
+ * @return Total number of bytes written to the buffer, or 0 if memory could not be allocated.
+ */
+static size_t WriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t totalSize = size * nmemb;
+    struct http_request *request = userp;
+    char *data = realloc(request->response, request->response_len + totalSize + 1);
+    if (!data) {
+        return 0;
+    }
+    memcpy(data + request->response_len, contents, totalSize);
+    request->response = data;
+    request->response_len += totalSize;
+    request->response[request->response_len] = '\0';
+    return totalSize;
+}
+
+/**
+ * @brief Callback function recording the Retry-After header of a response.
+ *
+ * Only the delay-seconds form is understood; an HTTP-date is treated as absent.
+ */
+static size_t HeaderCallback(char *buffer, size_t size, size_t nitems, void *userp) {
+    size_t totalSize = size * nitems;
+    struct http_request *request = userp;
+    if (totalSize > 12 && strncasecmp(buffer, "Retry-After:", 12) == 0) {
+        request->retry_after = atof(buffer + 12);
+    }
+    return totalSize;
+}
+
+/**
+ * @brief Create the easy handle for the next attempt of a request.
+ */
+static CURL *start_attempt(CURLM *multi, const char *url, struct curl_slist *headers, struct http_request *request) {
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return NULL;
+    }
+
+    free(request->response);
+    request->response = NULL;
+    request->response_len = 0;
+    request->retry_after = 0;
+    request->attempts++;
+    stat_requests++;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request->body);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, request);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, request);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, request);
+    curl_multi_add_handle(multi, curl);
+    request->state = REQUEST_IN_FLIGHT;
+    return curl;
+}
+
+/**
+ * @brief POST several request bodies to one URL concurrently.
+ *
+ * Requests are multiplexed with the curl multi interface, with at most limits->max_in_flight
+ * on the wire at once. Starts are paced by a token bucket refilled at an adaptive rate: a 429
+ * or 5xx response halves the rate and a success lets it creep back towards
+ * limits->requests_per_sec. Failed attempts are retried after an exponential backoff with
+ * random jitter, or after the server's Retry-After delay when one is given, during which no
+ * new requests are started.
+ *
+ * The function returns once every request has either succeeded or run out of retries.
+ *
+ * @param url The URL to POST to.
+ * @param headers Headers sent with every request.
+ * @param requests The requests to run; status, response and attempts are filled in.
+ * @param count Number of requests.
+ * @param limits Concurrency, rate and retry limits.
+ */
+void http_post_all(const char *url, struct curl_slist *headers, struct http_request *requests, int count,
+                   const struct http_limits *limits) {
+    static int seeded = 0;
+    if (!seeded) {
+        srand48(time(NULL) ^ getpid());
+        seeded = 1;
+    }
+
+    CURLM *multi = curl_multi_init();
+    int max_in_flight = limits->max_in_flight > 0 ? limits->max_in_flight : 1;
+    double max_rate = limits->requests_per_sec > 0 ? limits->requests_per_sec : 1;
+    double rate = max_rate;
+    double tokens = max_in_flight;
+    double last_refill = now_seconds();
+    double paused_until = 0;
+    int in_flight = 0;
+    int done = 0;
+
+    for (int i = 0; i < count; i++) {
+        requests[i].status = 0;
+        requests[i].response = NULL;
+        requests[i].response_len = 0;
+        requests[i].attempts = 0;
+        requests[i].not_before = 0;
+        requests[i].state = REQUEST_PENDING;
+    }
+
+    while (done < count) {
+        double now = now_seconds();
+        tokens += (now - last_refill) * rate;
+        if (tokens > max_in_flight) {
+            tokens = max_in_flight;
+        }
+        last_refill = now;
+
+        // Start as many ready requests as the in-flight bound and the token bucket allow
+        double next_wakeup = now + 1.0;
+        for (int i = 0; i < count && in_flight < max_in_flight; i++) {
+            struct http_request *request = &requests[i];
+            if (request->state != REQUEST_PENDING) {
+                continue;
+            }
+            double ready_at = request->not_before > paused_until ? request->not_before : paused_until;
+            if (ready_at > now) {
+                if (ready_at < next_wakeup) {
+                    next_wakeup = ready_at;
+                }
+                continue;
+            }
+            if (tokens < 1) {
+                double token_at = now + (1 - tokens) / rate;
+                if (token_at < next_wakeup) {
+                    next_wakeup = token_at;
+                }
+                break;
+            }
+            if (!start_attempt(multi, url, headers, request)) {
+                request->state = REQUEST_DONE;
+                stat_failed++;
+                done++;
+                continue;
+            }
+            tokens -= 1;
+            in_flight++;
+        }
+
+        int running;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL *curl = msg->easy_handle;
+            struct http_request *request;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&request);
+            request->status = 0;
+            if (msg->data.result == CURLE_OK) {
+                curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &request->status);
+            }
+            if (metrics_enabled) {
+                curl_off_t total_us = 0, sent = 0, received = 0;
+                curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_us);
+                curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+                curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+                metrics_observe(METRIC_HTTP_REQUEST, (uint64_t)total_us * 1000);
+                metrics_count(METRIC_HTTP_BYTES_SENT, (uint64_t)sent);
+                metrics_count(METRIC_HTTP_BYTES_RECEIVED, (uint64_t)received);
+            }
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, curl);
+            curl_easy_cleanup(curl);
+            in_flight--;
+
+            int throttled = request->status == 429 || request->status >= 500;
+            if (result == CURLE_OK && !throttled) {
+                // Additive increase back towards the configured rate
+                rate += 0.1 * max_rate;
+                if (rate > max_rate) {
+                    rate = max_rate;
+                }
+                request->state = REQUEST_DONE;
+                done++;
+                continue;
+            }
+
+            if (throttled) {
+                stat_throttled++;
+                rate /= 2;
+                if (rate < MIN_REQUESTS_PER_SEC) {
+                    rate = MIN_REQUESTS_PER_SEC;
+                }
+            }
+            if (request->attempts > limits->max_retries) {
+                if (result != CURLE_OK) {
+                    fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(result));
+                } else {
+                    fprintf(stderr, "HTTP request failed with status %ld\n", request->status);
+                }
+                stat_failed++;
+                request->state = REQUEST_DONE;
+                done++;
+                continue;
+            }
+
+            // Exponential backoff with +/-50% jitter, or the server's own Retry-After
+            double delay = RETRY_BASE_DELAY * (1 << (request->attempts - 1)) * (0.5 + drand48());
+            if (request->retry_after > 0) {
+                delay = request->retry_after;
+                paused_until = now_seconds() + delay;
+            }
+            request->not_before = now_seconds() + delay;
+            request->state = REQUEST_PENDING;
+            stat_retries++;
+        }
+
+        if (done < count) {
+            int timeout_ms = (int)((next_wakeup - now_seconds()) * 1000);
+            if (timeout_ms < 1) {
+                timeout_ms = 1;
+            }
+            curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+        }
+    }
+
+    curl_multi_cleanup(multi);
+}
+
+/**
+ * @brief Print the request, retry and failure counters for this process.
+ */
+void http_print_stats(void) {
+    printf("HTTP requests: %d sent, %d retried, %d throttled (429/5xx), %d failed\n",
+           stat_requests, stat_retries, stat_throttled, stat_failed);
+}
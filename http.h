@@ -0,0 +1,36 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <curl/curl.h>
+
+/**
+ * @brief One POST request run by http_post_all.
+ *
+ * The caller fills in body; http_post_all fills in the rest. The response must be freed by the caller.
+ */
+struct http_request {
+    const char *body;     /**< Request body. */
+    long status;          /**< Final HTTP status, or 0 if no response was received. */
+    char *response;       /**< Response body of the final attempt (NUL-terminated), or NULL. */
+    size_t response_len;  /**< Length of response. */
+    int attempts;         /**< Number of times the request was sent. */
+    double retry_after;   /**< Internal: Retry-After seconds from the last response, or 0. */
+    double not_before;    /**< Internal: earliest time the next attempt may start. */
+    int state;            /**< Internal: pending, in flight or done. */
+};
+
+/**
+ * @brief Concurrency and rate limits for http_post_all.
+ */
+struct http_limits {
+    int max_in_flight;        /**< Maximum number of requests on the wire at once. */
+    double requests_per_sec;  /**< Token bucket refill rate; lowered on 429/5xx and recovered on success. */
+    int max_retries;          /**< Retries per request after a transport error, 429 or 5xx. */
+};
+
+void http_post_all(const char *url, struct curl_slist *headers, struct http_request *requests, int count,
+                   const struct http_limits *limits);
+void http_print_stats(void);
+
+#endif
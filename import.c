@@ -5,117 +5,1484 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include "category.h"
+#include "csv.h"
+#include "date.h"
+#include "db.h"
+#include "metrics.h"
+#include "hash.h"
+#include "import.h"
+#include "http.h"
+#include "local_classifier.h"
+#include "queue.h"
 
+// Batches each pipeline queue holds before its producer blocks
+#define IMPORT_QUEUE_DEPTH 8
+// Bytes just before a checkpoint that --since-checkpoint compares instead of the whole prefix
+#define CHECKPOINT_TAIL 4096
 
 /**
- * @brief Import transactions from a CSV file into the database.
+ * @brief Compute the duplicate-detection fingerprint of a transaction.
  *
- * This function reads transaction data from a CSV file and imports it into the SQLite3 database.
- * It supports overwriting existing transactions if specified.
+ * The fingerprint hashes the date, the charge in whole cents and the description with
+ * surrounding whitespace trimmed, inner whitespace collapsed and letters upper-cased, so
+ * re-exports of the same statement line map to the same value.
  *
- * @param filename The path to the CSV file containing transaction data.
- * @param overwrite Flag indicating whether to overwrite existing transactions (1 for true, 0 for false).
+ * The date is hashed in its YYYY-MM-DD form, as it was when dates were stored as text, so
+ * fingerprints stored before the switch to day numbers still match.
+ *
+ * @param day The transaction date as days since 1970-01-01.
+ * @param cents The transaction amount in cents.
+ * @param description The transaction description as it appears in the statement.
+ * @param description_len Length of the description in bytes.
+ * @return The fingerprint as stored in transactions.fingerprint.
+ */
+static sqlite3_int64 transaction_fingerprint(int day, long long cents, const char *description, size_t description_len) {
+    char date[11];
+    date_format(day, date);
+    uint64_t hash = hash_fnv1a(date, sizeof(date), HASH_FNV_OFFSET);
+    hash = hash_fnv1a(&cents, sizeof(cents), hash);
+
+    int pending_space = 0, started = 0;
+    const unsigned char *end = (const unsigned char *)description + description_len;
+    for (const unsigned char *p = (const unsigned char *)description; p < end; p++) {
+        if (isspace(*p)) {
+            pending_space = 1;
+            continue;
+        }
+        if (pending_space && started) {
+            hash = hash_fnv1a(" ", 1, hash);
+        }
+        pending_space = 0;
+        started = 1;
+        unsigned char c = toupper(*p);
+        hash = hash_fnv1a(&c, 1, hash);
+    }
+    return (sqlite3_int64)hash;
+}
+
+/**
+ * @brief SQL wrapper around transaction_fingerprint, used to backfill rows stored before fingerprints existed.
+ */
+static void sql_transaction_fingerprint(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void)argc;
+    const char *description = (const char *)sqlite3_value_text(argv[2]);
+    sqlite3_result_int64(context, transaction_fingerprint(sqlite3_value_int(argv[0]), sqlite3_value_int64(argv[1]),
+                                                          description ? description : "", sqlite3_value_bytes(argv[2])));
+}
+
+/**
+ * @brief Load the stored fingerprints of one month into the in-memory duplicate set.
+ *
+ * Months are loaded the first time a row from them is seen, so the set only ever holds the
+ * date window covered by the file being imported.
+ *
+ * @param stmt Prepared "fingerprints in date range" statement.
+ * @param seen The duplicate set to fill.
+ * @param year The year of the month to load.
+ * @param month The month to load (1-12).
+ * @return 0 on success, -1 on SQL or memory failure.
+ */
+static int load_month_fingerprints(sqlite3_stmt *stmt, struct hash_set *seen, int year, int month) {
+    sqlite3_bind_int(stmt, 1, date_days_from_civil(year, month, 1));
+    sqlite3_bind_int(stmt, 2, date_days_from_civil(month == 12 ? year + 1 : year, month == 12 ? 1 : month + 1, 1));
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (hash_set_add(seen, (uint64_t)sqlite3_column_int64(stmt, 0)) < 0) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+    }
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * @brief A parsed row on its way through the dedup, classify and write stages.
  */
-void import_csv(const char *filename, int overwrite) {
-    printf("Importing data from %s\n", filename);
+struct pending_row {
+    int day;         /**< Days since 1970-01-01. */
+    long long cents;
+    const char *description; /**< Points into the batch's text. */
+    size_t text_offset;      /**< Offset of the description in the batch's text. */
+    sqlite3_int64 fingerprint;
+    int year;
+    int month;       /**< 1-12. */
+    int exists;      /**< Row is already stored and is being reclassified (--overwrite). */
+    int category_id; /**< -1 until classified. */
+};
+
+/**
+ * @brief How far into a file the import has got, as stored in import_ledger.
+ */
+struct checkpoint {
+    const char *source;   /**< Absolute path of the file, or NULL if the input cannot be resumed. */
+    size_t offset;        /**< Bytes of the file whose records have all been handled. */
+    int records;          /**< Records before offset, header included. */
+    uint64_t prefix_hash; /**< FNV-1a of the bytes before offset. */
+    uint64_t tail_hash;   /**< FNV-1a of the last CHECKPOINT_TAIL bytes before offset. */
+};
+
+/**
+ * @brief Rows passed from one pipeline stage to the next together.
+ *
+ * Descriptions are copied into one NUL-separated text buffer per batch, so a batch owns
+ * everything it points to and the input file can be closed while it is still queued.
+ * Batches travel even when every row was dropped if they carry a checkpoint, so the
+ * writer learns how far the input has been handled.
+ */
+struct row_batch {
+    struct pending_row *rows;
+    int count;
+    int capacity;
+    char *text;
+    size_t text_len;
+    size_t text_capacity;
+    struct checkpoint checkpoint; /**< Progress once the batch is written; source is NULL if none. */
+};
+
+/**
+ * @brief Row counts and wall time of one pipeline stage.
+ */
+struct stage_stats {
+    int rows_in;
+    int rows_out;
+    double seconds; /**< From the stage starting to it finishing, including time blocked on queues. */
+};
+
+/**
+ * @brief State of one import pipeline.
+ *
+ * Each stage runs on its own thread and only touches its own fields, so none of them need
+ * locking. All stages share the database connection, which is opened in serialized mode.
+ */
+struct import_state {
     sqlite3 *db;
-    char *err_msg = 0;
-    int rc = sqlite3_open("budget.db", &db);
+    const struct csv_columns *columns;
+    int batch_rows;            /**< Rows per batch. */
+    struct queue parsed;       /**< Parse stage to dedup stage. */
+    struct queue deduplicated; /**< Dedup stage to classify stage. */
+    struct queue classified;   /**< Classify stage to write stage. */
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
+    // Parse stage
+    char **inputs;
+    char **sources;            /**< Absolute path of each input, once opened; NULL if it cannot be resumed. */
+    int input_count;
+    int jobs;
+    sqlite3_stmt *ledger_stmt;
+    int since_checkpoint;
+    const char *data;          /**< The current input's mapping, for checkpoint hashes. */
+    struct checkpoint progress; /**< The current input's last checkpoint. */
+    size_t consumed;           /**< Offset just past the last record read from the current input. */
+    int record;                /**< Records read from the current input, for messages and checkpoints. */
+    struct row_batch *batch;   /**< Batch being filled. */
+    int rows;                  /**< Data records read, including credits and duplicates. */
+    struct stage_stats parse;
+
+    // Dedup stage
+    sqlite3_stmt *window_stmt;
+    struct hash_set *seen;          /**< Fingerprints of stored and queued transactions. */
+    struct hash_set *loaded_months; /**< Months (year * 12 + month) already loaded into seen. */
+    int overwrite;
+    struct stage_stats dedup;
+
+    // Classify stage
+    struct prompt_context *context;
+    struct local_classifier *local; /**< NULL unless a local threshold was given. */
+    double local_threshold;
+    int local_rows;
+    int remote_rows;
+    double local_seconds;
+    double remote_seconds;
+    struct stage_stats classify;
+
+    // Write stage
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *update_stmt;
+    sqlite3_stmt *checkpoint_stmt;
+    int category_version;         /**< category_set version the classifier was built from. */
+    struct checkpoint checkpoint; /**< Progress of the last batch written. */
+    int checkpoint_dirty;         /**< checkpoint has not been stored yet. */
+    int batch_size;
+    int in_batch;
+    int inserted;
+    int updated;
+    struct stage_stats write;
+};
+
+/**
+ * @brief Monotonic wall-clock time in seconds, used for throughput reporting.
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Allocate an empty batch with room for capacity rows.
+ */
+static struct row_batch *batch_new(int capacity) {
+    struct row_batch *batch = calloc(1, sizeof(struct row_batch));
+    if (!batch) {
+        return NULL;
+    }
+    batch->capacity = capacity;
+    batch->text_capacity = (size_t)capacity * 64;
+    batch->rows = malloc(sizeof(struct pending_row) * capacity);
+    batch->text = malloc(batch->text_capacity);
+    if (!batch->rows || !batch->text) {
+        free(batch->rows);
+        free(batch->text);
+        free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+static void batch_free(struct row_batch *batch) {
+    if (!batch) {
         return;
     }
+    free(batch->rows);
+    free(batch->text);
+    free(batch);
+}
+
+/**
+ * @brief Copy a description into the batch's text buffer.
+ *
+ * @return The offset of the copy, or -1 if the buffer could not grow.
+ */
+static long batch_add_text(struct row_batch *batch, const char *text, size_t len) {
+    if (batch->text_len + len + 1 > batch->text_capacity) {
+        size_t capacity = batch->text_capacity * 2;
+        while (batch->text_len + len + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *grown = realloc(batch->text, capacity);
+        if (!grown) {
+            return -1;
+        }
+        batch->text = grown;
+        batch->text_capacity = capacity;
+    }
+    long offset = (long)batch->text_len;
+    memcpy(batch->text + batch->text_len, text, len);
+    batch->text[batch->text_len + len] = '\0';
+    batch->text_len += len + 1;
+    return offset;
+}
 
-    char *sql = "CREATE TABLE IF NOT EXISTS transactions("
-                "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-                "date TEXT, "
-                "charge REAL, "
-                "description TEXT);";
+/**
+ * @brief Classify the rows of a batch that still need a category.
+ *
+ * Rows are first offered to the local classifier, if enabled, which keeps its answer when it is
+ * at least local_threshold confident. The rest are classified with one classify_batch call,
+ * which sends concurrent batched requests, and rows the replies left out fall back to
+ * get_category_id. Remote answers are fed back into the local classifier.
+ *
+ * @return 0 on success, -1 if memory ran out and no row was classified.
+ */
+static int classify_rows(struct import_state *state, struct row_batch *batch) {
+    const char **descriptions = malloc(sizeof(char *) * batch->count);
+    int *category_ids = malloc(sizeof(int) * batch->count);
+    int *indexes = malloc(sizeof(int) * batch->count);
+    if (batch->count > 0 && (!descriptions || !category_ids || !indexes)) {
+        fprintf(stderr, "Out of memory classifying %d rows\n", batch->count);
+        free(descriptions);
+        free(category_ids);
+        free(indexes);
+        return -1;
+    }
+    int count = 0;
+    double started = now_seconds();
+    for (int i = 0; i < batch->count; i++) {
+        struct pending_row *row = &batch->rows[i];
+        if (row->category_id != -1) {
+            continue;
+        }
+        if (state->local) {
+            double confidence;
+            int category_id = local_classifier_classify(state->local, row->description, &confidence);
+            if (category_id != -1 && confidence >= state->local_threshold) {
+                row->category_id = category_id;
+                state->local_rows++;
+                continue;
+            }
+        }
+        descriptions[count] = row->description;
+        indexes[count++] = i;
+    }
+    state->local_seconds += now_seconds() - started;
 
-    rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+    if (count > 0) {
+        started = now_seconds();
+        uint64_t timer = metrics_start();
+        classify_batch(state->context, descriptions, count, category_ids);
+        metrics_stop(METRIC_CLASSIFY_BATCH, timer);
+        for (int i = 0; i < count; i++) {
+            struct pending_row *row = &batch->rows[indexes[i]];
+            row->category_id = category_ids[i] != -1 ? category_ids[i] : get_category_id(state->context, row->description);
+            if (state->local && row->category_id > 0) {
+                local_classifier_add(state->local, row->description, row->category_id);
+            }
+        }
+        state->remote_rows += count;
+        state->remote_seconds += now_seconds() - started;
+    }
+    free(descriptions);
+    free(category_ids);
+    free(indexes);
+    return 0;
+}
 
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
-        sqlite3_free(err_msg);
-        sqlite3_close(db);
+/**
+ * @brief Store the checkpoint of the last batch written, if it changed.
+ *
+ * Called just before each commit, so the checkpoint is committed together with the rows it
+ * covers and never claims rows that were not stored.
+ */
+static void save_checkpoint(struct import_state *state) {
+    if (!state->checkpoint_dirty) {
         return;
     }
+    const struct checkpoint *checkpoint = &state->checkpoint;
+    sqlite3_bind_text(state->checkpoint_stmt, 1, checkpoint->source, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(state->checkpoint_stmt, 2, (sqlite3_int64)checkpoint->offset);
+    sqlite3_bind_int(state->checkpoint_stmt, 3, checkpoint->records);
+    sqlite3_bind_int64(state->checkpoint_stmt, 4, (sqlite3_int64)checkpoint->prefix_hash);
+    sqlite3_bind_int64(state->checkpoint_stmt, 5, (sqlite3_int64)checkpoint->tail_hash);
+    if (sqlite3_step(state->checkpoint_stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to record import checkpoint: %s\n", sqlite3_errmsg(state->db));
+    }
+    sqlite3_reset(state->checkpoint_stmt);
+    state->checkpoint_dirty = 0;
+}
 
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Could not open file: %s\n", filename);
-        sqlite3_close(db);
-        return;
+/**
+ * @brief Store the checkpoint and commit the open batch, rolling it back if the commit fails.
+ *
+ * @return 0 on success, -1 if the batch was not committed.
+ */
+static int commit_batch(struct import_state *state) {
+    save_checkpoint(state);
+    uint64_t timer = metrics_start();
+    int rc = db_exec("COMMIT;");
+    metrics_stop(METRIC_SQL_COMMIT, timer);
+    if (rc != 0 && !sqlite3_get_autocommit(state->db)) {
+        db_exec("ROLLBACK;");
+    }
+    state->in_batch = 0;
+    return rc;
+}
+
+/**
+ * @brief Bind the category-set version a row was labelled with.
+ *
+ * Rows the classifier could not label get no version, so reclassify picks them up.
+ */
+static void bind_category_version(struct import_state *state, sqlite3_stmt *stmt, int index, const struct pending_row *row) {
+    if (row->category_id != -1 && state->category_version > 0) {
+        sqlite3_bind_int(stmt, index, state->category_version);
+    } else {
+        sqlite3_bind_null(stmt, index);
+    }
+}
+
+/**
+ * @brief Insert or update the rows of a batch in order, committing every batch_size rows.
+ *
+ * The insert returns the new row's id, so a duplicate skipped by ON CONFLICT is told apart
+ * without sqlite3_changes, which other stages using the connection could change in between.
+ *
+ * @return 0 on success, -1 if a row could not be written or a batch committed.
+ */
+static int write_rows(struct import_state *state, const struct row_batch *batch) {
+    for (int i = 0; i < batch->count; i++) {
+        const struct pending_row *row = &batch->rows[i];
+        if (state->in_batch == 0 && db_exec("BEGIN;") != 0) {
+            return -1;
+        }
+
+        int rc;
+        uint64_t timer = metrics_start();
+        if (!row->exists) {
+            sqlite3_bind_int(state->insert_stmt, 1, row->day);
+            sqlite3_bind_int64(state->insert_stmt, 2, row->cents);
+            sqlite3_bind_text(state->insert_stmt, 3, row->description, -1, SQLITE_STATIC);
+            sqlite3_bind_int(state->insert_stmt, 4, row->category_id);
+            sqlite3_bind_int64(state->insert_stmt, 5, row->fingerprint);
+            bind_category_version(state, state->insert_stmt, 6, row);
+            rc = sqlite3_step(state->insert_stmt);
+            if (rc == SQLITE_ROW) {
+                state->inserted++;
+                rc = sqlite3_step(state->insert_stmt);
+            }
+            if (rc != SQLITE_DONE) {
+                fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(state->db));
+            }
+            sqlite3_reset(state->insert_stmt);
+        } else {
+            sqlite3_bind_int(state->update_stmt, 1, row->category_id);
+            bind_category_version(state, state->update_stmt, 2, row);
+            sqlite3_bind_int64(state->update_stmt, 3, row->fingerprint);
+            rc = sqlite3_step(state->update_stmt);
+            if (rc != SQLITE_DONE) {
+                fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(state->db));
+            } else {
+                state->updated++;
+            }
+            sqlite3_reset(state->update_stmt);
+        }
+        metrics_stop(METRIC_SQL_INSERT, timer);
+        if (rc != SQLITE_DONE) {
+            return -1;
+        }
+
+        if (++state->in_batch >= state->batch_size && commit_batch(state) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#define PARSED_ROW 0
+#define PARSED_BLANK 1
+#define PARSED_MALFORMED 2
+#define PARSED_BAD_DATE 3
+
+// Bytes of input handed to a parse worker at a time
+#define PARSE_CHUNK_SIZE (1 << 20)
+// Chunks each worker may parse ahead of the writer, bounding the memory held by parsed rows
+#define PARSE_CHUNKS_AHEAD 4
+
+/**
+ * @brief One CSV record with its fields converted, ready for duplicate checks.
+ */
+struct parsed_row {
+    int status;      /**< PARSED_ROW, PARSED_BLANK or PARSED_MALFORMED. */
+    int field_count;
+    size_t end;      /**< Offset just past the record (parallel parsing only). */
+    int day;         /**< Days since 1970-01-01. */
+    char charge[32]; /**< The charge as written in the file. */
+    long long cents;
+    const char *description; /**< Points into the input, or at unescaped. */
+    int description_len;
+    char *unescaped; /**< Owned copy of a description that contained doubled quotes, or NULL. */
+    sqlite3_int64 fingerprint;
+    int year;
+    int month;       /**< 1-12. */
+};
+
+/**
+ * @brief Highest column index the layout reads.
+ */
+static int columns_needed(const struct csv_columns *columns) {
+    int needed = columns->date;
+    if (columns->charge > needed) {
+        needed = columns->charge;
+    }
+    if (columns->description > needed) {
+        needed = columns->description;
+    }
+    return needed;
+}
+
+/**
+ * @brief Convert a charge such as "-12.34" to cents.
+ *
+ * Plain decimals with at most two fractional digits are converted exactly without going through
+ * a double; anything else (exponents, more digits, stray characters) is rounded from atof.
+ */
+static long long parse_cents(const char *charge) {
+    const char *p = charge;
+    while (*p == ' ') {
+        p++;
+    }
+    int negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+    long long cents = 0;
+    int digits = 0, fraction = -1;
+    for (; *p; p++) {
+        if (*p >= '0' && *p <= '9' && digits < 16 && fraction < 2) {
+            cents = cents * 10 + (*p - '0');
+            digits++;
+            if (fraction >= 0) {
+                fraction++;
+            }
+        } else if (*p == '.' && fraction < 0) {
+            fraction = 0;
+        } else {
+            break;
+        }
+    }
+    while (*p == ' ') {
+        p++;
+    }
+    if (*p != '\0' || digits == 0) {
+        return llround(atof(charge) * 100);
+    }
+    for (int scale = fraction < 0 ? 0 : fraction; scale < 2; scale++) {
+        cents *= 10;
     }
+    return negative ? -cents : cents;
+}
+
+/**
+ * @brief Convert the fields of one record: date to a day number, charge to cents, and the fingerprint.
+ *
+ * Only the short date and charge fields are copied; the description is used in place unless it
+ * contains doubled quotes. The conversion does not touch the database, so it is safe to run on
+ * parse worker threads.
+ *
+ * @return 0 on success, -1 if memory for an unescaped description could not be allocated.
+ */
+static int parse_fields(const struct csv_field *fields, int field_count, const struct csv_columns *columns,
+                        struct parsed_row *row) {
+    row->field_count = field_count;
+    row->unescaped = NULL;
+    if (field_count <= columns_needed(columns)) {
+        // Blank lines are a single empty field; anything else is worth a warning
+        row->status = field_count > 1 || fields[0].len > 0 ? PARSED_MALFORMED : PARSED_BLANK;
+        return 0;
+    }
+    char date[32];
+    size_t date_len = csv_field_copy(&fields[columns->date], date, sizeof(date));
+    uint64_t timer = metrics_start();
+    int bad_date = date_parse(date, date_len, columns->date_format, &row->day) != 0;
+    metrics_stop(METRIC_DATE_PARSE, timer);
+    if (bad_date) {
+        row->status = PARSED_BAD_DATE;
+        return 0;
+    }
+    row->status = PARSED_ROW;
+    csv_field_copy(&fields[columns->charge], row->charge, sizeof(row->charge));
+    const struct csv_field *description = &fields[columns->description];
+    row->description = description->data;
+    row->description_len = (int)description->len;
+    if (description->escaped) {
+        row->unescaped = malloc(description->len + 1);
+        if (!row->unescaped) {
+            return -1;
+        }
+        row->description_len = (int)csv_field_copy(description, row->unescaped, description->len + 1);
+        row->description = row->unescaped;
+    }
+
+    int day;
+    date_civil_from_days(row->day, &row->year, &row->month, &day);
+    row->cents = parse_cents(row->charge);
+    row->fingerprint = transaction_fingerprint(row->day, row->cents, row->description, row->description_len);
+    metrics_count(METRIC_ROWS_PARSED, 1);
+    return 0;
+}
+
+/**
+ * @brief FNV-1a of the last CHECKPOINT_TAIL bytes before offset.
+ */
+static uint64_t checkpoint_tail_hash(const char *data, size_t offset) {
+    if (offset == 0) {
+        return HASH_FNV_OFFSET;
+    }
+    size_t len = offset < CHECKPOINT_TAIL ? offset : CHECKPOINT_TAIL;
+    return hash_fnv1a(data + offset - len, len, HASH_FNV_OFFSET);
+}
+
+/**
+ * @brief Pass the filled batch on to the dedup stage.
+ *
+ * If the current input is checkpointed and records were read since the last batch, the batch
+ * carries the new checkpoint, and is sent even if it holds no rows.
+ *
+ * @return 0 on success, -1 if the pipeline was cancelled.
+ */
+static int send_batch(struct import_state *state) {
+    struct row_batch *batch = state->batch;
+    state->batch = NULL;
+    struct checkpoint *progress = &state->progress;
+    if (progress->source && state->consumed > progress->offset) {
+        progress->prefix_hash = hash_fnv1a(state->data + progress->offset, state->consumed - progress->offset,
+                                           progress->prefix_hash);
+        progress->offset = state->consumed;
+        progress->records = state->record;
+        progress->tail_hash = checkpoint_tail_hash(state->data, progress->offset);
+        if (!batch) {
+            batch = batch_new(1);
+        }
+        if (batch) {
+            batch->checkpoint = *progress;
+        }
+    }
+    if (!batch || (batch->count == 0 && !batch->checkpoint.source)) {
+        batch_free(batch);
+        return 0;
+    }
+    // Descriptions were appended by offset because the text buffer may have moved while growing
+    for (int i = 0; i < batch->count; i++) {
+        batch->rows[i].description = batch->text + batch->rows[i].text_offset;
+    }
+    state->parse.rows_out += batch->count;
+    if (queue_push(&state->parsed, batch) != 0) {
+        batch_free(batch);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Hand one parsed record to the rest of the pipeline.
+ *
+ * This is the single, ordered consumer of parsed records: the serial and parallel parsers both
+ * hand it records in file order, so they print and store exactly the same things. Credits are
+ * dropped here; debits are added to the current batch, which is sent on once full.
+ *
+ * @param state The import state; state->record is the record's 1-based number in the file.
+ * @param row The parsed record; its unescaped description is freed.
+ * @return 0 to continue, -1 if the pipeline was cancelled or memory ran out and parsing should stop.
+ */
+static int emit_row(struct import_state *state, struct parsed_row *row) {
+    int record = state->record;
+    if (row->status == PARSED_MALFORMED) {
+        fprintf(stderr, "Skipping record %d: expected at least %d fields, found %d\n", record,
+                columns_needed(state->columns) + 1, row->field_count);
+        return 0;
+    }
+    if (row->status == PARSED_BAD_DATE) {
+        fprintf(stderr, "Skipping record %d: date does not match %s\n", record, state->columns->date_format);
+        return 0;
+    }
+    if (row->status != PARSED_ROW) {
+        return 0;
+    }
+    state->rows++;
+    state->parse.rows_in++;
 
-    char line[256];
-    while (fgets(line, sizeof(line), file)) {
-        char date[11], charge[20], description[256];
-        sscanf(line, "\"%10[^\"]\",\"%19[^\"]\",%*[^,],%*[^,],\"%255[^\"]\"", date, charge, description);
+    // Check if the charge is positive (credit), skip if it is
+    if (row->cents > 0) {
+        char date[11];
+        date_format(row->day, date);
+        printf("Skipping credit transaction: %s, %s, %.*s\n", date, row->charge, row->description_len, row->description);
+        free(row->unescaped);
+        return 0;
+    }
 
-        // Convert date from MM/DD/YYYY to YYYY-MM-DD
-        struct tm tm;
-        strptime(date, "%m/%d/%Y", &tm);
-        char formatted_date[11];
-        strftime(formatted_date, sizeof(formatted_date), "%Y-%m-%d", &tm);
+    if (!state->batch) {
+        state->batch = batch_new(state->batch_rows);
+    }
+    long offset = state->batch ? batch_add_text(state->batch, row->description, row->description_len) : -1;
+    free(row->unescaped);
+    if (offset < 0) {
+        // The next batch's checkpoint would pass the dropped row, so the import stops before it
+        fprintf(stderr, "Out of memory reading record %d\n", record);
+        return -1;
+    }
+    struct pending_row *pending = &state->batch->rows[state->batch->count++];
+    pending->day = row->day;
+    pending->cents = row->cents;
+    pending->text_offset = (size_t)offset;
+    pending->fingerprint = row->fingerprint;
+    pending->year = row->year;
+    pending->month = row->month;
+    pending->exists = 0;
+    pending->category_id = row->cents < 0 ? -1 : 1; // Only debits are classified, others default to "Other"
 
-        // Check if the charge is positive (credit), skip if it is
-        if (atof(charge) > 0) {
-            printf("Skipping credit transaction: %s, %s, %s\n", formatted_date, charge, description);
+    if (state->batch->count == state->batch->capacity) {
+        return send_batch(state);
+    }
+    return 0;
+}
+
+/**
+ * @brief Parse every record of the input on the calling thread and hand it to emit_row.
+ *
+ * @return 0 on success, -1 if the pipeline was cancelled or memory ran out.
+ */
+static int parse_serial(struct import_state *state, struct csv_reader *reader, const char *filename) {
+    struct csv_field fields[CSV_MAX_FIELDS];
+    int field_count;
+    uint64_t timer = metrics_start();
+    while ((field_count = csv_next_record(reader, fields, CSV_MAX_FIELDS)) > 0) {
+        metrics_stop(METRIC_CSV_RECORD, timer);
+        state->record++;
+        state->consumed = csv_offset(reader);
+        if (state->record == 1 && state->columns->header) {
             continue;
         }
+        struct parsed_row row;
+        if (parse_fields(fields, field_count, state->columns, &row) != 0) {
+            fprintf(stderr, "Out of memory reading record %d\n", state->record);
+            return -1;
+        }
+        if (emit_row(state, &row) != 0) {
+            return -1;
+        }
+        timer = metrics_start();
+    }
+    if (field_count < 0) {
+        fprintf(stderr, "Failed to read %s after record %d\n", filename, state->record);
+    }
+    return 0;
+}
+
+/**
+ * @brief A slice of the input parsed by one worker.
+ *
+ * Chunks start just after a newline, which is a record boundary unless the newline sits inside
+ * a quoted field. A worker parses every record that starts before the next chunk's start,
+ * reading past it to finish the last one, and records where it stopped in end. The writer then
+ * checks that each chunk starts where the previous one ended and re-parses it if not.
+ */
+struct parse_chunk {
+    size_t start;
+    size_t limit; /**< Start of the next chunk. */
+    size_t end;   /**< Offset just past the last record parsed. */
+    struct parsed_row *rows;
+    int count;
+    int capacity;
+    int records;  /**< Records parsed, including blank and malformed ones. */
+    int failed;   /**< A row could not be stored for lack of memory. */
+    int done;
+};
+
+/**
+ * @brief Work shared by the parse workers and the writer.
+ */
+struct parse_pool {
+    const char *data;
+    size_t size;
+    const struct csv_columns *columns;
+    struct parse_chunk *chunks;
+    int chunk_count;
+    int next;      /**< Next chunk to hand to a worker. */
+    int written;   /**< Chunks the writer has finished with. */
+    int max_ahead; /**< Chunks that may be parsed but not yet written. */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/**
+ * @brief Parse the records of a chunk into its row array.
+ */
+static void parse_chunk(const struct parse_pool *pool, struct parse_chunk *chunk) {
+    struct csv_field fields[CSV_MAX_FIELDS];
+    size_t pos = chunk->start;
+    chunk->count = 0;
+    chunk->records = 0;
+    chunk->failed = 0;
+    while (pos < chunk->limit) {
+        uint64_t timer = metrics_start();
+        int field_count = csv_record_at(pool->data, pool->size, &pos, fields, CSV_MAX_FIELDS);
+        metrics_stop(METRIC_CSV_RECORD, timer);
+        if (field_count <= 0) {
+            break;
+        }
+        if (chunk->count == chunk->capacity) {
+            int capacity = chunk->capacity ? chunk->capacity * 2 : 1024;
+            struct parsed_row *rows = realloc(chunk->rows, sizeof(struct parsed_row) * capacity);
+            if (!rows) {
+                chunk->failed = 1;
+                break;
+            }
+            chunk->rows = rows;
+            chunk->capacity = capacity;
+        }
+        if (parse_fields(fields, field_count, pool->columns, &chunk->rows[chunk->count]) != 0) {
+            chunk->failed = 1;
+            break;
+        }
+        chunk->rows[chunk->count].end = pos;
+        chunk->count++;
+        chunk->records++;
+    }
+    chunk->end = pos;
+}
+
+/**
+ * @brief Parse worker: take chunks in order, staying at most max_ahead chunks ahead of the writer.
+ */
+static void *parse_worker(void *arg) {
+    struct parse_pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->next < pool->chunk_count && pool->next >= pool->written + pool->max_ahead) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stop || pool->next == pool->chunk_count) {
+            break;
+        }
+        struct parse_chunk *chunk = &pool->chunks[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        parse_chunk(pool, chunk);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = 1;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * @brief Free the rows of a chunk, including unescaped descriptions from index first on.
+ */
+static void free_chunk_rows(struct parse_chunk *chunk, int first) {
+    for (int i = first; i < chunk->count; i++) {
+        free(chunk->rows[i].unescaped);
+    }
+    free(chunk->rows);
+    chunk->rows = NULL;
+    chunk->count = 0;
+    chunk->capacity = 0;
+}
+
+/**
+ * @brief Parse a memory-mapped input on jobs worker threads and hand the records on in file order.
+ *
+ * Workers split the input at newlines and convert fields (dates, amounts, fingerprints) in
+ * parallel. The calling thread takes the chunks back in order, re-parses any chunk whose
+ * speculative start fell inside a quoted field, and hands every record to emit_row exactly as
+ * parse_serial would.
+ *
+ * @param start Offset of the first record to read, after any checkpointed prefix.
+ * @return 0 on success, -1 if the pipeline was cancelled or memory ran out.
+ */
+static int parse_parallel(struct import_state *state, const char *data, size_t size, size_t start, int jobs) {
+    struct parse_pool pool = {
+        .data = data,
+        .size = size,
+        .columns = state->columns,
+        .chunk_count = size > start ? (int)((size - start + PARSE_CHUNK_SIZE - 1) / PARSE_CHUNK_SIZE) : 0,
+        .max_ahead = jobs * PARSE_CHUNKS_AHEAD,
+    };
+    pool.chunks = calloc(pool.chunk_count > 0 ? pool.chunk_count : 1, sizeof(struct parse_chunk));
+    pthread_t *threads = malloc(sizeof(pthread_t) * jobs);
+    if (!pool.chunks || !threads) {
+        fprintf(stderr, "Failed to prepare parse workers\n");
+        free(pool.chunks);
+        free(threads);
+        return -1;
+    }
+    for (int i = 0; i < pool.chunk_count; i++) {
+        size_t chunk_start = start;
+        if (i > 0) {
+            size_t from = start + (size_t)i * PARSE_CHUNK_SIZE - 1;
+            const char *newline = memchr(data + from, '\n', size - from);
+            chunk_start = newline ? (size_t)(newline - data) + 1 : size;
+            pool.chunks[i - 1].limit = chunk_start;
+        }
+        pool.chunks[i].start = chunk_start;
+    }
+    if (pool.chunk_count > 0) {
+        pool.chunks[pool.chunk_count - 1].limit = size;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, parse_worker, &pool) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        // No worker could be started; the writer parses every chunk itself below
+        pool.stop = 1;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < pool.chunk_count; i++) {
+        struct parse_chunk *chunk = &pool.chunks[i];
+        pthread_mutex_lock(&pool.lock);
+        while (!chunk->done && !pool.stop) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        }
+        int done = chunk->done;
+        pthread_mutex_unlock(&pool.lock);
+
+        // A chunk that started inside a quoted field, or was never parsed, is redone here
+        size_t expected = i > 0 ? pool.chunks[i - 1].end : start;
+        if (!done || chunk->start != expected || chunk->failed) {
+            free_chunk_rows(chunk, 0);
+            chunk->start = expected;
+            parse_chunk(&pool, chunk);
+            if (chunk->failed) {
+                fprintf(stderr, "Out of memory parsing record %d\n", state->record + chunk->records + 1);
+                failed = 1;
+            }
+        }
+
+        int j = 0;
+        for (; j < chunk->count && !failed; j++) {
+            state->record++;
+            state->consumed = chunk->rows[j].end;
+            if (state->record == 1 && state->columns->header) {
+                free(chunk->rows[j].unescaped);
+                continue;
+            }
+            if (emit_row(state, &chunk->rows[j]) != 0) {
+                failed = 1;
+                j++;
+            }
+        }
+        free_chunk_rows(chunk, j);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.written = i + 1;
+        if (failed) {
+            pool.stop = 1;
+        }
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+        if (failed) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < pool.chunk_count; i++) {
+        free_chunk_rows(&pool.chunks[i], 0);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    free(pool.chunks);
+    free(threads);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Decide where to start reading an input, from its import_ledger checkpoint.
+ *
+ * Regular files are checkpointed under their absolute path. A stored checkpoint is used if the
+ * file still holds the same bytes before it: the whole prefix is hashed and compared, or with
+ * --since-checkpoint only its last CHECKPOINT_TAIL bytes, so nothing before the new records is
+ * read. A file that no longer matches (e.g. a rewritten export) is imported from the start,
+ * and --overwrite always reads whole files so every row is reclassified.
+ *
+ * @param state The import state; its progress, consumed and record fields are set for the input.
+ * @param index The input's index, whose absolute path is kept in state->sources.
+ * @param reader The opened input, moved to the first record to read.
+ * @return The offset of the first record to read.
+ */
+static size_t resume_point(struct import_state *state, int index, struct csv_reader *reader) {
+    const char *filename = state->inputs[index];
+    state->data = reader->data;
+    state->consumed = 0;
+    state->record = 0;
+    state->progress = (struct checkpoint){ .prefix_hash = HASH_FNV_OFFSET, .tail_hash = HASH_FNV_OFFSET };
+    // Standard input and pipes cannot be re-read, so they are never checkpointed
+    if (!reader->mapped || !(state->sources[index] = realpath(filename, NULL))) {
+        return 0;
+    }
+    state->progress.source = state->sources[index];
+    if (state->overwrite) {
+        return 0;
+    }
+
+    struct checkpoint stored = { .source = state->progress.source };
+    sqlite3_bind_text(state->ledger_stmt, 1, stored.source, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(state->ledger_stmt);
+    if (rc == SQLITE_ROW) {
+        stored.offset = (size_t)sqlite3_column_int64(state->ledger_stmt, 0);
+        stored.records = sqlite3_column_int(state->ledger_stmt, 1);
+        stored.prefix_hash = (uint64_t)sqlite3_column_int64(state->ledger_stmt, 2);
+        stored.tail_hash = (uint64_t)sqlite3_column_int64(state->ledger_stmt, 3);
+    } else if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Failed to read import checkpoint: %s\n", sqlite3_errmsg(state->db));
+    }
+    sqlite3_reset(state->ledger_stmt);
+    if (rc != SQLITE_ROW) {
+        return 0;
+    }
 
-        // Check if the transaction already exists
-        char *check_sql = sqlite3_mprintf("SELECT COUNT(*) FROM transactions WHERE date = '%q' AND charge = %q AND description = '%q';", formatted_date, charge, description);
-        sqlite3_stmt *check_stmt;
-        rc = sqlite3_prepare_v2(db, check_sql, -1, &check_stmt, 0);
-        sqlite3_free(check_sql);
+    int matches = stored.offset <= reader->size && checkpoint_tail_hash(reader->data, stored.offset) == stored.tail_hash;
+    if (matches && !state->since_checkpoint) {
+        matches = hash_fnv1a(reader->data, stored.offset, HASH_FNV_OFFSET) == stored.prefix_hash;
+    }
+    if (!matches || csv_seek(reader, stored.offset) != 0) {
+        printf("%s changed since it was last imported; reading it from the start\n", filename);
+        return 0;
+    }
+    state->progress = stored;
+    state->consumed = stored.offset;
+    state->record = stored.records;
+    printf("Resuming %s after record %d (%zu of %zu bytes already imported)\n", filename, stored.records,
+           stored.offset, reader->size);
+    return stored.offset;
+}
 
-        if (rc != SQLITE_OK) {
-            fprintf(stderr, "Failed to check existing transaction: %s\n", sqlite3_errmsg(db));
-            sqlite3_finalize(check_stmt);
+/**
+ * @brief Parse stage: read every input in order and send its debits on in batches.
+ */
+static void *parse_stage(void *arg) {
+    struct import_state *state = arg;
+    double started = now_seconds();
+    int cancelled = 0;
+    for (int i = 0; i < state->input_count && !cancelled; i++) {
+        const char *filename = state->inputs[i];
+        printf("Importing data from %s\n", filename);
+        struct csv_reader reader;
+        if (csv_open(&reader, filename) != 0) {
+            fprintf(stderr, "Could not open file: %s\n", filename);
             continue;
         }
+        size_t start = resume_point(state, i, &reader);
 
-        int exists = 0;
-        if (sqlite3_step(check_stmt) == SQLITE_ROW) {
-            exists = sqlite3_column_int(check_stmt, 0);
+        int jobs = state->jobs;
+        if (jobs > 1 && !reader.mapped) {
+            fprintf(stderr, "--jobs needs a regular file; parsing %s on one thread\n", filename);
+            jobs = 1;
         }
-        sqlite3_finalize(check_stmt);
+        int rows = state->rows;
+        if (jobs > 1) {
+            cancelled = parse_parallel(state, reader.data, reader.size, start, jobs) != 0;
+        } else {
+            cancelled = parse_serial(state, &reader, filename) != 0;
+        }
+        // Batches never span files, so a file is fully handed on before the next is opened
+        if (!cancelled) {
+            cancelled = send_batch(state) != 0;
+        }
+        printf("Read %d rows from %s\n", state->rows - rows, filename);
+        metrics_count(METRIC_CSV_BYTES, (jobs > 1 ? reader.size : csv_offset(&reader)) - start);
+        state->data = NULL;
+        csv_close(&reader);
+    }
+    batch_free(state->batch);
+    state->batch = NULL;
+    queue_close(&state->parsed);
+    state->parse.seconds = now_seconds() - started;
+    return NULL;
+}
 
-        if (!exists) {
-            int category_id = 1; // Default to "Other" category
-            if (atof(charge) < 0) { // Check if the transaction is a debit
-                category_id = get_category_id(db, description);
+/**
+ * @brief Dedup stage: drop rows that are already stored or were already seen in this import.
+ *
+ * Stored fingerprints are loaded one month at a time, the first time a row from that month
+ * arrives, so the set only ever holds the date window covered by the inputs. With --overwrite,
+ * stored rows are kept and marked for reclassification instead. If a month cannot be loaded, the
+ * batch is dropped and the import cancelled, so batches before it are still written.
+ */
+static void *dedup_stage(void *arg) {
+    struct import_state *state = arg;
+    double started = now_seconds();
+    struct row_batch *batch;
+    while ((batch = queue_pop(&state->parsed))) {
+        int kept = 0;
+        int failed = 0;
+        for (int i = 0; i < batch->count; i++) {
+            struct pending_row *row = &batch->rows[i];
+            uint64_t month_key = (uint64_t)row->year * 12 + (row->month - 1);
+            if (!hash_set_contains(state->loaded_months, month_key)) {
+                uint64_t timer = metrics_start();
+                failed = load_month_fingerprints(state->window_stmt, state->seen, row->year, row->month) != 0;
+                metrics_stop(METRIC_DEDUP_LOAD, timer);
+                if (failed) {
+                    fprintf(stderr, "Failed to check existing transaction: %s\n", sqlite3_errmsg(state->db));
+                    break;
+                }
+                hash_set_add(state->loaded_months, month_key);
+            }
+            int exists = hash_set_contains(state->seen, (uint64_t)row->fingerprint);
+            if (exists && !state->overwrite) {
+                continue;
             }
+            if (exists) {
+                char date[11];
+                date_format(row->day, date);
+                printf("Transaction exists, updating category_id: %s, %.2f, %s\n", date, row->cents / 100.0, row->description);
+                row->exists = 1;
+                row->category_id = -1;
+            }
+            // Later copies of the row in the inputs are duplicates from here on
+            hash_set_add(state->seen, (uint64_t)row->fingerprint);
+            batch->rows[kept++] = *row;
+        }
+        if (failed) {
+            // The batch's checkpoint would pass the unchecked row, so the import stops before the batch
+            batch_free(batch);
+            queue_cancel(&state->parsed);
+            break;
+        }
+        state->dedup.rows_in += batch->count;
+        state->dedup.rows_out += kept;
+        batch->count = kept;
 
-            char *insert_sql = sqlite3_mprintf("INSERT INTO transactions (date, charge, description, category_id) VALUES ('%q', %q, '%q', %d);", formatted_date, charge, description, category_id);
-            rc = sqlite3_exec(db, insert_sql, 0, 0, &err_msg);
-            sqlite3_free(insert_sql);
+        if (kept == 0 && !batch->checkpoint.source) {
+            batch_free(batch);
+        } else if (queue_push(&state->deduplicated, batch) != 0) {
+            batch_free(batch);
+            queue_cancel(&state->parsed);
+            break;
+        }
+    }
+    queue_close(&state->deduplicated);
+    state->dedup.seconds = now_seconds() - started;
+    return NULL;
+}
 
-            if (rc != SQLITE_OK) {
-                fprintf(stderr, "SQL error: %s\n", err_msg);
-                sqlite3_free(err_msg);
-                break;
+/**
+ * @brief Classify stage: assign categories while earlier batches are written and later ones parsed.
+ *
+ * A batch that cannot be classified is dropped and the import cancelled, so it is never written
+ * with unassigned categories and batches before it are still written.
+ */
+static void *classify_stage(void *arg) {
+    struct import_state *state = arg;
+    double started = now_seconds();
+    struct row_batch *batch;
+    while ((batch = queue_pop(&state->deduplicated))) {
+        if (classify_rows(state, batch) != 0) {
+            batch_free(batch);
+            queue_cancel(&state->deduplicated);
+            break;
+        }
+        state->classify.rows_in += batch->count;
+        state->classify.rows_out += batch->count;
+        if (queue_push(&state->classified, batch) != 0) {
+            batch_free(batch);
+            queue_cancel(&state->deduplicated);
+            break;
+        }
+    }
+    queue_close(&state->classified);
+    state->classify.seconds = now_seconds() - started;
+    return NULL;
+}
+
+/**
+ * @brief Write stage, run on the calling thread: the only stage that writes transactions.
+ *
+ * A batch's checkpoint is stored with the next commit once all its rows are written, so a
+ * rerun after a failure resumes after the last batch that was committed in full; rows of a
+ * partly committed batch are read again and dropped as duplicates.
+ */
+static void write_stage(struct import_state *state) {
+    double started = now_seconds();
+    struct row_batch *batch;
+    while ((batch = queue_pop(&state->classified))) {
+        state->write.rows_in += batch->count;
+        int rc = write_rows(state, batch);
+        if (rc == 0 && batch->checkpoint.source) {
+            state->checkpoint = batch->checkpoint;
+            state->checkpoint_dirty = 1;
+            if (state->in_batch == 0) {
+                // Every row of the batch is already committed
+                save_checkpoint(state);
+            }
+        }
+        batch_free(batch);
+        if (rc != 0) {
+            // Rows written before an error are kept, as they were when every row committed on its own
+            queue_cancel(&state->classified);
+            break;
+        }
+    }
+    if (state->in_batch > 0) {
+        commit_batch(state);
+    }
+    state->write.rows_out = state->inserted + state->updated;
+    state->write.seconds = now_seconds() - started;
+}
+
+/**
+ * @brief Print the row counts and throughput of a stage.
+ *
+ * Busy time excludes the time the stage spent blocked on its input or output queue.
+ */
+static void print_stage_stats(const char *name, const struct stage_stats *stats, const struct queue *input,
+                              const struct queue *output) {
+    double busy = stats->seconds - (input ? input->pop_wait : 0) - (output ? output->push_wait : 0);
+    if (busy < 0) {
+        busy = 0;
+    }
+    printf("Stage %-8s %d rows in, %d out, %.2fs busy (%.0f rows/sec)\n", name, stats->rows_in, stats->rows_out,
+           busy, busy > 0 ? stats->rows_in / busy : 0.0);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Expand the import arguments into a list of files.
+ *
+ * Directories are replaced by the *.csv files they contain, in name order; other arguments,
+ * including "-" for standard input, are kept as given.
+ *
+ * @param paths The files and directories to import.
+ * @param path_count Number of paths.
+ * @param count Receives the number of files.
+ * @return The file list, to be released with free_inputs, or NULL on failure.
+ */
+static char **list_inputs(const char **paths, int path_count, int *count) {
+    char **inputs = NULL;
+    int capacity = 0;
+    *count = 0;
+    for (int i = 0; i < path_count; i++) {
+        struct stat st;
+        DIR *dir = NULL;
+        if (strcmp(paths[i], "-") != 0 && stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            dir = opendir(paths[i]);
+            if (!dir) {
+                fprintf(stderr, "Could not open directory: %s\n", paths[i]);
+                continue;
             }
-        } else if (overwrite) {
-            printf("Transaction exists, updating category_id: %s, %s, %s\n", formatted_date, charge, description);
-            int category_id = get_category_id(db, description);
-            char *update_sql = sqlite3_mprintf("UPDATE transactions SET category_id = %d WHERE date = '%q' AND charge = %q AND description = '%q';", category_id, formatted_date, charge, description);
-            rc = sqlite3_exec(db, update_sql, 0, 0, &err_msg);
-            sqlite3_free(update_sql);
+        }
 
-            if (rc != SQLITE_OK) {
-                fprintf(stderr, "SQL error: %s\n", err_msg);
-                sqlite3_free(err_msg);
+        int first = *count;
+        struct dirent *entry = NULL;
+        while (!dir || (entry = readdir(dir))) {
+            char *input;
+            if (dir) {
+                size_t len = strlen(entry->d_name);
+                if (len < 5 || strcasecmp(entry->d_name + len - 4, ".csv") != 0) {
+                    continue;
+                }
+                input = malloc(strlen(paths[i]) + len + 2);
+                if (input) {
+                    sprintf(input, "%s/%s", paths[i], entry->d_name);
+                }
+            } else {
+                input = strdup(paths[i]);
+            }
+
+            if (*count == capacity) {
+                capacity = capacity ? capacity * 2 : 8;
+                char **grown = realloc(inputs, sizeof(char *) * capacity);
+                if (!grown) {
+                    free(input);
+                    input = NULL;
+                } else {
+                    inputs = grown;
+                }
+            }
+            if (!input) {
+                fprintf(stderr, "Out of memory listing %s\n", paths[i]);
                 break;
             }
+            inputs[(*count)++] = input;
+            if (!dir) {
+                break;
+            }
+        }
+        if (dir) {
+            qsort(inputs + first, *count - first, sizeof(char *), compare_names);
+            closedir(dir);
+        }
+    }
+    return inputs;
+}
+
+static void free_inputs(char **inputs, int count) {
+    for (int i = 0; i < count; i++) {
+        free(inputs[i]);
+    }
+    free(inputs);
+}
+
+/**
+ * @brief Import transactions from CSV files into the database.
+ *
+ * The import is a pipeline of four stages connected by bounded queues of row batches, so network
+ * classification overlaps with parsing and database writes:
+ * - parse: tokenizes each file in turn with csv_reader (on options->jobs threads for large
+ *   files), converts dates to day numbers and amounts to cents, drops credits and batches the rest;
+ * - dedup: drops rows whose fingerprint is already stored or was seen earlier in the import;
+ * - classify: assigns categories locally or with concurrent batched requests;
+ * - write: inserts or updates the rows in input order, committing every options->batch_size rows.
+ * options->columns says which fields hold the date, charge and description (the Wells Fargo
+ * layout when unset). It supports overwriting existing transactions if specified. Each stage
+ * reports its throughput and each queue its depth when the import finishes.
+ *
+ * Progress through each regular file is checkpointed in import_ledger as batches commit, so
+ * importing a file again, after it was appended to or after a failed import, only reads the
+ * records past its checkpoint.
+ *
+ * @param paths The CSV files to import, directories of CSV files, or "-" for standard input.
+ * @param path_count Number of paths.
+ * @param options Import options (overwrite flag, batch size, parsing and classifier settings).
+ */
+void import_csv(const char **paths, int path_count, const struct import_options *options) {
+    int input_count;
+    char **inputs = list_inputs(paths, path_count, &input_count);
+    if (input_count == 0) {
+        fprintf(stderr, "No CSV files to import\n");
+        free_inputs(inputs, input_count);
+        return;
+    }
+
+    // The shared connection is serialized, so the pipeline stages can use it from their own threads
+    sqlite3 *db = db_open();
+    char *err_msg = 0;
+    if (!db) {
+        free_inputs(inputs, input_count);
+        return;
+    }
+
+    // Fingerprint rows stored before the fingerprint column existed; this also fails if the schema was never created
+    sqlite3_create_function(db, "transaction_fingerprint", 3, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                            sql_transaction_fingerprint, NULL, NULL);
+    int rc = sqlite3_exec(db, "UPDATE OR IGNORE transactions SET fingerprint = transaction_fingerprint(day, cents, description) "
+                          "WHERE fingerprint IS NULL;", 0, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s (has migrate_db.sh been run?)\n", err_msg);
+        sqlite3_free(err_msg);
+        free_inputs(inputs, input_count);
+        return;
+    }
+
+    sqlite3_stmt *window_stmt = NULL;
+    sqlite3_stmt *insert_stmt = NULL;
+    sqlite3_stmt *update_stmt = NULL;
+    sqlite3_stmt *ledger_stmt = NULL;
+    sqlite3_stmt *checkpoint_stmt = NULL;
+    char **sources = calloc(input_count, sizeof(char *));
+    if (!(window_stmt = db_prepare("SELECT fingerprint FROM transactions WHERE day >= ? AND day < ? AND fingerprint IS NOT NULL;")) ||
+        !(insert_stmt = db_prepare("INSERT INTO transactions (day, cents, description, category_id, fingerprint, category_version) VALUES (?, ?, ?, ?, ?, ?) "
+                                   "ON CONFLICT(fingerprint) DO NOTHING RETURNING id;")) ||
+        !(update_stmt = db_prepare("UPDATE transactions SET category_id = ?, category_version = ? WHERE fingerprint = ?;")) ||
+        !(ledger_stmt = db_prepare("SELECT committed_offset, records, prefix_hash, tail_hash FROM import_ledger WHERE source = ?;")) ||
+        !(checkpoint_stmt = db_prepare("INSERT INTO import_ledger (source, committed_offset, records, prefix_hash, tail_hash, updated_at) "
+                                       "VALUES (?, ?, ?, ?, ?, datetime('now')) ON CONFLICT(source) DO UPDATE SET "
+                                       "committed_offset = excluded.committed_offset, records = excluded.records, "
+                                       "prefix_hash = excluded.prefix_hash, tail_hash = excluded.tail_hash, "
+                                       "updated_at = excluded.updated_at;")) ||
+        !sources) {
+        fprintf(stderr, "Failed to prepare import statements: %s\n", sqlite3_errmsg(db));
+        db_release(window_stmt);
+        db_release(insert_stmt);
+        db_release(update_stmt);
+        db_release(ledger_stmt);
+        db_release(checkpoint_stmt);
+        free(sources);
+        free_inputs(inputs, input_count);
+        return;
+    }
+
+    // Fingerprints of stored transactions, plus the set of months (year * 12 + month) already loaded into it
+    struct hash_set seen = {0}, loaded_months = {0};
+    classifier_configure(options->classifier_url, options->concurrency, options->requests_per_sec);
+    struct prompt_context *context = prompt_context_new(db);
+    struct local_classifier *local = NULL;
+    if (options->local_threshold >= 0) {
+        double started = now_seconds();
+        local = local_classifier_new(db);
+        if (local) {
+            printf("Local classifier trained on %d descriptions in %.2fs\n", local_classifier_size(local), now_seconds() - started);
+        }
+    }
+
+    struct csv_columns columns = options->columns;
+    if (!columns.date_format) {
+        csv_columns_preset("wellsfargo", &columns);
+    }
+    struct import_state state = {
+        .db = db,
+        .columns = &columns,
+        // A batch is what one classify_batch call sends: concurrency requests of CLASSIFY_BATCH_SIZE rows
+        .batch_rows = CLASSIFY_BATCH_SIZE * (options->concurrency > 0 ? options->concurrency : 1),
+        .inputs = inputs,
+        .sources = sources,
+        .input_count = input_count,
+        .jobs = options->jobs > 1 ? options->jobs : 1,
+        .ledger_stmt = ledger_stmt,
+        .since_checkpoint = options->since_checkpoint,
+        .window_stmt = window_stmt,
+        .seen = &seen,
+        .loaded_months = &loaded_months,
+        .overwrite = options->overwrite,
+        .context = context,
+        .local = local,
+        .local_threshold = options->local_threshold,
+        .insert_stmt = insert_stmt,
+        .update_stmt = update_stmt,
+        .checkpoint_stmt = checkpoint_stmt,
+        .category_version = context ? prompt_context_version(context) : 0,
+        .batch_size = options->batch_size > 0 ? options->batch_size : 1,
+    };
+    pthread_t parse_thread, dedup_thread, classify_thread;
+    int threads = 0;
+    double started = now_seconds();
+    if (!context || hash_set_init(&seen, 4096) != 0 || hash_set_init(&loaded_months, 64) != 0 ||
+        queue_init(&state.parsed, IMPORT_QUEUE_DEPTH) != 0 || queue_init(&state.deduplicated, IMPORT_QUEUE_DEPTH) != 0 ||
+        queue_init(&state.classified, IMPORT_QUEUE_DEPTH) != 0) {
+        fprintf(stderr, "Failed to prepare import state\n");
+    } else if (pthread_create(&parse_thread, NULL, parse_stage, &state) != 0 ||
+               (threads++, pthread_create(&dedup_thread, NULL, dedup_stage, &state) != 0) ||
+               (threads++, pthread_create(&classify_thread, NULL, classify_stage, &state) != 0)) {
+        fprintf(stderr, "Failed to start import threads\n");
+        queue_cancel(&state.parsed);
+        queue_cancel(&state.deduplicated);
+    } else {
+        threads++;
+        write_stage(&state);
+    }
+
+    // A failed write, classification or fingerprint load cancels the stage's input queue; each stage before it then cancels its own
+    if (threads > 0) {
+        pthread_join(parse_thread, NULL);
+    }
+    if (threads > 1) {
+        pthread_join(dedup_thread, NULL);
+    }
+    if (threads > 2) {
+        pthread_join(classify_thread, NULL);
+    }
+    struct queue *queues[] = { &state.parsed, &state.deduplicated, &state.classified };
+    for (int i = 0; i < 3; i++) {
+        if (queues[i]->items) {
+            queue_cancel(queues[i]);
+            struct row_batch *batch;
+            while ((batch = queue_pop(queues[i]))) {
+                batch_free(batch);
+            }
+        }
+    }
+
+    if (threads == 3) {
+        double elapsed = now_seconds() - started;
+        printf("Processed %d rows (%d inserted, %d updated) in %.2fs (%.0f rows/sec)\n",
+               state.rows, state.inserted, state.updated, elapsed, elapsed > 0 ? state.rows / elapsed : 0.0);
+        if (local) {
+            printf("Classified %d rows locally in %.3fs\n", state.local_rows, state.local_seconds);
         }
+        printf("Classified %d rows remotely in %.2fs\n", state.remote_rows, state.remote_seconds);
+        category_cache_print_stats();
+        http_print_stats();
+        print_stage_stats("parse", &state.parse, NULL, &state.parsed);
+        print_stage_stats("dedup", &state.dedup, &state.parsed, &state.deduplicated);
+        print_stage_stats("classify", &state.classify, &state.deduplicated, &state.classified);
+        print_stage_stats("write", &state.write, &state.classified, NULL);
+        queue_print_stats(&state.parsed, "parse->dedup");
+        queue_print_stats(&state.deduplicated, "dedup->classify");
+        queue_print_stats(&state.classified, "classify->write");
     }
 
-    fclose(file);
-    sqlite3_close(db);
+    queue_free(&state.parsed);
+    queue_free(&state.deduplicated);
+    queue_free(&state.classified);
+    prompt_context_free(context);
+    local_classifier_free(local);
+    hash_set_free(&seen);
+    hash_set_free(&loaded_months);
+    db_release(window_stmt);
+    db_release(insert_stmt);
+    db_release(update_stmt);
+    db_release(ledger_stmt);
+    db_release(checkpoint_stmt);
+    free_inputs(sources, input_count);
+    free_inputs(inputs, input_count);
 }
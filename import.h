@@ -1,6 +1,21 @@
 #ifndef IMPORT_H
 #define IMPORT_H
 
-void import_csv(const char *filename, int overwrite);
+/**
+ * @brief Options controlling how import_csv ingests a file.
+ */
+struct import_options {
+    int overwrite;  /**< Reclassify transactions that already exist (1 for true, 0 for false). */
+    int batch_size; /**< Number of rows committed per transaction; 1 commits every row. */
+    int concurrency; /**< Maximum classification requests in flight at once. */
+    double requests_per_sec; /**< Maximum classification request rate. */
+    const char *classifier_url; /**< Chat completions endpoint, or NULL for the default. */
+    double local_threshold; /**< Minimum local classifier confidence (0-1) to skip the remote model; negative disables it. */
+    int jobs; /**< Parse worker threads; 1 parses on the calling thread. */
+    int since_checkpoint; /**< Trust each file's checkpoint after checking only the bytes before it, instead of its whole imported prefix. */
+    struct csv_columns columns; /**< Column layout of the file; a NULL date_format selects the Wells Fargo layout. */
+};
+
+void import_csv(const char **paths, int path_count, const struct import_options *options);
 
 #endif
@@ -0,0 +1,318 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include "category.h"
+#include "hash.h"
+#include "local_classifier.h"
+
+// Number of hashed trigram features; collisions only blur rare trigrams together
+#define LOCAL_BUCKETS (1 << 16)
+// Longest merchant key considered, in bytes
+#define LOCAL_MAX_KEY 256
+
+/**
+ * @brief One document's weight for a trigram bucket.
+ */
+struct posting {
+    int doc;
+    float weight;
+};
+
+/**
+ * @brief All documents containing a trigram bucket.
+ */
+struct posting_list {
+    struct posting *items;
+    int count;
+    int capacity;
+};
+
+/**
+ * @brief Nearest-neighbour classifier over character-trigram TF-IDF vectors.
+ *
+ * Every known description (a category example or an already-categorized transaction) is a
+ * document. Documents are indexed in an inverted index from hashed trigram to the documents
+ * containing it, with L2-normalized TF-IDF weights, so a lookup only touches documents that
+ * share a trigram with the query.
+ */
+struct local_classifier {
+    struct posting_list buckets[LOCAL_BUCKETS];
+    float idf[LOCAL_BUCKETS];
+    int *doc_category;
+    int doc_count;
+    int doc_capacity;
+    float *scores; /**< Scratch accumulator, one per document, kept zeroed between lookups. */
+    int *touched;  /**< Scratch list of documents with a non-zero score. */
+    struct hash_set known; /**< (merchant key, category) pairs already indexed. */
+};
+
+/**
+ * @brief A hashed trigram and how often it occurs in a text.
+ */
+struct term {
+    uint32_t bucket;
+    int count;
+};
+
+static int compare_terms(const void *a, const void *b) {
+    uint32_t x = ((const struct term *)a)->bucket, y = ((const struct term *)b)->bucket;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Split a description into hashed trigram terms with their counts.
+ *
+ * The description is normalized with merchant_key and padded with a space on each side, so
+ * word boundaries form trigrams of their own.
+ *
+ * @param description The text to split.
+ * @param terms Output array with room for LOCAL_MAX_KEY terms.
+ * @param key_hash Receives a hash of the normalized text, or NULL.
+ * @return The number of distinct terms written.
+ */
+static int extract_terms(const char *description, struct term *terms, uint64_t *key_hash) {
+    char key[LOCAL_MAX_KEY];
+    merchant_key(description, key + 1, sizeof(key) - 2);
+    key[0] = ' ';
+    size_t len = strlen(key);
+    if (key_hash) {
+        *key_hash = hash_fnv1a(key, len, HASH_FNV_OFFSET);
+    }
+    key[len++] = ' ';
+
+    int count = 0;
+    for (size_t i = 0; i + 2 < len; i++) {
+        uint32_t code = (unsigned char)key[i] << 16 | (unsigned char)key[i + 1] << 8 | (unsigned char)key[i + 2];
+        code *= 2654435761u;
+        terms[count].bucket = code >> 16;
+        terms[count].count = 1;
+        count++;
+    }
+    qsort(terms, count, sizeof(struct term), compare_terms);
+
+    int distinct = 0;
+    for (int i = 0; i < count; i++) {
+        if (distinct > 0 && terms[distinct - 1].bucket == terms[i].bucket) {
+            terms[distinct - 1].count++;
+        } else {
+            terms[distinct++] = terms[i];
+        }
+    }
+    return distinct;
+}
+
+/**
+ * @brief Append a document to the index using the current IDF weights.
+ *
+ * Descriptions that normalize to an already indexed (merchant key, category) pair are skipped,
+ * so a merchant seen thousands of times is still a single document.
+ */
+static void add_document(struct local_classifier *classifier, const struct term *terms, int term_count,
+                         uint64_t key_hash, int category_id) {
+    uint64_t pair = hash_fnv1a(&category_id, sizeof(category_id), key_hash);
+    if (hash_set_add(&classifier->known, pair) != 1) {
+        return;
+    }
+    if (classifier->doc_count == classifier->doc_capacity) {
+        int capacity = classifier->doc_capacity ? classifier->doc_capacity * 2 : 1024;
+        int *doc_category = realloc(classifier->doc_category, sizeof(int) * capacity);
+        float *scores = realloc(classifier->scores, sizeof(float) * capacity);
+        int *touched = realloc(classifier->touched, sizeof(int) * capacity);
+        if (doc_category) {
+            classifier->doc_category = doc_category;
+        }
+        if (scores) {
+            classifier->scores = scores;
+        }
+        if (touched) {
+            classifier->touched = touched;
+        }
+        if (!doc_category || !scores || !touched) {
+            return;
+        }
+        memset(classifier->scores + classifier->doc_capacity, 0, sizeof(float) * (capacity - classifier->doc_capacity));
+        classifier->doc_capacity = capacity;
+    }
+
+    int doc = classifier->doc_count++;
+    classifier->doc_category[doc] = category_id;
+
+    double norm = 0;
+    for (int i = 0; i < term_count; i++) {
+        double weight = terms[i].count * classifier->idf[terms[i].bucket];
+        norm += weight * weight;
+    }
+    norm = sqrt(norm);
+    if (norm == 0) {
+        return;
+    }
+
+    for (int i = 0; i < term_count; i++) {
+        struct posting_list *list = &classifier->buckets[terms[i].bucket];
+        if (list->count == list->capacity) {
+            int capacity = list->capacity ? list->capacity * 2 : 4;
+            struct posting *items = realloc(list->items, sizeof(struct posting) * capacity);
+            if (!items) {
+                continue;
+            }
+            list->items = items;
+            list->capacity = capacity;
+        }
+        list->items[list->count].doc = doc;
+        list->items[list->count].weight = terms[i].count * classifier->idf[terms[i].bucket] / norm;
+        list->count++;
+    }
+}
+
+/**
+ * @brief Train a local classifier from the database.
+ *
+ * Documents are the category examples plus every distinct (merchant key, category) pair of
+ * already-categorized transactions. IDF weights are computed over this training set and kept
+ * fixed for documents added later with local_classifier_add.
+ *
+ * @param db Pointer to the SQLite3 database connection.
+ * @return The classifier, to be released with local_classifier_free, or NULL on failure.
+ */
+struct local_classifier *local_classifier_new(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db,
+                                "SELECT example, category_id FROM category_examples WHERE category_id IS NOT NULL "
+                                "UNION "
+                                "SELECT description, category_id FROM transactions WHERE category_id > 0;",
+                                -1, &stmt, 0);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to load local classifier training data: %s\n", sqlite3_errmsg(db));
+        return NULL;
+    }
+
+    struct local_classifier *classifier = calloc(1, sizeof(struct local_classifier));
+    if (!classifier || hash_set_init(&classifier->known, 1024) != 0) {
+        free(classifier);
+        sqlite3_finalize(stmt);
+        return NULL;
+    }
+
+    // First pass: document frequencies
+    struct term terms[LOCAL_MAX_KEY];
+    int *document_frequency = calloc(LOCAL_BUCKETS, sizeof(int));
+    int training_docs = 0;
+    while (document_frequency && sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *text = (const char *)sqlite3_column_text(stmt, 0);
+        int term_count = extract_terms(text ? text : "", terms, NULL);
+        for (int i = 0; i < term_count; i++) {
+            document_frequency[terms[i].bucket]++;
+        }
+        training_docs++;
+    }
+    for (int i = 0; document_frequency && i < LOCAL_BUCKETS; i++) {
+        classifier->idf[i] = log((1.0 + training_docs) / (1.0 + document_frequency[i])) + 1.0;
+    }
+    free(document_frequency);
+
+    // Second pass: weighted postings
+    sqlite3_reset(stmt);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *text = (const char *)sqlite3_column_text(stmt, 0);
+        uint64_t key_hash;
+        int term_count = extract_terms(text ? text : "", terms, &key_hash);
+        add_document(classifier, terms, term_count, key_hash, sqlite3_column_int(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+    return classifier;
+}
+
+/**
+ * @brief Find the category of the most similar known description.
+ *
+ * @param classifier The trained classifier.
+ * @param description The transaction description to classify.
+ * @param confidence Receives the cosine similarity (0 to 1) of the nearest document.
+ * @return The nearest document's category ID, or -1 if no document shares a trigram with the description.
+ */
+int local_classifier_classify(const struct local_classifier *classifier, const char *description, double *confidence) {
+    struct term terms[LOCAL_MAX_KEY];
+    int term_count = extract_terms(description, terms, NULL);
+    *confidence = 0;
+
+    double norm = 0;
+    for (int i = 0; i < term_count; i++) {
+        double weight = terms[i].count * classifier->idf[terms[i].bucket];
+        norm += weight * weight;
+    }
+    norm = sqrt(norm);
+    if (norm == 0) {
+        return -1;
+    }
+
+    // The scratch buffers are logically const: they are left zeroed on return
+    float *scores = classifier->scores;
+    int *touched = classifier->touched;
+    int touched_count = 0;
+    for (int i = 0; i < term_count; i++) {
+        const struct posting_list *list = &classifier->buckets[terms[i].bucket];
+        float query_weight = terms[i].count * classifier->idf[terms[i].bucket] / norm;
+        for (int j = 0; j < list->count; j++) {
+            int doc = list->items[j].doc;
+            if (scores[doc] == 0) {
+                touched[touched_count++] = doc;
+            }
+            scores[doc] += query_weight * list->items[j].weight;
+        }
+    }
+
+    int best = -1;
+    for (int i = 0; i < touched_count; i++) {
+        int doc = touched[i];
+        if (best == -1 || scores[doc] > scores[best]) {
+            best = doc;
+        }
+    }
+    int category_id = -1;
+    if (best != -1) {
+        *confidence = scores[best] > 1 ? 1 : scores[best];
+        category_id = classifier->doc_category[best];
+    }
+    for (int i = 0; i < touched_count; i++) {
+        scores[touched[i]] = 0;
+    }
+    return category_id;
+}
+
+/**
+ * @brief Teach the classifier a newly categorized description, e.g. one answered by the remote model.
+ */
+void local_classifier_add(struct local_classifier *classifier, const char *description, int category_id) {
+    struct term terms[LOCAL_MAX_KEY];
+    uint64_t key_hash;
+    int term_count = extract_terms(description, terms, &key_hash);
+    add_document(classifier, terms, term_count, key_hash, category_id);
+}
+
+/**
+ * @brief Number of documents in the classifier.
+ */
+int local_classifier_size(const struct local_classifier *classifier) {
+    return classifier->doc_count;
+}
+
+/**
+ * @brief Release a local classifier.
+ */
+void local_classifier_free(struct local_classifier *classifier) {
+    if (!classifier) {
+        return;
+    }
+    for (int i = 0; i < LOCAL_BUCKETS; i++) {
+        free(classifier->buckets[i].items);
+    }
+    free(classifier->doc_category);
+    free(classifier->scores);
+    free(classifier->touched);
+    hash_set_free(&classifier->known);
+    free(classifier);
+}
@@ -0,0 +1,12 @@
+#ifndef LOCAL_CLASSIFIER_H
+#define LOCAL_CLASSIFIER_H
+
+struct local_classifier;
+
+struct local_classifier *local_classifier_new(sqlite3 *db);
+int local_classifier_classify(const struct local_classifier *classifier, const char *description, double *confidence);
+void local_classifier_add(struct local_classifier *classifier, const char *description, int category_id);
+int local_classifier_size(const struct local_classifier *classifier);
+void local_classifier_free(struct local_classifier *classifier);
+
+#endif
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <json-c/json.h>
+#include "metrics.h"
+
+// Histogram buckets: bucket b counts durations of [2^(b-1), 2^b) nanoseconds, the last one all longer ones
+#define METRICS_BUCKETS 40
+// Threads update one of this many copies of the metrics, so they rarely share cache lines
+#define METRICS_SHARDS 16
+
+/**
+ * @brief Running totals of one timer.
+ */
+struct timer_totals {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t nanoseconds;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[METRICS_BUCKETS];
+};
+
+/**
+ * @brief One thread's share of the metrics.
+ */
+struct metrics_shard {
+    struct timer_totals timers[METRIC_TIMERS];
+    atomic_uint_fast64_t counters[METRIC_COUNTERS];
+} __attribute__((aligned(64)));
+
+static const char *const timer_names[METRIC_TIMERS] = {
+    "command", "csv.record", "date.parse", "dedup.load", "classify.batch", "http.request",
+    "json.parse", "sql.insert", "sql.commit", "sql.statement",
+};
+
+static const char *const counter_names[METRIC_COUNTERS] = {
+    "csv.bytes", "rows.parsed", "http.bytes_sent", "http.bytes_received", "sql.rows",
+};
+
+int metrics_enabled = 0;
+static struct metrics_shard metrics_shards[METRICS_SHARDS];
+static atomic_int metrics_next_shard;
+static _Thread_local struct metrics_shard *metrics_shard;
+
+/**
+ * @brief Turn on collection; until then every metrics call returns at once.
+ *
+ * Must be called before the threads that record metrics are started.
+ */
+void metrics_enable(void) {
+    metrics_enabled = 1;
+}
+
+static struct metrics_shard *shard(void) {
+    if (!metrics_shard) {
+        metrics_shard = &metrics_shards[atomic_fetch_add(&metrics_next_shard, 1) % METRICS_SHARDS];
+    }
+    return metrics_shard;
+}
+
+/**
+ * @brief Start timing an operation.
+ *
+ * @return The monotonic clock in nanoseconds, to pass to metrics_stop, or 0 if metrics are off.
+ */
+uint64_t metrics_start(void) {
+    if (!metrics_enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Record an operation that started at started, as returned by metrics_start.
+ */
+void metrics_stop(enum metric_timer timer, uint64_t started) {
+    if (started == 0) {
+        return;
+    }
+    metrics_observe(timer, metrics_start() - started);
+}
+
+/**
+ * @brief Record an operation that took the given time.
+ */
+void metrics_observe(enum metric_timer timer, uint64_t nanoseconds) {
+    if (!metrics_enabled) {
+        return;
+    }
+    struct timer_totals *totals = &shard()->timers[timer];
+    int bucket = nanoseconds ? 64 - __builtin_clzll(nanoseconds) : 0;
+    if (bucket >= METRICS_BUCKETS) {
+        bucket = METRICS_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&totals->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals->nanoseconds, nanoseconds, memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals->buckets[bucket], 1, memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&totals->max, memory_order_relaxed);
+    while (nanoseconds > max &&
+           !atomic_compare_exchange_weak_explicit(&totals->max, &max, nanoseconds, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Add to a counter.
+ */
+void metrics_count(enum metric_counter counter, uint64_t amount) {
+    if (!metrics_enabled) {
+        return;
+    }
+    atomic_fetch_add_explicit(&shard()->counters[counter], amount, memory_order_relaxed);
+}
+
+/**
+ * @brief A timer's totals summed over the shards.
+ */
+struct timer_summary {
+    uint64_t count;
+    uint64_t nanoseconds;
+    uint64_t max;
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+static void summarize(enum metric_timer timer, struct timer_summary *summary) {
+    memset(summary, 0, sizeof(*summary));
+    for (int s = 0; s < METRICS_SHARDS; s++) {
+        struct timer_totals *totals = &metrics_shards[s].timers[timer];
+        summary->count += atomic_load(&totals->count);
+        summary->nanoseconds += atomic_load(&totals->nanoseconds);
+        uint64_t max = atomic_load(&totals->max);
+        summary->max = max > summary->max ? max : summary->max;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            summary->buckets[b] += atomic_load(&totals->buckets[b]);
+        }
+    }
+}
+
+static uint64_t counter_total(enum metric_counter counter) {
+    uint64_t total = 0;
+    for (int s = 0; s < METRICS_SHARDS; s++) {
+        total += atomic_load(&metrics_shards[s].counters[counter]);
+    }
+    return total;
+}
+
+/**
+ * @brief Upper bound of a histogram bucket in microseconds.
+ */
+static double bucket_limit_us(int bucket) {
+    return (double)(1ULL << bucket) / 1000;
+}
+
+/**
+ * @brief Estimate a percentile as the upper bound of the bucket holding it, capped at the maximum.
+ */
+static double percentile_us(const struct timer_summary *summary, double fraction) {
+    uint64_t rank = (uint64_t)(summary->count * fraction + 0.5);
+    uint64_t seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += summary->buckets[b];
+        if (seen >= rank && seen > 0) {
+            double limit = bucket_limit_us(b);
+            return limit < summary->max / 1000.0 ? limit : summary->max / 1000.0;
+        }
+    }
+    return summary->max / 1000.0;
+}
+
+/**
+ * @brief Print a table of every timer that ran and every counter that is not zero.
+ *
+ * Percentiles are read from power-of-two histograms, so they are upper bounds within a factor of two.
+ */
+void metrics_print(FILE *out) {
+    fprintf(out, "%-20s | %10s | %12s | %10s | %10s | %10s | %10s | %10s\n", "Timer", "Count", "Total ms", "Mean us",
+            "p50 us", "p90 us", "p99 us", "Max us");
+    fprintf(out, "----------------------------------------------------------------------------------------------------------------\n");
+    for (int t = 0; t < METRIC_TIMERS; t++) {
+        struct timer_summary summary;
+        summarize(t, &summary);
+        if (summary.count == 0) {
+            continue;
+        }
+        fprintf(out, "%-20s | %10llu | %12.2f | %10.1f | %10.1f | %10.1f | %10.1f | %10.1f\n", timer_names[t],
+                (unsigned long long)summary.count, summary.nanoseconds / 1e6, summary.nanoseconds / 1e3 / summary.count,
+                percentile_us(&summary, 0.5), percentile_us(&summary, 0.9), percentile_us(&summary, 0.99), summary.max / 1e3);
+    }
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        uint64_t total = counter_total(c);
+        if (total > 0) {
+            fprintf(out, "%-20s | %10llu\n", counter_names[c], (unsigned long long)total);
+        }
+    }
+}
+
+/**
+ * @brief Write every timer and counter to a JSON file.
+ *
+ * Timers hold count, total_ms, mean_us, max_us, p50_us, p90_us, p99_us and the non-empty
+ * histogram buckets as {"le_us": upper bound, "count": n}.
+ *
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int metrics_write_json(const char *path) {
+    struct json_object *root = json_object_new_object();
+    struct json_object *timers = json_object_new_object();
+    struct json_object *counters = json_object_new_object();
+    for (int t = 0; t < METRIC_TIMERS; t++) {
+        struct timer_summary summary;
+        summarize(t, &summary);
+        struct json_object *timer = json_object_new_object();
+        struct json_object *histogram = json_object_new_array();
+        json_object_object_add(timer, "count", json_object_new_int64(summary.count));
+        json_object_object_add(timer, "total_ms", json_object_new_double(summary.nanoseconds / 1e6));
+        json_object_object_add(timer, "mean_us", json_object_new_double(summary.count ? summary.nanoseconds / 1e3 / summary.count : 0));
+        json_object_object_add(timer, "max_us", json_object_new_double(summary.max / 1e3));
+        json_object_object_add(timer, "p50_us", json_object_new_double(percentile_us(&summary, 0.5)));
+        json_object_object_add(timer, "p90_us", json_object_new_double(percentile_us(&summary, 0.9)));
+        json_object_object_add(timer, "p99_us", json_object_new_double(percentile_us(&summary, 0.99)));
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            if (summary.buckets[b] == 0) {
+                continue;
+            }
+            struct json_object *bucket = json_object_new_object();
+            json_object_object_add(bucket, "le_us", json_object_new_double(bucket_limit_us(b)));
+            json_object_object_add(bucket, "count", json_object_new_int64(summary.buckets[b]));
+            json_object_array_add(histogram, bucket);
+        }
+        json_object_object_add(timer, "histogram", histogram);
+        json_object_object_add(timers, timer_names[t], timer);
+    }
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        json_object_object_add(counters, counter_names[c], json_object_new_int64(counter_total(c)));
+    }
+    json_object_object_add(root, "timers", timers);
+    json_object_object_add(root, "counters", counters);
+
+    int rc = json_object_to_file_ext(path, root, JSON_C_TO_STRING_PRETTY);
+    json_object_put(root);
+    if (rc != 0) {
+        fprintf(stderr, "Failed to write metrics to %s\n", path);
+        return -1;
+    }
+    return 0;
+}
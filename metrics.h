@@ -0,0 +1,46 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @brief Timed operations; each keeps a count, total, maximum and latency histogram.
+ */
+enum metric_timer {
+    METRIC_COMMAND,        /**< The whole command. */
+    METRIC_CSV_RECORD,     /**< Splitting one CSV record into fields. */
+    METRIC_DATE_PARSE,     /**< Converting one date field to a day number. */
+    METRIC_DEDUP_LOAD,     /**< Loading one month of stored fingerprints for the duplicate check. */
+    METRIC_CLASSIFY_BATCH, /**< Classifying one batch of rows, cache lookups and requests included. */
+    METRIC_HTTP_REQUEST,   /**< One HTTP request attempt, as timed by curl. */
+    METRIC_JSON_PARSE,     /**< Parsing one classifier reply. */
+    METRIC_SQL_INSERT,     /**< Inserting or updating one transaction. */
+    METRIC_SQL_COMMIT,     /**< Committing one import transaction. */
+    METRIC_SQL_STATEMENT,  /**< Any SQL statement, from its first step to its reset. */
+    METRIC_TIMERS
+};
+
+/**
+ * @brief Counted quantities.
+ */
+enum metric_counter {
+    METRIC_CSV_BYTES,            /**< Bytes of CSV input read. */
+    METRIC_ROWS_PARSED,          /**< CSV records converted to rows. */
+    METRIC_HTTP_BYTES_SENT,      /**< Request bodies sent. */
+    METRIC_HTTP_BYTES_RECEIVED,  /**< Response bodies received. */
+    METRIC_SQL_ROWS,             /**< Result rows stepped through by SQL statements. */
+    METRIC_COUNTERS
+};
+
+extern int metrics_enabled;
+
+void metrics_enable(void);
+uint64_t metrics_start(void);
+void metrics_stop(enum metric_timer timer, uint64_t started);
+void metrics_observe(enum metric_timer timer, uint64_t nanoseconds);
+void metrics_count(enum metric_counter counter, uint64_t amount);
+void metrics_print(FILE *out);
+int metrics_write_json(const char *path);
+
+#endif
@@ -1,6 +1,14 @@
 #!/bin/zsh
 
-sqlite3 budget.db <<EOF
+# The database to migrate: --db=PATH, else $BUDGET_DB, else budget.db
+db="${BUDGET_DB:-budget.db}"
+for arg in "$@"; do
+    case "$arg" in
+        --db=*) db="${arg#--db=}" ;;
+    esac
+done
+
+sqlite3 "$db" <<EOF
 CREATE TABLE IF NOT EXISTS categories(
     id INTEGER PRIMARY KEY AUTOINCREMENT,
     label TEXT UNIQUE,
@@ -30,3 +38,306 @@ CREATE TABLE IF NOT EXISTS category_examples(
 INSERT OR IGNORE INTO categories (label) VALUES ('Other');
 
 EOF
+
+# Versioned migrations: each step runs once, tracked by PRAGMA user_version.
+schema_version=$(sqlite3 "$db" "PRAGMA user_version;")
+
+# 1: content fingerprints for constant-time duplicate detection on import.
+# Existing rows are fingerprinted by the next import.
+if [ "$schema_version" -lt 1 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+ALTER TABLE transactions ADD COLUMN fingerprint INTEGER;
+CREATE UNIQUE INDEX IF NOT EXISTS transactions_fingerprint ON transactions(fingerprint);
+CREATE INDEX IF NOT EXISTS transactions_date ON transactions(date);
+PRAGMA user_version = 1;
+COMMIT;
+EOF
+fi
+
+# 2: classification cache keyed by normalized merchant description, cleared
+# whenever the category set changes.
+if [ "$schema_version" -lt 2 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+CREATE TABLE IF NOT EXISTS category_cache(
+    merchant TEXT PRIMARY KEY,
+    category_id INTEGER,
+    FOREIGN KEY(category_id) REFERENCES categories(id)
+);
+PRAGMA user_version = 2;
+COMMIT;
+EOF
+fi
+
+# 3: covering index for the reports, which filter on a date range and sum
+# charge per category. It replaces the plain date index from step 1.
+if [ "$schema_version" -lt 3 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+CREATE INDEX IF NOT EXISTS transactions_date_category_charge ON transactions(date, category_id, charge);
+DROP INDEX IF EXISTS transactions_date;
+PRAGMA user_version = 3;
+COMMIT;
+EOF
+fi
+
+# 4: per-month, per-category totals for the reports, kept in step with
+# transactions by triggers so every insert, reclassification and delete
+# updates them in the same transaction. Totals are kept in whole cents so
+# they never drift from the row sums. A NULL category is stored as 0.
+if [ "$schema_version" -lt 4 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+CREATE TABLE IF NOT EXISTS monthly_rollup(
+    month TEXT NOT NULL,
+    category_id INTEGER NOT NULL,
+    total_cents INTEGER NOT NULL,
+    count INTEGER NOT NULL,
+    PRIMARY KEY(month, category_id)
+) WITHOUT ROWID;
+
+CREATE TRIGGER IF NOT EXISTS transactions_rollup_insert AFTER INSERT ON transactions
+BEGIN
+    INSERT INTO monthly_rollup (month, category_id, total_cents, count)
+    VALUES (substr(NEW.date, 1, 7), IFNULL(NEW.category_id, 0), CAST(round(NEW.charge * 100) AS INTEGER), 1)
+    ON CONFLICT(month, category_id) DO UPDATE SET total_cents = total_cents + excluded.total_cents, count = count + 1;
+END;
+
+CREATE TRIGGER IF NOT EXISTS transactions_rollup_delete AFTER DELETE ON transactions
+BEGIN
+    UPDATE monthly_rollup SET total_cents = total_cents - CAST(round(OLD.charge * 100) AS INTEGER), count = count - 1
+    WHERE month = substr(OLD.date, 1, 7) AND category_id = IFNULL(OLD.category_id, 0);
+    DELETE FROM monthly_rollup
+    WHERE month = substr(OLD.date, 1, 7) AND category_id = IFNULL(OLD.category_id, 0) AND count <= 0;
+END;
+
+CREATE TRIGGER IF NOT EXISTS transactions_rollup_update AFTER UPDATE OF date, charge, category_id ON transactions
+BEGIN
+    UPDATE monthly_rollup SET total_cents = total_cents - CAST(round(OLD.charge * 100) AS INTEGER), count = count - 1
+    WHERE month = substr(OLD.date, 1, 7) AND category_id = IFNULL(OLD.category_id, 0);
+    DELETE FROM monthly_rollup
+    WHERE month = substr(OLD.date, 1, 7) AND category_id = IFNULL(OLD.category_id, 0) AND count <= 0;
+    INSERT INTO monthly_rollup (month, category_id, total_cents, count)
+    VALUES (substr(NEW.date, 1, 7), IFNULL(NEW.category_id, 0), CAST(round(NEW.charge * 100) AS INTEGER), 1)
+    ON CONFLICT(month, category_id) DO UPDATE SET total_cents = total_cents + excluded.total_cents, count = count + 1;
+END;
+
+DELETE FROM monthly_rollup;
+INSERT INTO monthly_rollup (month, category_id, total_cents, count)
+SELECT substr(date, 1, 7), IFNULL(category_id, 0), SUM(CAST(round(charge * 100) AS INTEGER)), COUNT(*) FROM transactions GROUP BY 1, 2;
+PRAGMA user_version = 4;
+COMMIT;
+EOF
+fi
+
+# 5: fixed-point storage. Dates become integer days since 1970-01-01 and
+# charges integer cents, so range filters, sorting and sums are integer work
+# and totals are exact. SQLite cannot change a column's type in place, so the
+# table is rebuilt, which drops the old indexes and rollup triggers; they are
+# recreated against the new columns. Fingerprints are kept as they are.
+if [ "$schema_version" -lt 5 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+CREATE TABLE transactions_fixed(
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    day INTEGER,
+    cents INTEGER,
+    description TEXT,
+    category_id INTEGER,
+    fingerprint INTEGER,
+    FOREIGN KEY(category_id) REFERENCES categories(id)
+);
+INSERT INTO transactions_fixed (id, day, cents, description, category_id, fingerprint)
+SELECT id, CAST(julianday(date) - 2440587.5 AS INTEGER), CAST(round(charge * 100) AS INTEGER), description, category_id, fingerprint
+FROM transactions ORDER BY id;
+DROP TABLE transactions;
+ALTER TABLE transactions_fixed RENAME TO transactions;
+
+CREATE UNIQUE INDEX transactions_fingerprint ON transactions(fingerprint);
+CREATE INDEX transactions_day_category_cents ON transactions(day, category_id, cents);
+
+CREATE TRIGGER transactions_rollup_insert AFTER INSERT ON transactions
+BEGIN
+    INSERT INTO monthly_rollup (month, category_id, total_cents, count)
+    VALUES (IFNULL(strftime('%Y-%m', NEW.day * 86400, 'unixepoch'), ''), IFNULL(NEW.category_id, 0), NEW.cents, 1)
+    ON CONFLICT(month, category_id) DO UPDATE SET total_cents = total_cents + excluded.total_cents, count = count + 1;
+END;
+
+CREATE TRIGGER transactions_rollup_delete AFTER DELETE ON transactions
+BEGIN
+    UPDATE monthly_rollup SET total_cents = total_cents - OLD.cents, count = count - 1
+    WHERE month = IFNULL(strftime('%Y-%m', OLD.day * 86400, 'unixepoch'), '') AND category_id = IFNULL(OLD.category_id, 0);
+    DELETE FROM monthly_rollup
+    WHERE month = IFNULL(strftime('%Y-%m', OLD.day * 86400, 'unixepoch'), '') AND category_id = IFNULL(OLD.category_id, 0) AND count <= 0;
+END;
+
+CREATE TRIGGER transactions_rollup_update AFTER UPDATE OF day, cents, category_id ON transactions
+BEGIN
+    UPDATE monthly_rollup SET total_cents = total_cents - OLD.cents, count = count - 1
+    WHERE month = IFNULL(strftime('%Y-%m', OLD.day * 86400, 'unixepoch'), '') AND category_id = IFNULL(OLD.category_id, 0);
+    DELETE FROM monthly_rollup
+    WHERE month = IFNULL(strftime('%Y-%m', OLD.day * 86400, 'unixepoch'), '') AND category_id = IFNULL(OLD.category_id, 0) AND count <= 0;
+    INSERT INTO monthly_rollup (month, category_id, total_cents, count)
+    VALUES (IFNULL(strftime('%Y-%m', NEW.day * 86400, 'unixepoch'), ''), IFNULL(NEW.category_id, 0), NEW.cents, 1)
+    ON CONFLICT(month, category_id) DO UPDATE SET total_cents = total_cents + excluded.total_cents, count = count + 1;
+END;
+
+DELETE FROM monthly_rollup;
+INSERT INTO monthly_rollup (month, category_id, total_cents, count)
+SELECT IFNULL(strftime('%Y-%m', day * 86400, 'unixepoch'), ''), IFNULL(category_id, 0), SUM(cents), COUNT(*) FROM transactions GROUP BY 1, 2;
+PRAGMA user_version = 5;
+COMMIT;
+EOF
+fi
+
+# 6: import checkpoints. One row per imported file, keyed by its absolute
+# path, recording how far into it the import has committed, so re-importing
+# a file that has only been appended to skips the part already stored.
+if [ "$schema_version" -lt 6 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+CREATE TABLE IF NOT EXISTS import_ledger(
+    source TEXT PRIMARY KEY,
+    committed_offset INTEGER NOT NULL,
+    records INTEGER NOT NULL,
+    prefix_hash INTEGER NOT NULL,
+    tail_hash INTEGER NOT NULL,
+    updated_at TEXT NOT NULL
+);
+PRAGMA user_version = 6;
+COMMIT;
+EOF
+fi
+
+# 7: category-set versions. The version goes up on every change to the
+# categories or their examples, and each transaction records the version
+# that labelled it, so reclassify only relabels rows whose label is stale.
+# Rows labelled before this step have no version and count as stale.
+if [ "$schema_version" -lt 7 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+CREATE TABLE IF NOT EXISTS category_set(
+    id INTEGER PRIMARY KEY CHECK (id = 1),
+    version INTEGER NOT NULL
+);
+INSERT OR IGNORE INTO category_set (id, version) VALUES (1, 1);
+ALTER TABLE transactions ADD COLUMN category_version INTEGER;
+
+CREATE TRIGGER categories_version_insert AFTER INSERT ON categories
+BEGIN
+    UPDATE category_set SET version = version + 1;
+END;
+CREATE TRIGGER categories_version_update AFTER UPDATE ON categories
+BEGIN
+    UPDATE category_set SET version = version + 1;
+END;
+CREATE TRIGGER categories_version_delete AFTER DELETE ON categories
+BEGIN
+    UPDATE category_set SET version = version + 1;
+END;
+CREATE TRIGGER category_examples_version_insert AFTER INSERT ON category_examples
+BEGIN
+    UPDATE category_set SET version = version + 1;
+END;
+CREATE TRIGGER category_examples_version_update AFTER UPDATE ON category_examples
+BEGIN
+    UPDATE category_set SET version = version + 1;
+END;
+CREATE TRIGGER category_examples_version_delete AFTER DELETE ON category_examples
+BEGIN
+    UPDATE category_set SET version = version + 1;
+END;
+PRAGMA user_version = 7;
+COMMIT;
+EOF
+fi
+
+# 8: keyset pagination for transaction list. An index on day alone is
+# ordered by (day, id), so each page is a seek past the previous page's
+# last row.
+if [ "$schema_version" -lt 8 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+CREATE INDEX IF NOT EXISTS transactions_day_id ON transactions(day);
+PRAGMA user_version = 8;
+COMMIT;
+EOF
+fi
+
+# 9: full-text search over descriptions for transaction search. The index
+# is external content over transactions, kept in step by triggers, so
+# imports and edits need no extra code.
+if [ "$schema_version" -lt 9 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+CREATE VIRTUAL TABLE IF NOT EXISTS transactions_fts USING fts5(
+    description,
+    content = 'transactions',
+    content_rowid = 'id'
+);
+CREATE TRIGGER IF NOT EXISTS transactions_fts_insert AFTER INSERT ON transactions
+BEGIN
+    INSERT INTO transactions_fts (rowid, description) VALUES (NEW.id, NEW.description);
+END;
+CREATE TRIGGER IF NOT EXISTS transactions_fts_delete AFTER DELETE ON transactions
+BEGIN
+    INSERT INTO transactions_fts (transactions_fts, rowid, description) VALUES ('delete', OLD.id, OLD.description);
+END;
+CREATE TRIGGER IF NOT EXISTS transactions_fts_update AFTER UPDATE OF description ON transactions
+BEGIN
+    INSERT INTO transactions_fts (transactions_fts, rowid, description) VALUES ('delete', OLD.id, OLD.description);
+    INSERT INTO transactions_fts (rowid, description) VALUES (NEW.id, NEW.description);
+END;
+INSERT INTO transactions_fts (transactions_fts) VALUES ('rebuild');
+PRAGMA user_version = 9;
+COMMIT;
+EOF
+fi
+
+# 10: a category-set change also empties the classification cache, whose
+# answers were given for the old set. The version triggers of step 7 are
+# recreated, so edits made outside the application are covered too.
+if [ "$schema_version" -lt 10 ]; then
+sqlite3 "$db" <<EOF
+BEGIN;
+DROP TRIGGER IF EXISTS categories_version_insert;
+CREATE TRIGGER categories_version_insert AFTER INSERT ON categories
+BEGIN
+    UPDATE category_set SET version = version + 1;
+    DELETE FROM category_cache;
+END;
+DROP TRIGGER IF EXISTS categories_version_update;
+CREATE TRIGGER categories_version_update AFTER UPDATE ON categories
+BEGIN
+    UPDATE category_set SET version = version + 1;
+    DELETE FROM category_cache;
+END;
+DROP TRIGGER IF EXISTS categories_version_delete;
+CREATE TRIGGER categories_version_delete AFTER DELETE ON categories
+BEGIN
+    UPDATE category_set SET version = version + 1;
+    DELETE FROM category_cache;
+END;
+DROP TRIGGER IF EXISTS category_examples_version_insert;
+CREATE TRIGGER category_examples_version_insert AFTER INSERT ON category_examples
+BEGIN
+    UPDATE category_set SET version = version + 1;
+    DELETE FROM category_cache;
+END;
+DROP TRIGGER IF EXISTS category_examples_version_update;
+CREATE TRIGGER category_examples_version_update AFTER UPDATE ON category_examples
+BEGIN
+    UPDATE category_set SET version = version + 1;
+    DELETE FROM category_cache;
+END;
+DROP TRIGGER IF EXISTS category_examples_version_delete;
+CREATE TRIGGER category_examples_version_delete AFTER DELETE ON category_examples
+BEGIN
+    UPDATE category_set SET version = version + 1;
+    DELETE FROM category_cache;
+END;
+PRAGMA user_version = 10;
+COMMIT;
+EOF
+fi
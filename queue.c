@@ -0,0 +1,134 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "queue.h"
+
+/**
+ * @brief Monotonic wall-clock time in seconds.
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Initialize an empty queue.
+ *
+ * @param queue The queue to initialize.
+ * @param capacity Maximum number of items held before queue_push blocks.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int queue_init(struct queue *queue, int capacity) {
+    *queue = (struct queue){ .capacity = capacity > 0 ? capacity : 1 };
+    queue->items = malloc(sizeof(void *) * queue->capacity);
+    if (!queue->items) {
+        return -1;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+/**
+ * @brief Append an item, waiting for room if the queue is full.
+ *
+ * @return 0 on success, -1 if the queue was cancelled (the item is not queued).
+ */
+int queue_push(struct queue *queue, void *item) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity && !queue->cancelled) {
+        double started = now_seconds();
+        while (queue->count == queue->capacity && !queue->cancelled) {
+            pthread_cond_wait(&queue->not_full, &queue->lock);
+        }
+        queue->push_wait += now_seconds() - started;
+    }
+    if (queue->cancelled) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    queue->pushes++;
+    queue->depth_sum += queue->count;
+    if (queue->count > queue->max_depth) {
+        queue->max_depth = queue->count;
+    }
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/**
+ * @brief Remove the oldest item, waiting for one if the queue is empty.
+ *
+ * @return The item, or NULL once the queue is closed and empty.
+ */
+void *queue_pop(struct queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == 0 && !queue->closed) {
+        double started = now_seconds();
+        while (queue->count == 0 && !queue->closed) {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        }
+        queue->pop_wait += now_seconds() - started;
+    }
+    void *item = NULL;
+    if (queue->count > 0) {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+/**
+ * @brief Mark the end of input; queue_pop returns NULL once the remaining items are taken.
+ */
+void queue_close(struct queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @brief Close the queue and make every further push fail, waking blocked producers.
+ */
+void queue_cancel(struct queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    queue->cancelled = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @brief Print the depth and wait statistics of a queue.
+ */
+void queue_print_stats(const struct queue *queue, const char *name) {
+    printf("Queue %s: %ld batches, depth avg %.1f max %d of %d, producer blocked %.2fs, consumer blocked %.2fs\n",
+           name, queue->pushes, queue->pushes > 0 ? (double)queue->depth_sum / queue->pushes : 0.0,
+           queue->max_depth, queue->capacity, queue->push_wait, queue->pop_wait);
+}
+
+/**
+ * @brief Release a queue. Items still queued are not freed.
+ */
+void queue_free(struct queue *queue) {
+    if (!queue->items) {
+        return;
+    }
+    free(queue->items);
+    queue->items = NULL;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
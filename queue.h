@@ -0,0 +1,38 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+
+/**
+ * @brief Bounded, blocking FIFO of pointers connecting two pipeline stages.
+ *
+ * The producer blocks while the queue is full and the consumer while it is empty. Closing the
+ * queue lets the consumer drain what is left; cancelling it also makes further pushes fail, which
+ * is how a failing downstream stage stops the stages feeding it.
+ */
+struct queue {
+    void **items;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    int cancelled;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    long pushes;         /**< Items pushed so far. */
+    long depth_sum;      /**< Sum of the depth seen by each push, for the average. */
+    int max_depth;
+    double push_wait;    /**< Seconds producers spent blocked on a full queue. */
+    double pop_wait;     /**< Seconds consumers spent blocked on an empty queue. */
+};
+
+int queue_init(struct queue *queue, int capacity);
+int queue_push(struct queue *queue, void *item);
+void *queue_pop(struct queue *queue);
+void queue_close(struct queue *queue);
+void queue_cancel(struct queue *queue);
+void queue_print_stats(const struct queue *queue, const char *name);
+void queue_free(struct queue *queue);
+
+#endif
@@ -1,10 +1,30 @@
 #ifndef REPORT_H
 #define REPORT_H
 
-void report_budget(int year, const char *exclude_categories);
+int report_budget(FILE *out, FILE *err, int year, const char *exclude_categories);
 
-void report_budget_month(const char *month);
+int report_budget_month(FILE *out, FILE *err, const char *month, const char *exclude_categories);
 
-void report_spend(const char *date_start, const char *date_end, const char *agg, const char *exclude_categories, const char *output_format);
+int report_budget_breakdown(FILE *out, FILE *err, int year, const char *exclude_categories, const char *output_format);
+
+/**
+ * @brief Options of a spend report.
+ */
+struct spend_options {
+    const char *date_start;
+    const char *date_end;
+    const char *agg;                /**< NULL, "yearly" or "monthly"; shorthand for group_by. */
+    const char *group_by;           /**< Comma-separated year, month, week, weekday and category, or NULL. */
+    const char *exclude_categories; /**< Comma-separated category ids, or NULL. */
+    const char *output_format;      /**< json, ndjson, yaml, csv, or NULL for a table. */
+    const char *snapshot;           /**< Columnar snapshot directory to read instead of the database, or NULL. */
+    const char *engine;             /**< "sql" (the default) or "vector". */
+};
+
+int report_spend(FILE *out, FILE *err, const struct spend_options *options);
+
+int report_spend_bench(FILE *out, FILE *err, const struct spend_options *options, int runs);
+
+void rollup_rebuild(void);
 
 #endif 
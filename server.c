@@ -0,0 +1,650 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sqlite3.h>
+#include <json-c/json.h>
+#include "db.h"
+#include "hash.h"
+#include "queue.h"
+#include "server.h"
+
+// Connections accepted but not yet taken by a worker; accept waits while this many are pending
+#define SERVER_PENDING 64
+// Responses remembered before the cache is emptied and starts over
+#define SERVER_CACHE_ENTRIES 1024
+// Arguments accepted in one request
+#define SERVER_MAX_ARGS 32
+
+extern char **environ;
+
+/**
+ * @brief Responses to recent requests, valid while the database's data_version is unchanged.
+ */
+struct response_cache {
+    struct hash_map index;                    /**< Request key to slot in responses. */
+    char *responses[SERVER_CACHE_ENTRIES];
+    int count;
+    sqlite3_int64 data_version;
+    pthread_mutex_t lock;
+};
+
+/**
+ * @brief State shared by the acceptor and the worker threads.
+ */
+struct server {
+    server_handler handler;
+    struct queue connections;     /**< Accepted sockets, stored as fd + 1 so fd 0 is not NULL. */
+    struct response_cache cache;
+    int *active;                  /**< Socket each worker is serving, or -1; shut down on exit. */
+    int workers;
+    long requests;
+    long cache_hits;
+    pthread_mutex_t lock;
+};
+
+/**
+ * @brief A worker thread's view of the server.
+ */
+struct worker {
+    struct server *server;
+    int index;                    /**< Slot of server->active this worker owns. */
+};
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void server_stop(int signal) {
+    (void)signal;
+    server_stopping = 1;
+}
+
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Write all of data to a socket, retrying short writes.
+ *
+ * @return 0 on success, -1 if the peer went away.
+ */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief The database's data_version, which changes whenever another connection commits.
+ */
+static sqlite3_int64 data_version(void) {
+    sqlite3_int64 version = -1;
+    sqlite3_stmt *stmt = db_prepare("PRAGMA data_version;");
+    if (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int64(stmt, 0);
+    }
+    db_release(stmt);
+    return version;
+}
+
+static void cache_clear(struct response_cache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        free(cache->responses[i]);
+    }
+    cache->count = 0;
+    hash_map_free(&cache->index);
+    hash_map_init(&cache->index, SERVER_CACHE_ENTRIES);
+}
+
+/**
+ * @brief Look up a cached response, first dropping the cache if the database changed since it was filled.
+ *
+ * @param version The current data_version.
+ * @return A copy of the response to free, or NULL if it is not cached.
+ */
+static char *cache_get(struct response_cache *cache, const char *key, sqlite3_int64 version) {
+    char *response = NULL;
+    pthread_mutex_lock(&cache->lock);
+    if (version != cache->data_version) {
+        cache_clear(cache);
+        cache->data_version = version;
+    }
+    int slot;
+    if (hash_map_get(&cache->index, key, strlen(key), &slot)) {
+        response = strdup(cache->responses[slot]);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return response;
+}
+
+/**
+ * @brief Remember a response computed at the given data_version.
+ */
+static void cache_put(struct response_cache *cache, const char *key, const char *response, sqlite3_int64 version) {
+    pthread_mutex_lock(&cache->lock);
+    int slot;
+    if (version == cache->data_version && !hash_map_get(&cache->index, key, strlen(key), &slot)) {
+        if (cache->count == SERVER_CACHE_ENTRIES) {
+            cache_clear(cache);
+        }
+        char *copy = strdup(response);
+        if (copy && hash_map_put(&cache->index, key, cache->count) == 0) {
+            cache->responses[cache->count++] = copy;
+        } else {
+            free(copy);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static char *error_response(const char *message) {
+    json_object *reply = json_object_new_object();
+    json_object_object_add(reply, "error", json_object_new_string(message));
+    char *response = strdup(json_object_to_json_string_ext(reply, JSON_C_TO_STRING_PLAIN));
+    json_object_put(reply);
+    return response;
+}
+
+/**
+ * @brief Answer one request line.
+ *
+ * A request is {"args": ["report", "spend", "--date-start=...", ...]} with the same arguments
+ * as the command line, optionally with "cache": false to bypass the response cache. The reply is
+ * {"output": "..."} holding exactly what the command prints, or {"error": "..."} holding what a
+ * failed command printed as its error. Only successful replies are cached.
+ *
+ * @return The reply without its trailing newline, to be freed.
+ */
+static char *handle_request(struct server *server, const char *line) {
+    json_object *request = json_tokener_parse(line);
+    json_object *args = NULL;
+    if (!request || !json_object_object_get_ex(request, "args", &args) || !json_object_is_type(args, json_type_array)) {
+        json_object_put(request);
+        return error_response("expected {\"args\": [...]}");
+    }
+    size_t arg_count = json_object_array_length(args);
+    if (arg_count == 0 || arg_count > SERVER_MAX_ARGS) {
+        json_object_put(request);
+        return error_response("expected 1 to 32 arguments");
+    }
+    json_object *use_cache = NULL;
+    int cached = !json_object_object_get_ex(request, "cache", &use_cache) || json_object_get_boolean(use_cache);
+
+    // argv as main would see it, plus a cache key of the arguments separated by unit separators
+    char *argv[SERVER_MAX_ARGS + 2];
+    argv[0] = "budget_tracker";
+    size_t key_len = 0;
+    for (size_t i = 0; i < arg_count; i++) {
+        json_object *arg = json_object_array_get_idx(args, i);
+        if (!json_object_is_type(arg, json_type_string)) {
+            json_object_put(request);
+            return error_response("arguments must be strings");
+        }
+        argv[i + 1] = (char *)json_object_get_string(arg);
+        key_len += strlen(argv[i + 1]) + 1;
+    }
+    argv[arg_count + 1] = NULL;
+    char *key = malloc(key_len + 1);
+    if (!key) {
+        json_object_put(request);
+        return error_response("out of memory");
+    }
+    key[0] = '\0';
+    for (size_t i = 1, pos = 0; i <= arg_count; i++) {
+        pos += sprintf(key + pos, "%s\x1f", argv[i]);
+    }
+
+    sqlite3_int64 version = data_version();
+    char *response = cached ? cache_get(&server->cache, key, version) : NULL;
+    if (response) {
+        pthread_mutex_lock(&server->lock);
+        server->cache_hits++;
+        pthread_mutex_unlock(&server->lock);
+    } else {
+        char *output = NULL, *errors = NULL;
+        size_t output_len = 0, errors_len = 0;
+        FILE *out = open_memstream(&output, &output_len);
+        FILE *err = open_memstream(&errors, &errors_len);
+        int rc = out && err ? server->handler((int)arg_count + 1, argv, out, err) : -1;
+        if (out) {
+            fclose(out);
+        }
+        if (err) {
+            fclose(err);
+        }
+
+        if (rc == 0) {
+            json_object *reply = json_object_new_object();
+            json_object_object_add(reply, "output", json_object_new_string_len(output, (int)output_len));
+            response = strdup(json_object_to_json_string_ext(reply, JSON_C_TO_STRING_PLAIN));
+            json_object_put(reply);
+            if (response && version >= 0) {
+                cache_put(&server->cache, key, response, version);
+            }
+        } else if (rc > 0) {
+            // A failed command is answered with what it printed to err, and never cached
+            while (errors_len > 0 && errors[errors_len - 1] == '\n') {
+                errors[--errors_len] = '\0';
+            }
+            response = error_response(errors_len > 0 ? errors : "command failed");
+        } else {
+            char message[256];
+            snprintf(message, sizeof(message), "unsupported command: %s%s%s", argv[1], arg_count > 1 ? " " : "",
+                     arg_count > 1 ? argv[2] : "");
+            response = error_response(message);
+        }
+        free(output);
+        free(errors);
+    }
+
+    free(key);
+    json_object_put(request);
+    return response;
+}
+
+/**
+ * @brief Answer requests on one connection, one per line, until the client disconnects.
+ */
+static void serve_connection(struct server *server, int fd) {
+    FILE *in = fdopen(dup(fd), "r");
+    if (!in) {
+        return;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while ((len = getline(&line, &capacity, in)) > 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        char *response = handle_request(server, line);
+        pthread_mutex_lock(&server->lock);
+        server->requests++;
+        pthread_mutex_unlock(&server->lock);
+        int rc = response ? write_all(fd, response, strlen(response)) : -1;
+        free(response);
+        if (rc != 0 || write_all(fd, "\n", 1) != 0) {
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+}
+
+static void *server_worker(void *arg) {
+    struct server *server = ((struct worker *)arg)->server;
+    int worker = ((struct worker *)arg)->index;
+    void *item;
+    while ((item = queue_pop(&server->connections)) != NULL) {
+        int fd = (int)(intptr_t)item - 1;
+        pthread_mutex_lock(&server->lock);
+        server->active[worker] = fd;
+        pthread_mutex_unlock(&server->lock);
+
+        serve_connection(server, fd);
+
+        pthread_mutex_lock(&server->lock);
+        server->active[worker] = -1;
+        pthread_mutex_unlock(&server->lock);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Bind a listening Unix socket, replacing a stale socket file left by a server that died.
+ *
+ * @return The listening socket, or -1 on failure.
+ */
+static int listen_unix(const char *socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            fprintf(stderr, "A server is already listening on %s\n", socket_path);
+            close(fd);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SERVER_PENDING) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Serve read-only commands over a Unix socket until SIGINT or SIGTERM.
+ *
+ * The database connection, its prepared statements and page cache, and a cache of recent
+ * responses stay warm between requests, so a dashboard polling the same reports pays for the
+ * query once per change to the database instead of a process start and cold cache per request.
+ * Each connection is served by one of a pool of worker threads; queries from different workers
+ * share the one serialized connection, so the pool overlaps parsing, formatting and socket I/O
+ * rather than SQLite work.
+ *
+ * @param socket_path Path of the socket to create.
+ * @param workers Number of worker threads, i.e. connections served at once.
+ * @param handler Runs a command for a request.
+ * @return 0 on a clean shutdown, -1 if the server could not start.
+ */
+int server_run(const char *socket_path, int workers, server_handler handler) {
+    if (!db_open()) {
+        return -1;
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    int listen_fd = listen_unix(socket_path);
+    if (listen_fd < 0) {
+        return -1;
+    }
+
+    struct server server = { .handler = handler, .workers = workers, .cache.data_version = -1 };
+    server.active = malloc(sizeof(int) * workers);
+    if (!server.active || queue_init(&server.connections, SERVER_PENDING) != 0 ||
+        hash_map_init(&server.cache.index, SERVER_CACHE_ENTRIES) != 0) {
+        fprintf(stderr, "Failed to start server\n");
+        free(server.active);
+        close(listen_fd);
+        unlink(socket_path);
+        return -1;
+    }
+    for (int i = 0; i < workers; i++) {
+        server.active[i] = -1;
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_mutex_init(&server.cache.lock, NULL);
+
+    // Without SA_RESTART the signal interrupts accept, which is how the loop below notices it
+    struct sigaction action = { .sa_handler = server_stop };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers block the signals so they are delivered to the accepting thread
+    sigset_t stop_signals, previous;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &previous);
+    pthread_t threads[workers];
+    struct worker contexts[workers];
+    for (int i = 0; i < workers; i++) {
+        contexts[i] = (struct worker){ .server = &server, .index = i };
+        pthread_create(&threads[i], NULL, server_worker, &contexts[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    printf("Serving %s on %s with %d workers\n", db_path(), socket_path, workers);
+    fflush(stdout);
+
+    while (!server_stopping) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        if (queue_push(&server.connections, (void *)(intptr_t)(fd + 1)) != 0) {
+            close(fd);
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    queue_cancel(&server.connections);
+    pthread_mutex_lock(&server.lock);
+    for (int i = 0; i < workers; i++) {
+        if (server.active[i] >= 0) {
+            shutdown(server.active[i], SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    void *item;
+    while ((item = queue_pop(&server.connections)) != NULL) {
+        close((int)(intptr_t)item - 1);
+    }
+
+    printf("Served %ld requests (%ld from cache)\n", server.requests, server.cache_hits);
+    pthread_mutex_lock(&server.cache.lock);
+    cache_clear(&server.cache);
+    pthread_mutex_unlock(&server.cache.lock);
+    hash_map_free(&server.cache.index);
+    queue_free(&server.connections);
+    free(server.active);
+    return 0;
+}
+
+static int connect_unix(const char *socket_path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Send one request line and read the reply line.
+ *
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int round_trip(int fd, FILE *in, const char *request, char **reply, size_t *capacity) {
+    if (write_all(fd, request, strlen(request)) != 0 || getline(reply, capacity, in) <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Serialize a request as one newline-terminated line, to be freed.
+ */
+static char *request_line(json_object *request) {
+    const char *json = json_object_to_json_string_ext(request, JSON_C_TO_STRING_PLAIN);
+    size_t len = strlen(json);
+    char *line = malloc(len + 2);
+    if (line) {
+        memcpy(line, json, len);
+        line[len] = '\n';
+        line[len + 1] = '\0';
+    }
+    return line;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_latencies(const char *name, double *seconds, int count) {
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += seconds[i];
+    }
+    qsort(seconds, count, sizeof(double), compare_doubles);
+    printf("%-18s mean %8.3f ms  p50 %8.3f ms  p99 %8.3f ms\n", name, total / count * 1000,
+           seconds[count / 2] * 1000, seconds[(count * 99) / 100] * 1000);
+}
+
+/**
+ * @brief Time the same command run as a fresh process, the way a dashboard shelling out would.
+ *
+ * @return 0 on success, -1 if the process could not be started.
+ */
+static int bench_fork(int argc, char **argv, double *seconds, int count) {
+    char db_arg[4096];
+    snprintf(db_arg, sizeof(db_arg), "--db=%s", db_path());
+    char *child_argv[argc + 3];
+    child_argv[0] = "budget_tracker";
+    child_argv[1] = db_arg;
+    for (int i = 0; i < argc; i++) {
+        child_argv[i + 2] = argv[i];
+    }
+    child_argv[argc + 2] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    int rc = 0;
+    for (int i = 0; i < count && rc == 0; i++) {
+        double start = monotonic_now();
+        pid_t pid;
+        int status;
+        if (posix_spawn(&pid, "/proc/self/exe", &actions, NULL, child_argv, environ) != 0 ||
+            waitpid(pid, &status, 0) < 0) {
+            perror("posix_spawn");
+            rc = -1;
+        }
+        seconds[i] = monotonic_now() - start;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return rc;
+}
+
+/**
+ * @brief Run a command on a server and print its output.
+ *
+ * With bench > 0 the command is instead sent bench times over one connection, both answered from
+ * the server's response cache and with the cache bypassed, then run bench times as a new process
+ * per query, and the latency of each approach is printed. The forked runs use this process's
+ * database (--db or $BUDGET_DB), which should be the one the server was started with.
+ *
+ * @param socket_path The server's socket.
+ * @param argc Number of command arguments.
+ * @param argv The command and its options, e.g. "report", "spend", "--date-start=...".
+ * @param bench Number of timed requests per approach, or 0 to run the command once.
+ * @return 0 on success, 1 if the server could not be reached or reported an error.
+ */
+int client_run(const char *socket_path, int argc, char **argv, int bench) {
+    if (argc < 1) {
+        printf("Command not specified.\n");
+        return 1;
+    }
+    int fd = connect_unix(socket_path);
+    if (fd < 0) {
+        return 1;
+    }
+    FILE *in = fdopen(dup(fd), "r");
+    if (!in) {
+        close(fd);
+        return 1;
+    }
+
+    // The same request, answered from the cache and with the cache bypassed
+    json_object *request = json_object_new_object();
+    json_object *args = json_object_new_array();
+    for (int i = 0; i < argc; i++) {
+        json_object_array_add(args, json_object_new_string(argv[i]));
+    }
+    json_object_object_add(request, "args", args);
+    char *cached_request = request_line(request);
+    json_object_object_add(request, "cache", json_object_new_boolean(0));
+    char *uncached_request = request_line(request);
+    json_object_put(request);
+
+    char *reply_line = NULL;
+    size_t capacity = 0;
+    int rc = 1;
+    if (cached_request && uncached_request && round_trip(fd, in, cached_request, &reply_line, &capacity) == 0) {
+        json_object *reply = json_tokener_parse(reply_line);
+        json_object *field = NULL;
+        if (reply && json_object_object_get_ex(reply, "output", &field)) {
+            if (bench == 0) {
+                fwrite(json_object_get_string(field), 1, json_object_get_string_len(field), stdout);
+            }
+            rc = 0;
+        } else if (reply && json_object_object_get_ex(reply, "error", &field)) {
+            fprintf(stderr, "Server error: %s\n", json_object_get_string(field));
+        } else {
+            fprintf(stderr, "Malformed reply from %s\n", socket_path);
+        }
+        json_object_put(reply);
+    } else {
+        fprintf(stderr, "No reply from %s\n", socket_path);
+    }
+
+    double *seconds = rc == 0 && bench > 0 ? malloc(sizeof(double) * bench) : NULL;
+    if (seconds) {
+        printf("Benchmark: %d requests per approach\n", bench);
+        const char *requests[] = { cached_request, uncached_request };
+        const char *names[] = { "server (cached)", "server (uncached)" };
+        for (int approach = 0; approach < 2 && rc == 0; approach++) {
+            for (int i = 0; i < bench; i++) {
+                double start = monotonic_now();
+                if (round_trip(fd, in, requests[approach], &reply_line, &capacity) != 0) {
+                    fprintf(stderr, "Connection to %s lost\n", socket_path);
+                    rc = 1;
+                    break;
+                }
+                seconds[i] = monotonic_now() - start;
+            }
+            if (rc == 0) {
+                print_latencies(names[approach], seconds, bench);
+            }
+        }
+        if (rc == 0 && bench_fork(argc, argv, seconds, bench) == 0) {
+            print_latencies("fork per query", seconds, bench);
+        }
+        free(seconds);
+    }
+
+    free(reply_line);
+    free(cached_request);
+    free(uncached_request);
+    fclose(in);
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,20 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+
+// Worker threads answering connections when --workers is not given
+#define SERVER_DEFAULT_WORKERS 4
+
+/**
+ * @brief Runs one read-only command, given as main's argc/argv, writing its output to out.
+ *
+ * @return 0 if the command succeeded, 1 if it failed after writing why to err, -1 if it is not
+ * one the server answers.
+ */
+typedef int (*server_handler)(int argc, char **argv, FILE *out, FILE *err);
+
+int server_run(const char *socket_path, int workers, server_handler handler);
+int client_run(const char *socket_path, int argc, char **argv, int bench);
+
+#endif
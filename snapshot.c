@@ -0,0 +1,507 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include "db.h"
+#include "hash.h"
+#include "snapshot.h"
+
+// Every column file starts with this header, which keeps the data 64-byte aligned when mapped
+#define SNAPSHOT_HEADER_SIZE 64
+#define SNAPSHOT_MAGIC "BTSNAP1"
+// Written in native byte order, so a reader on a machine of the other order can tell
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+// Buffer of each column file while exporting
+#define SNAPSHOT_WRITE_BUFFER (1 << 20)
+
+/**
+ * @brief Header of a column file.
+ */
+struct column_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t width;      /**< Bytes per element. */
+    char reserved[SNAPSHOT_HEADER_SIZE - 16];
+};
+
+enum {
+    COLUMN_DAY,
+    COLUMN_CENTS,
+    COLUMN_CATEGORY,
+    COLUMN_DESCRIPTION,
+    COLUMN_BLOCKS,
+    COLUMN_DICTIONARY_OFFSETS,
+    COLUMN_DICTIONARY,
+    COLUMN_COUNT
+};
+
+static const struct {
+    const char *name;
+    uint32_t width;
+} column_files[COLUMN_COUNT] = {
+    { "day.col", sizeof(int32_t) },
+    { "cents.col", sizeof(int64_t) },
+    { "category.col", sizeof(int32_t) },
+    { "description.col", sizeof(uint32_t) },
+    { "blocks.col", sizeof(struct snapshot_block) },
+    { "dictionary.off", sizeof(uint64_t) },
+    { "dictionary.str", 1 },
+};
+
+/**
+ * @brief Row and dictionary counts of a snapshot, kept in its snapshot.meta file.
+ *
+ * The column files may hold more data than the metadata accounts for if an export was interrupted;
+ * only the counted elements are part of the snapshot.
+ */
+struct snapshot_meta {
+    size_t rows;
+    size_t descriptions;
+    size_t dictionary_bytes;
+    int64_t last_id;
+};
+
+/**
+ * @brief Number of elements of a column file that belong to the snapshot.
+ */
+static size_t column_count(const struct snapshot_meta *meta, int column) {
+    switch (column) {
+    case COLUMN_BLOCKS:
+        return (meta->rows + SNAPSHOT_BLOCK_ROWS - 1) / SNAPSHOT_BLOCK_ROWS;
+    case COLUMN_DICTIONARY_OFFSETS:
+        return meta->descriptions;
+    case COLUMN_DICTIONARY:
+        return meta->dictionary_bytes;
+    default:
+        return meta->rows;
+    }
+}
+
+static void snapshot_file(char *path, size_t size, const char *dir, const char *name) {
+    snprintf(path, size, "%s/%s", dir, name);
+}
+
+static int read_meta(const char *dir, struct snapshot_meta *meta) {
+    char path[4096];
+    snapshot_file(path, sizeof(path), dir, "snapshot.meta");
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    long long rows = -1, descriptions = -1, dictionary_bytes = -1, last_id = -1, block_rows = -1;
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        sscanf(line, "rows=%lld", &rows);
+        sscanf(line, "descriptions=%lld", &descriptions);
+        sscanf(line, "dictionary_bytes=%lld", &dictionary_bytes);
+        sscanf(line, "last_id=%lld", &last_id);
+        sscanf(line, "block_rows=%lld", &block_rows);
+    }
+    fclose(file);
+    if (rows < 0 || descriptions < 0 || dictionary_bytes < 0 || last_id < 0 || block_rows != SNAPSHOT_BLOCK_ROWS) {
+        return -1;
+    }
+    *meta = (struct snapshot_meta){ .rows = rows, .descriptions = descriptions, .dictionary_bytes = dictionary_bytes,
+                                    .last_id = last_id };
+    return 0;
+}
+
+/**
+ * @brief Replace snapshot.meta, which is what makes newly appended rows part of the snapshot.
+ */
+static int write_meta(const char *dir, const struct snapshot_meta *meta) {
+    char path[4096], temp[4096];
+    snapshot_file(path, sizeof(path), dir, "snapshot.meta");
+    snapshot_file(temp, sizeof(temp), dir, "snapshot.meta.tmp");
+    FILE *file = fopen(temp, "w");
+    if (!file) {
+        return -1;
+    }
+    fprintf(file, "rows=%zu\ndescriptions=%zu\ndictionary_bytes=%zu\nlast_id=%lld\nblock_rows=%d\n", meta->rows,
+            meta->descriptions, meta->dictionary_bytes, (long long)meta->last_id, SNAPSHOT_BLOCK_ROWS);
+    int rc = fflush(file) == 0 && fsync(fileno(file)) == 0 ? 0 : -1;
+    fclose(file);
+    return rc == 0 ? rename(temp, path) : -1;
+}
+
+/**
+ * @brief Replace categories.tsv with the current id and label of every category.
+ */
+static int write_categories(const char *dir) {
+    char path[4096], temp[4096];
+    snapshot_file(path, sizeof(path), dir, "categories.tsv");
+    snapshot_file(temp, sizeof(temp), dir, "categories.tsv.tmp");
+    sqlite3_stmt *stmt = db_prepare("SELECT id, label FROM categories ORDER BY id;");
+    FILE *file = stmt ? fopen(temp, "w") : NULL;
+    if (!file) {
+        db_release(stmt);
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *label = (const char *)sqlite3_column_text(stmt, 1);
+        fprintf(file, "%d\t", sqlite3_column_int(stmt, 0));
+        // Tabs and line breaks would split the record
+        for (const char *c = label ? label : ""; *c; c++) {
+            putc(*c == '\t' || *c == '\n' || *c == '\r' ? ' ' : *c, file);
+        }
+        putc('\n', file);
+    }
+    db_release(stmt);
+    int rc = fflush(file) == 0 && fsync(fileno(file)) == 0 ? 0 : -1;
+    fclose(file);
+    return rc == 0 ? rename(temp, path) : -1;
+}
+
+/**
+ * @brief Open a column file for appending after the elements counted in meta.
+ *
+ * With full set the file is recreated with just its header. Otherwise NULL is returned if the file
+ * is missing or does not hold the counted elements, so the caller can start over.
+ */
+static FILE *open_column(const char *dir, int column, const struct snapshot_meta *meta, int full) {
+    char path[4096];
+    snapshot_file(path, sizeof(path), dir, column_files[column].name);
+    size_t size = SNAPSHOT_HEADER_SIZE + column_count(meta, column) * column_files[column].width;
+
+    FILE *file = full ? NULL : fopen(path, "r+b");
+    if (file) {
+        setvbuf(file, NULL, _IOFBF, SNAPSHOT_WRITE_BUFFER);
+        struct column_header header;
+        struct stat st;
+        if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0 ||
+            header.byte_order != SNAPSHOT_BYTE_ORDER || header.width != column_files[column].width ||
+            fstat(fileno(file), &st) != 0 || (size_t)st.st_size < size || ftruncate(fileno(file), size) != 0) {
+            fclose(file);
+            return NULL;
+        }
+        fseek(file, 0, SEEK_END);
+    } else if (full) {
+        file = fopen(path, "w+b");
+        if (!file) {
+            fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        setvbuf(file, NULL, _IOFBF, SNAPSHOT_WRITE_BUFFER);
+        struct column_header header = { .magic = SNAPSHOT_MAGIC, .byte_order = SNAPSHOT_BYTE_ORDER,
+                                        .width = column_files[column].width };
+        fwrite(&header, sizeof(header), 1, file);
+    }
+    return file;
+}
+
+/**
+ * @brief Load the description dictionary of an existing snapshot into a map from description to id.
+ */
+static int load_dictionary(const char *dir, const struct snapshot_meta *meta, struct hash_map *dictionary) {
+    if (meta->dictionary_bytes == 0) {
+        return 0;
+    }
+    char path[4096];
+    snapshot_file(path, sizeof(path), dir, column_files[COLUMN_DICTIONARY].name);
+    FILE *file = fopen(path, "rb");
+    char *data = malloc(meta->dictionary_bytes);
+    int rc = -1;
+    if (file && data && fseek(file, SNAPSHOT_HEADER_SIZE, SEEK_SET) == 0 &&
+        fread(data, 1, meta->dictionary_bytes, file) == meta->dictionary_bytes) {
+        rc = 0;
+        size_t id = 0;
+        for (size_t pos = 0; pos < meta->dictionary_bytes && rc == 0; id++) {
+            rc = hash_map_put(dictionary, data + pos, (int)id);
+            pos += strlen(data + pos) + 1;
+        }
+        if (id != meta->descriptions) {
+            rc = -1;
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+    free(data);
+    return rc;
+}
+
+/**
+ * @brief Export the transactions table as a columnar snapshot.
+ *
+ * The snapshot directory holds one file per column (day, cents, category_id and description
+ * dictionary id, in transaction id order), the description dictionary, the smallest and largest
+ * day of each block of SNAPSHOT_BLOCK_ROWS rows, the categories and a snapshot.meta file with the
+ * counts. Column files are a 64-byte header followed by fixed-width native-endian values, so
+ * they can be memory-mapped and read as arrays.
+ *
+ * An existing snapshot is extended with the transactions whose id is above the last one exported.
+ * Changes to rows already exported (e.g. reclassification) are only picked up with full set.
+ *
+ * @param dir The snapshot directory, created if needed.
+ * @param full Non-zero to rewrite the snapshot from scratch.
+ * @return 0 on success, -1 on failure.
+ */
+int snapshot_export(const char *dir, int full) {
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    sqlite3 *db = db_open();
+    if (!db) {
+        return -1;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    struct snapshot_meta meta = { 0 };
+    if (!full && read_meta(dir, &meta) != 0) {
+        full = 1;
+    }
+    FILE *files[COLUMN_COUNT] = { 0 };
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int opened = 0;
+        for (int i = 0; i < COLUMN_COUNT; i++) {
+            files[i] = open_column(dir, i, &meta, full);
+            opened += files[i] != NULL;
+        }
+        if (opened == COLUMN_COUNT || full) {
+            break;
+        }
+        // A column file does not match the metadata: start the snapshot over
+        fprintf(stderr, "Snapshot in %s is incomplete; exporting all transactions\n", dir);
+        for (int i = 0; i < COLUMN_COUNT; i++) {
+            if (files[i]) {
+                fclose(files[i]);
+            }
+        }
+        meta = (struct snapshot_meta){ 0 };
+        full = 1;
+    }
+
+    struct hash_map dictionary;
+    int rc = hash_map_init(&dictionary, meta.descriptions + 1024);
+    for (int i = 0; i < COLUMN_COUNT; i++) {
+        if (!files[i]) {
+            rc = -1;
+        }
+    }
+    if (rc == 0 && load_dictionary(dir, &meta, &dictionary) != 0) {
+        fprintf(stderr, "Cannot read the description dictionary in %s\n", dir);
+        rc = -1;
+    }
+
+    // The last block may be partial; its statistics are rewritten as rows are added to it
+    struct snapshot_block block = { INT32_MAX, INT32_MIN };
+    if (rc == 0 && meta.rows % SNAPSHOT_BLOCK_ROWS != 0) {
+        long offset = SNAPSHOT_HEADER_SIZE + (long)(meta.rows / SNAPSHOT_BLOCK_ROWS) * sizeof(struct snapshot_block);
+        if (fseek(files[COLUMN_BLOCKS], offset, SEEK_SET) != 0 ||
+            fread(&block, sizeof(block), 1, files[COLUMN_BLOCKS]) != 1 ||
+            fseek(files[COLUMN_BLOCKS], offset, SEEK_SET) != 0) {
+            rc = -1;
+        }
+    }
+
+    sqlite3_stmt *stmt = rc == 0 ? db_prepare("SELECT id, day, cents, category_id, description FROM transactions "
+                                              "WHERE id > ? ORDER BY id;") : NULL;
+    if (rc == 0 && !stmt) {
+        fprintf(stderr, "Failed to fetch transactions: %s\n", sqlite3_errmsg(db));
+        rc = -1;
+    }
+    size_t added = 0;
+    if (stmt) {
+        sqlite3_bind_int64(stmt, 1, meta.last_id);
+        while (rc == 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+            const char *description = (const char *)sqlite3_column_text(stmt, 4);
+            if (!description) {
+                description = "";
+            }
+            size_t len = strlen(description);
+            int description_id;
+            if (!hash_map_get(&dictionary, description, len, &description_id)) {
+                description_id = (int)meta.descriptions;
+                uint64_t offset = meta.dictionary_bytes;
+                if (hash_map_put(&dictionary, description, description_id) != 0) {
+                    rc = -1;
+                    break;
+                }
+                fwrite(&offset, sizeof(offset), 1, files[COLUMN_DICTIONARY_OFFSETS]);
+                fwrite(description, 1, len + 1, files[COLUMN_DICTIONARY]);
+                meta.descriptions++;
+                meta.dictionary_bytes += len + 1;
+            }
+
+            int32_t day = sqlite3_column_int(stmt, 1);
+            int64_t cents = sqlite3_column_int64(stmt, 2);
+            int32_t category_id = sqlite3_column_int(stmt, 3);
+            uint32_t description_index = description_id;
+            fwrite(&day, sizeof(day), 1, files[COLUMN_DAY]);
+            fwrite(&cents, sizeof(cents), 1, files[COLUMN_CENTS]);
+            fwrite(&category_id, sizeof(category_id), 1, files[COLUMN_CATEGORY]);
+            fwrite(&description_index, sizeof(description_index), 1, files[COLUMN_DESCRIPTION]);
+
+            block.min_day = day < block.min_day ? day : block.min_day;
+            block.max_day = day > block.max_day ? day : block.max_day;
+            meta.rows++;
+            meta.last_id = sqlite3_column_int64(stmt, 0);
+            added++;
+            if (meta.rows % SNAPSHOT_BLOCK_ROWS == 0) {
+                fwrite(&block, sizeof(block), 1, files[COLUMN_BLOCKS]);
+                block = (struct snapshot_block){ INT32_MAX, INT32_MIN };
+            }
+        }
+        db_release(stmt);
+        if (rc == 0 && meta.rows % SNAPSHOT_BLOCK_ROWS != 0) {
+            fwrite(&block, sizeof(block), 1, files[COLUMN_BLOCKS]);
+        }
+    }
+
+    // The data must be on disk before the metadata that counts it
+    for (int i = 0; i < COLUMN_COUNT; i++) {
+        if (files[i]) {
+            if (fflush(files[i]) != 0 || ferror(files[i]) || fsync(fileno(files[i])) != 0) {
+                rc = -1;
+            }
+            fclose(files[i]);
+        }
+    }
+    hash_map_free(&dictionary);
+    if (rc == 0 && (write_categories(dir) != 0 || write_meta(dir, &meta) != 0)) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Failed to export snapshot to %s\n", dir);
+        return -1;
+    }
+
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    printf("Exported %zu new transactions to %s (%zu rows, %zu distinct descriptions) in %.2fs\n", added, dir,
+           meta.rows, meta.descriptions,
+           (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+    return 0;
+}
+
+/**
+ * @brief Map the counted part of a column file.
+ *
+ * @return A pointer to the first element, or NULL if the file is missing, malformed or too short.
+ */
+static const void *map_column(struct snapshot *snapshot, const char *dir, int column, const struct snapshot_meta *meta) {
+    char path[4096];
+    snapshot_file(path, sizeof(path), dir, column_files[column].name);
+    size_t size = SNAPSHOT_HEADER_SIZE + column_count(meta, column) * column_files[column].width;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= size) {
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    snapshot->maps[column] = map;
+    snapshot->map_sizes[column] = size;
+
+    const struct column_header *header = map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 || header->byte_order != SNAPSHOT_BYTE_ORDER ||
+        header->width != column_files[column].width) {
+        return NULL;
+    }
+    return (const char *)map + SNAPSHOT_HEADER_SIZE;
+}
+
+static int load_categories(struct snapshot *snapshot, const char *dir) {
+    char path[4096];
+    snapshot_file(path, sizeof(path), dir, "categories.tsv");
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    int allocated = 0;
+    while ((len = getline(&line, &capacity, file)) > 0) {
+        char *tab = strchr(line, '\t');
+        if (!tab) {
+            continue;
+        }
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        if (snapshot->category_count == allocated) {
+            allocated = allocated ? allocated * 2 : 16;
+            struct snapshot_category *categories = realloc(snapshot->categories, sizeof(*categories) * allocated);
+            if (!categories) {
+                break;
+            }
+            snapshot->categories = categories;
+        }
+        snapshot->categories[snapshot->category_count].id = atoi(line);
+        snapshot->categories[snapshot->category_count].label = strdup(tab + 1);
+        snapshot->category_count++;
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+/**
+ * @brief Map a snapshot written by snapshot_export for reading.
+ *
+ * @param snapshot Receives the snapshot, to be released with snapshot_close.
+ * @param dir The snapshot directory.
+ * @param err Where to write why the snapshot cannot be read.
+ * @return 0 on success, -1 if the directory does not hold a complete snapshot.
+ */
+int snapshot_open(struct snapshot *snapshot, const char *dir, FILE *err) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    struct snapshot_meta meta;
+    if (read_meta(dir, &meta) != 0) {
+        fprintf(err, "No snapshot in %s (run export --format=columnar --output=%s)\n", dir, dir);
+        return -1;
+    }
+    snapshot->rows = meta.rows;
+    snapshot->descriptions = meta.descriptions;
+    snapshot->last_id = meta.last_id;
+    snapshot->day = map_column(snapshot, dir, COLUMN_DAY, &meta);
+    snapshot->cents = map_column(snapshot, dir, COLUMN_CENTS, &meta);
+    snapshot->category_id = map_column(snapshot, dir, COLUMN_CATEGORY, &meta);
+    snapshot->description = map_column(snapshot, dir, COLUMN_DESCRIPTION, &meta);
+    snapshot->blocks = map_column(snapshot, dir, COLUMN_BLOCKS, &meta);
+    snapshot->dictionary_offsets = map_column(snapshot, dir, COLUMN_DICTIONARY_OFFSETS, &meta);
+    snapshot->dictionary = map_column(snapshot, dir, COLUMN_DICTIONARY, &meta);
+    if (!snapshot->day || !snapshot->cents || !snapshot->category_id || !snapshot->description || !snapshot->blocks ||
+        !snapshot->dictionary_offsets || !snapshot->dictionary || load_categories(snapshot, dir) != 0) {
+        fprintf(err, "Snapshot in %s is incomplete or damaged\n", dir);
+        snapshot_close(snapshot);
+        return -1;
+    }
+    for (int i = 0; i < COLUMN_COUNT; i++) {
+        posix_madvise(snapshot->maps[i], snapshot->map_sizes[i], POSIX_MADV_WILLNEED);
+    }
+    return 0;
+}
+
+/**
+ * @brief Unmap a snapshot.
+ */
+void snapshot_close(struct snapshot *snapshot) {
+    for (int i = 0; i < COLUMN_COUNT; i++) {
+        if (snapshot->maps[i]) {
+            munmap(snapshot->maps[i], snapshot->map_sizes[i]);
+        }
+    }
+    for (int i = 0; i < snapshot->category_count; i++) {
+        free(snapshot->categories[i].label);
+    }
+    free(snapshot->categories);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
@@ -0,0 +1,54 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// Rows summarized by one entry of the block statistics
+#define SNAPSHOT_BLOCK_ROWS 65536
+
+/**
+ * @brief Smallest and largest day of a block of SNAPSHOT_BLOCK_ROWS rows.
+ */
+struct snapshot_block {
+    int32_t min_day;
+    int32_t max_day;
+};
+
+/**
+ * @brief A category as exported with the snapshot.
+ */
+struct snapshot_category {
+    int id;
+    char *label;
+};
+
+/**
+ * @brief A memory-mapped columnar snapshot of the transactions table.
+ *
+ * Row i of the snapshot is day[i], cents[i], category_id[i] and the description with dictionary
+ * id description[i]. Rows are in transaction id order.
+ */
+struct snapshot {
+    size_t rows;
+    size_t descriptions;                   /**< Entries in the description dictionary. */
+    int64_t last_id;                       /**< Highest transaction id exported. */
+    const int32_t *day;
+    const int64_t *cents;
+    const int32_t *category_id;
+    const uint32_t *description;
+    const struct snapshot_block *blocks;   /**< (rows + SNAPSHOT_BLOCK_ROWS - 1) / SNAPSHOT_BLOCK_ROWS entries. */
+    const uint64_t *dictionary_offsets;    /**< Offset of each description in dictionary. */
+    const char *dictionary;                /**< NUL-terminated descriptions, back to back. */
+    struct snapshot_category *categories;
+    int category_count;
+    void *maps[7];
+    size_t map_sizes[7];
+};
+
+int snapshot_export(const char *dir, int full);
+int snapshot_open(struct snapshot *snapshot, const char *dir, FILE *err);
+void snapshot_close(struct snapshot *snapshot);
+
+#endif